@@ -133,6 +133,7 @@ bool me_nozap_driver_PL2303::start(IOService *provider)
     enum pl2303_type type = type_1;
     
     OSNumber *release;
+    OSNumber *number;
     
     fTerminate = false;     // Make sure we don't think we're being terminated
     fPort = NULL;
@@ -140,8 +141,35 @@ bool me_nozap_driver_PL2303::start(IOService *provider)
     fpInterface = NULL;
     
     fpinterruptPipeBuffer = NULL;
-    fPipeInBuffer = NULL;
-    fPipeOutBuffer = NULL;
+    bzero( fReadRequests, sizeof(fReadRequests) );
+    fReadCount = 0;
+    fReadHead = 0;
+    fReadDelivering = false;
+    fLineErrors = 0;
+    fLineErrorPosition = 0;
+    fRXTime = 0;
+    bzero( fWriteRequests, sizeof(fWriteRequests) );
+    fWriteCount = 0;
+    fWriteNext = 0;
+    fWritesInFlight = 0;
+    fWriteSubmitting = false;
+    fWriteAgain = false;
+    fWriteFlush = false;
+    fWriteTimerArmed = false;
+    fWriteTimer = NULL;
+    fLineCodingValid = false;
+    fLineCodingPending = false;
+    fLineTimer = NULL;
+    fWakeTimer = NULL;
+    bzero( fControlRequests, sizeof(fControlRequests) );
+    fControlHead = 0;
+    fControlCount = 0;
+    fControlBusy = false;
+    fControlLines = 0;
+    fControlLinesValid = false;
+    fBreakOnTime = 0;
+    fControlWaiters = 0;
+    fAllocations = 0;
     
     fpDevice = NULL;
     fpInPipe = NULL;
@@ -211,7 +239,33 @@ bool me_nozap_driver_PL2303::start(IOService *provider)
 	
     fCommandGate->enable();
     
-    release = (OSNumber *) fpDevice->getProperty(kUSBDeviceReleaseNumber);
+    fWriteTimer = IOTimerEventSource::timerEventSource( this, writeTimeout );
+    if ( !fWriteTimer || (fWorkLoop->addEventSource( fWriteTimer ) != kIOReturnSuccess) )
+    {
+        IOLog("%s(%p)::start - create write timer failed\n", getName(), this);
+        goto Fail;
+    }
+    
+    fLineTimer = IOTimerEventSource::timerEventSource( this, lineTimeout );
+    if ( !fLineTimer || (fWorkLoop->addEventSource( fLineTimer ) != kIOReturnSuccess) )
+    {
+        IOLog("%s(%p)::start - create line coding timer failed\n", getName(), this);
+        goto Fail;
+    }
+    
+    fWakeTimer = IOTimerEventSource::timerEventSource( this, wakeTimeout );
+    if ( !fWakeTimer || (fWorkLoop->addEventSource( fWakeTimer ) != kIOReturnSuccess) )
+    {
+        IOLog("%s(%p)::start - create wakeup timer failed\n", getName(), this);
+        goto Fail;
+    }
+    
+    release = OSDynamicCast( OSNumber, fpDevice->getProperty(kUSBDeviceReleaseNumber) );
+    if ( !release )
+    {
+        IOLog("%s(%p)::start - no device release number\n", getName(), this);
+        goto Fail;
+    }
     
 	DEBUG_IOLog(1,"%s(%p)::start - Get device version: %p \n", getName(), this, release->unsigned16BitValue() );
 	
@@ -235,6 +289,13 @@ bool me_nozap_driver_PL2303::start(IOService *provider)
 	
     fPort->type = type;
     
+    // Resolve the quirks once, the completions only test the flags
+    fPort->Quirks = deviceQuirks( fpDevice->GetVendorID(), fpDevice->GetProductID(), release->unsigned16BitValue() );
+    number = OSDynamicCast( OSNumber, getProperty( kQuirksKey ) );
+    if ( number )
+        fPort->Quirks |= number->unsigned32BitValue();
+    DEBUG_IOLog(1,"%s(%p)::start - quirks: 0x%x \n", getName(), this, fPort->Quirks );
+    
 	fUSBStarted = true;
 	
 	DEBUG_IOLog(3,"%s(%p)::start - Allocate resources \n", getName(), this);
@@ -248,6 +309,27 @@ Fail:
 	{
 		destroyNub();
 	}
+    if (fWriteTimer)
+    {
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fWriteTimer);
+        fWriteTimer->release();
+        fWriteTimer = NULL;
+    }
+    if (fLineTimer)
+    {
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fLineTimer);
+        fLineTimer->release();
+        fLineTimer = NULL;
+    }
+    if (fWakeTimer)
+    {
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fWakeTimer);
+        fWakeTimer->release();
+        fWakeTimer = NULL;
+    }
     if (fCommandGate)
     {
         fCommandGate->release();
@@ -286,6 +368,30 @@ void me_nozap_driver_PL2303::stop( IOService *provider )
     CheckSerialState();         // turn serial off, release resources
 	DEBUG_IOLog(5,"%s(%p)::stop  CheckSerialState succeed\n", getName(), this);
     
+    if (fWriteTimer)
+    {
+        fWriteTimer->cancelTimeout();
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fWriteTimer);
+        fWriteTimer->release();
+        fWriteTimer = NULL;
+    }
+    if (fLineTimer)
+    {
+        fLineTimer->cancelTimeout();
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fLineTimer);
+        fLineTimer->release();
+        fLineTimer = NULL;
+    }
+    if (fWakeTimer)
+    {
+        fWakeTimer->cancelTimeout();
+        if (fWorkLoop)
+            fWorkLoop->removeEventSource(fWakeTimer);
+        fWakeTimer->release();
+        fWakeTimer = NULL;
+    }
     if (fCommandGate)
     {
         fCommandGate->release();
@@ -347,8 +453,9 @@ IOWorkLoop* me_nozap_driver_PL2303::getWorkLoop() const
 //      Method:     me_nozap_driver_PL2303::privateWatchState
 //
 //      Inputs:     port - the specified port, state - state watching for, mask - state mask (the specific bits)
+//                  deadline - uptime to give up at, 0 waits forever
 //
-//      Outputs:    IOReturn - kIOReturnSuccess, kIOReturnIOError or kIOReturnIPCError
+//      Outputs:    IOReturn - kIOReturnSuccess, kIOReturnIOError, kIOReturnTimeout or kIOReturnIPCError
 //
 //      Desc:       Wait for the at least one of the state bits defined in mask to be equal
 //                  to the value defined in state. Check on entry then sleep until necessary.
@@ -356,14 +463,17 @@ IOWorkLoop* me_nozap_driver_PL2303::getWorkLoop() const
 //                  bits specified by mask is equal to the value passed in by state.  A return
 //                  value of kIOReturnIOError indicates that the port went inactive.  A return
 //                  value of kIOReturnIPCError indicates sleep was interrupted by a signal.
+//                  kIOReturnTimeout means the deadline passed first.
 //
 /****************************************************************************************************/
 
-IOReturn me_nozap_driver_PL2303::privateWatchState( PortInfo_t *port, UInt32 *state, UInt32 mask )
+IOReturn me_nozap_driver_PL2303::privateWatchState( PortInfo_t *port, UInt32 *state, UInt32 mask, UInt64 deadline )
 {
-    unsigned            watchState, foundStates;
+    unsigned            watchState, foundStates, current;
     bool                autoActiveBit   = false;
+    bool                woken           = false;
     IOReturn            rtn             = kIOReturnSuccess;
+    StateWaiter         waiter;
 	
     DEBUG_IOLog(4,"%s(%p)::privateWatchState\n", getName(), this);
 	
@@ -380,18 +490,24 @@ IOReturn me_nozap_driver_PL2303::privateWatchState( PortInfo_t *port, UInt32 *st
 		autoActiveBit = true;
 	}
 	
+    // Register before the first check so a change in between still wakes us
+    IOLockLock( port->serialRequestLock );
+    addStateWaiter( &port->Waiters, &waiter, mask );
+    IOLockUnlock( port->serialRequestLock );
+    
     for (;;)
     {
 	    // Check port state for any interesting bits with watchState value
 	    // NB. the '^ ~' is a XNOR and tests for equality of bits.
-		DEBUG_IOLog(4,"%s(%p)::privateWatchState :watchState %p port->State %p mask %p\n", getName(), this, watchState,port->State,mask );
+		current = readPortState( port );
+		DEBUG_IOLog(4,"%s(%p)::privateWatchState :watchState %p port->State %p mask %p\n", getName(), this, watchState,current,mask );
         
-		foundStates = (watchState ^ ~port->State) & mask;
+		foundStates = stateFound( watchState, current, mask );
 		DEBUG_IOLog(4,"%s(%p)::privateWatchState :foundStates %p \n", getName(), this, foundStates );
         
 		if ( foundStates )
 		{
-			*state = port->State;
+			*state = current;
 			if ( autoActiveBit && (foundStates & PD_S_ACTIVE) )
 			{
 				rtn = kIOReturnIOError;
@@ -400,14 +516,36 @@ IOReturn me_nozap_driver_PL2303::privateWatchState( PortInfo_t *port, UInt32 *st
 			}
 			break;
 		}
-		port->WatchStateMask |= mask;
+        
+        if ( woken )
+            port->SpuriousWakeups++;
+        
+        // A change after the check above marked us woken, look again instead of
+        // sleeping through it. From here on changeState knows we may be asleep.
+        IOLockLock( port->serialRequestLock );
+        woken = !stateWaiterSleep( &waiter );
+        IOLockUnlock( port->serialRequestLock );
+        if ( woken )
+        {
+            woken = false;
+            continue;
+        }
         
 		retain();							// Just to make sure all threads are awake
 		fCommandGate->retain();					// before we're released
         
-		rtn = fCommandGate->commandSleep((void *)&port->State);
+		if ( deadline )
+			rtn = fCommandGate->commandSleep((void *)&waiter, deadline, THREAD_ABORTSAFE);
+		else
+			rtn = fCommandGate->commandSleep((void *)&waiter);
+        
+		fCommandGate->release();
+		release();
+		woken = true;
         
-		fCommandGate->retain();
+        IOLockLock( port->serialRequestLock );
+        stateWaiterAwake( &waiter );
+        IOLockUnlock( port->serialRequestLock );
 		
 		if (rtn == THREAD_TIMED_OUT)
 		{
@@ -420,16 +558,13 @@ IOReturn me_nozap_driver_PL2303::privateWatchState( PortInfo_t *port, UInt32 *st
 				break;
 			}
 		}
-		release();
 		
     }/* end for */
     
-    // As it is impossible to undo the masking used by this
-    // thread, we clear down the watch state mask and wakeup
-    // every sleeping thread to reinitialize the mask before exiting.
-	
-    port->WatchStateMask = 0;
-	fCommandGate->commandWakeup((void *)&port->State);
+    // Only our own entry goes, nobody else needs waking to re-register
+    IOLockLock( port->serialRequestLock );
+    removeStateWaiter( &port->Waiters, &waiter );
+    IOLockUnlock( port->serialRequestLock );
 	DEBUG_IOLog(4,"%s(%p)::privateWatchState end\n", getName(), this);
     
     return rtn;
@@ -454,9 +589,18 @@ bool me_nozap_driver_PL2303::allocateResources( void )
     IOUSBFindEndpointRequest    epReq;      // endPoint request struct on stack
     bool                        goodCall;   // return flag fm Interface call
 	vm_size_t					aBuffSize;
+    UInt32                      maxPacket;
+    UInt32                      readPackets;
+    UInt32                      i;
+    OSNumber                    *number;
 	
 	DEBUG_IOLog(4,"%s(%p)::allocateResources\n", getName(), this);
 	
+	if (!fPort) {
+	    IOLog("%s(%p)::allocateResources failed - no fPort.\n", getName(), this);
+		goto Fail;
+	}
+	
     // Open all the end points
     if (!fpInterface) {
 	    IOLog("%s(%p)::allocateResources failed - no fpInterface.\n", getName(), this);
@@ -500,7 +644,7 @@ bool me_nozap_driver_PL2303::allocateResources( void )
 	
     // Allocate Memory Descriptor Pointer with memory for the interrupt-in pipe:
 	aBuffSize = INTERRUPT_BUFF_SIZE;
-	if ( (fpDevice->GetVendorID() == SIEMENS_VENDOR_ID ) && (fpDevice->GetProductID() == SIEMENS_PRODUCT_ID_X65) ) {
+	if ( fPort->Quirks & kQuirkShortStatus ) {
         aBuffSize = 1;
         DEBUG_IOLog( 3, "%s(%p)::allocateResources interrupt Buff size = 1\n", getName(), this);
     }
@@ -512,42 +656,149 @@ bool me_nozap_driver_PL2303::allocateResources( void )
     fpinterruptPipeMDP->setLength( aBuffSize );
     fpinterruptPipeBuffer = (UInt8*)fpinterruptPipeMDP->getBytesNoCopy();
     // Allocate Memory Descriptor Pointer with memory for the data-in bulk pipe:
-	
-    fpPipeInMDP = IOBufferMemoryDescriptor::withCapacity( USBLapPayLoad, kIODirectionIn );
-	if (!fpPipeInMDP) {
-	    IOLog("%s(%p)::allocateResources failed - no fpPipeInMDP.\n", getName(), this);
-		goto Fail;
-	}
-    fpPipeInMDP->setLength( USBLapPayLoad );
-    fPipeInBuffer = (UInt8*)fpPipeInMDP->getBytesNoCopy();
+    // a multiple of the max packet size, so the chip can hand over its fifo in one transfer
+	
+    maxPacket = fpInPipe->GetMaxPacketSize();
+    if ( maxPacket == 0 )
+        maxPacket = kDefaultMaxPacketSize;
+    
+    readPackets = fPort->ReadPackets;
+    number = OSDynamicCast( OSNumber, getProperty( kReadPacketsKey ) );
+    if ( number )
+        readPackets = number->unsigned32BitValue();
+    if ( readPackets < 1 )
+        readPackets = 1;
+    if ( readPackets > kMaxReadPackets )
+        readPackets = kMaxReadPackets;
+    
+    fPort->ReadSize = readPackets * maxPacket;
+    fPort->ReadPacketSize = maxPacket;
+    DEBUG_IOLog(3,"%s(%p)::allocateResources bulk-in transfer size: %d (%d x %d)\n", getName(), this, fPort->ReadSize, readPackets, maxPacket);
+    
+    // One descriptor per outstanding read
+    fReadCount = fPort->ReadAhead;
+    number = OSDynamicCast( OSNumber, getProperty( kReadAheadKey ) );
+    if ( number )
+        fReadCount = number->unsigned32BitValue();
+    if ( fReadCount < 1 )
+        fReadCount = 1;
+    if ( fReadCount > kMaxReadAhead )
+        fReadCount = kMaxReadAhead;
+    fPort->ReadAhead = fReadCount;          // the RX marks leave room for all of them
+    
+    for ( i = 0; i < fReadCount; i++ )
+    {
+        ReadRequest *request = &fReadRequests[i];
+        
+        request->MDP = IOBufferMemoryDescriptor::withCapacity( fPort->ReadSize, kIODirectionIn );
+        if (!request->MDP) {
+            IOLog("%s(%p)::allocateResources failed - no read MDP %d.\n", getName(), this, i);
+            goto Fail;
+        }
+        request->MDP->setLength( fPort->ReadSize );
+        request->Buffer = (UInt8*)request->MDP->getBytesNoCopy();
+        request->Completion.target      = this;
+        request->Completion.action      = dataReadComplete;
+        request->Completion.parameter   = request;
+        request->Pending = false;
+        request->Done = false;
+    }
+    fReadHead = 0;
+    fReadDelivering = false;
+    fLineErrors = 0;
+    fLineErrorPosition = 0;
+    fRXTime = 0;
+    fPort->RXErrors.Added = fPort->RXErrors.Removed = 0;
 	
     // Allocate Memory Descriptor Pointer with memory for the data-out bulk pipe:
 	
-    fpPipeOutMDP = IOBufferMemoryDescriptor::withCapacity( MAX_BLOCK_SIZE, kIODirectionOut );
-	if (!fpPipeOutMDP) {
-	    IOLog("%s(%p)::allocateResources failed - no fpPipeOutMDP.\n", getName(), this);
-		goto Fail;
-	}
-    fpPipeOutMDP->setLength( MAX_BLOCK_SIZE );
-    fPipeOutBuffer = (UInt8*)fpPipeOutMDP->getBytesNoCopy();
+    fWriteCount = fPort->WriteBuffers;
+    number = OSDynamicCast( OSNumber, getProperty( kWriteBuffersKey ) );
+    if ( number )
+        fWriteCount = number->unsigned32BitValue();
+    if ( fWriteCount < 1 )
+        fWriteCount = 1;
+    if ( fWriteCount > kMaxWriteBuffers )
+        fWriteCount = kMaxWriteBuffers;
+    
+    for ( i = 0; i < fWriteCount; i++ )
+    {
+        WriteRequest *request = &fWriteRequests[i];
+        
+        request->MDP = IOBufferMemoryDescriptor::withCapacity( MAX_BLOCK_SIZE, kIODirectionOut );
+        if (!request->MDP) {
+            IOLog("%s(%p)::allocateResources failed - no write MDP %d.\n", getName(), this, i);
+            goto Fail;
+        }
+        request->MDP->setLength( MAX_BLOCK_SIZE );
+        request->Buffer = (UInt8*)request->MDP->getBytesNoCopy();
+        request->Completion.target      = this;
+        request->Completion.action      = dataWriteComplete;
+        request->Completion.parameter   = request;
+        request->Count = 0;
+        request->Pending = false;
+    }
+    fWriteNext = 0;
+    fWritesInFlight = 0;
+    fWriteSubmitting = false;
+    fWriteAgain = false;
+    
+    fPort->WritePacketSize = fpOutPipe->GetMaxPacketSize();
+    if ( fPort->WritePacketSize == 0 )
+        fPort->WritePacketSize = kDefaultMaxPacketSize;
+    
+    number = OSDynamicCast( OSNumber, getProperty( kWriteBatchKey ) );
+    if ( number )
+        fPort->WriteBatch = number->unsigned32BitValue();
+    if ( fPort->WriteBatch < 1 )
+        fPort->WriteBatch = 1;
+    if ( fPort->WriteBatch > MAX_BLOCK_SIZE )
+        fPort->WriteBatch = MAX_BLOCK_SIZE;
+    
+    number = OSDynamicCast( OSNumber, getProperty( kWriteDelayKey ) );
+    if ( number )
+        fPort->WriteDelay = number->unsigned32BitValue();
+    if ( fPort->WriteDelay > kMaxWriteDelay )
+        fPort->WriteDelay = kMaxWriteDelay;
+    
+    number = OSDynamicCast( OSNumber, getProperty( kWriteThresholdKey ) );
+    if ( number )
+        fPort->WriteThreshold = number->unsigned32BitValue();
+    if ( fPort->WriteThreshold < 1 )
+        fPort->WriteThreshold = 1;
+    if ( fPort->WriteThreshold > MAX_BLOCK_SIZE )
+        fPort->WriteThreshold = MAX_BLOCK_SIZE;
+    fWriteFlush = false;
+    fWriteTimerArmed = false;
+
+    number = OSDynamicCast( OSNumber, getProperty( kVerifyLineCodingKey ) );
+    if ( number )
+        fPort->VerifyLineCoding = (number->unsigned32BitValue() != 0);
     
     // set up the completion info for all three pipes
     
-	if (!fPort) {
-	    IOLog("%s(%p)::allocateResources failed - no fPort.\n", getName(), this);
-		goto Fail;
-	}
     finterruptCompletionInfo.target = this;
     finterruptCompletionInfo.action = interruptReadComplete;
     finterruptCompletionInfo.parameter  = fPort;
     
-    fReadCompletionInfo.target  = this;
-    fReadCompletionInfo.action  = dataReadComplete;
-    fReadCompletionInfo.parameter   = fPort;
-	
-    fWriteCompletionInfo.target = this;
-    fWriteCompletionInfo.action = dataWriteComplete;
-    fWriteCompletionInfo.parameter  = fPort;
+    fControlCompletion.target       = this;
+    fControlCompletion.action       = controlRequestComplete;
+    fControlCompletion.parameter    = NULL;
+    
+    // A request the last stopSerial left on the bus would complete into the new queue
+    if ( !drainControlRequests() )
+    {
+		IOLog("%s(%p)::allocateResources default pipe still busy\n", getName(), this);
+		goto Fail;
+    }
+    fControlHead = 0;
+    fControlCount = 0;
+    fControlBusy = false;
+    fControlLinesValid = false;
+    
+    // A fresh start, the device has not seen any line coding from us yet
+    fLineCodingValid = false;
+    fLineCodingPending = false;
 	
 	if( setSerialConfiguration() ){
 		IOLog("%s(%p)::allocateResources setSerialConfiguration failed\n", getName(), this);
@@ -584,15 +835,23 @@ void me_nozap_driver_PL2303::releaseResources( void )
 		fpInterface->close( this );
     }
     
-    if ( fpPipeOutMDP  ) {
-		fpPipeOutMDP->release();
-		fpPipeOutMDP    = 0;
+    for ( UInt32 i = 0; i < kMaxWriteBuffers; i++ ) {
+        if ( fWriteRequests[i].MDP ) {
+            fWriteRequests[i].MDP->release();
+            fWriteRequests[i].MDP       = 0;
+            fWriteRequests[i].Buffer    = 0;
+        }
     }
+    fWriteCount = 0;
     
-    if ( fpPipeInMDP   ) {
-		fpPipeInMDP->release();
-		fpPipeInMDP     = 0;
+    for ( UInt32 i = 0; i < kMaxReadAhead; i++ ) {
+        if ( fReadRequests[i].MDP ) {
+            fReadRequests[i].MDP->release();
+            fReadRequests[i].MDP    = 0;
+            fReadRequests[i].Buffer = 0;
+        }
     }
+    fReadCount = 0;
     
     if ( fpinterruptPipeMDP ) {
 		fpinterruptPipeMDP->release();
@@ -642,7 +901,7 @@ bool me_nozap_driver_PL2303::startSerial()
 		goto	Fail;
 	}
 	
-	buf = (char *) IOMalloc(10);
+	buf = (char *) allocBuffer(10);
     if (!buf) {
 		IOLog("%s(%p)::startSerial could not alloc memory for buf\n", getName(), this);
 		goto	Fail;
@@ -658,7 +917,7 @@ request.wValue =  c; \
 request.wIndex = d; \
 request.wLength = 1; \
 request.pData = buf; \
-rtn =  fpDevice->DeviceRequest(&request); \
+rtn =  deviceRequest(&request); \
 DEBUG_IOLog(5,"%s(%p)::startSerial FISH 0x%x:0x%x:0x%x:0x%x  %d - %x\n", getName(), this,a,b,c,d,rtn,buf[0]);
     
 #define SOUP(a,b,c,d)								\
@@ -668,7 +927,7 @@ request.wValue =  c; \
 request.wIndex = d; \
 request.wLength = 0; \
 request.pData = NULL; \
-rtn =  fpDevice->DeviceRequest(&request); \
+rtn =  deviceRequest(&request); \
 DEBUG_IOLog(5,"%s(%p)::startSerial SOUP 0x%x:0x%x:0x%x:0x%x  %d\n", getName(), this,a,b,c,d,rtn);
     
     
@@ -694,7 +953,7 @@ DEBUG_IOLog(5,"%s(%p)::startSerial SOUP 0x%x:0x%x:0x%x:0x%x  %d\n", getName(), t
 		SOUP (VENDOR_WRITE_REQUEST_TYPE, VENDOR_WRITE_REQUEST, 2, 0x24);
 	}
 	
-    IOFree(buf, 10);
+    freeBuffer(buf, 10);
 	
 	// open the pipe endpoints
 	if (!allocateResources() ) {
@@ -715,16 +974,25 @@ void me_nozap_driver_PL2303::stopSerial( bool resetDevice )
 {
     
 	DEBUG_IOLog(1,"%s(%p)::stopSerial\n", getName(), this);
+    if (fWriteTimer)
+        fWriteTimer->cancelTimeout();       // nothing left to combine
+    if (fLineTimer)
+        fLineTimer->cancelTimeout();
+    fLineCodingPending = false;
+    drainControlRequests();                 // let the last modem line change reach the device
     stopPipes();                            // stop reading on the usb pipes
     
-    if (fpPipeOutMDP != NULL)               // better test for releaseResources?
+    if (fWriteCount != 0)                   // better test for releaseResources?
     {
 		releaseResources( );
     }
     
 	
     
-	DEBUG_IOLog(1,"%s(%p)::stopSerial stopSerial succeed\n", getName(), this);
+	DEBUG_IOLog(1,"%s(%p)::stopSerial stopSerial succeed, %d allocations, %d bulk-out transfers, %d control transfers, %d DTR/RTS updates sent, %d unchanged, %d spurious wakeups, %d of %d queue checks changed state, %d late line errors\n", getName(), this, fAllocations,
+               fPort ? fPort->TXTransfers : 0, fPort ? fPort->ControlTransfers : 0, fPort ? fPort->ControlLineWrites : 0, fPort ? fPort->ControlLineSkips : 0,
+               fPort ? fPort->SpuriousWakeups : 0, fPort ? fPort->QueueUpdates : 0, fPort ? fPort->QueueChecks : 0,
+               fPort ? fPort->LateLineErrors : 0);
     
 Fail:
     return;
@@ -1054,7 +1322,8 @@ void me_nozap_driver_PL2303::SetStructureDefaults( PortInfo_t *port, bool Init )
 		port->IERmask           = 0x00;
 		
 		port->State             = ( PD_S_TXQ_EMPTY | PD_S_TXQ_LOW_WATER | PD_S_RXQ_EMPTY | PD_S_RXQ_LOW_WATER );
-		port->WatchStateMask    = 0x00000000;
+		port->Waiters           = NULL;
+		port->SpuriousWakeups   = 0;
 		port->lineState			= 0x00;
         //		port->serialRequestLock = 0;
     }
@@ -1071,13 +1340,21 @@ void me_nozap_driver_PL2303::SetStructureDefaults( PortInfo_t *port, bool Init )
     port->TXOstate          = kXO_Idle;
     port->FrameTOEntry      = NULL;
 	
-    port->RXStats.BufferSize    = kMaxCirBufferSize;
-    port->RXStats.HighWater     = (port->RXStats.BufferSize << 1) / 3;
-    port->RXStats.LowWater      = port->RXStats.HighWater >> 1;
-	
-    port->TXStats.BufferSize    = kMaxCirBufferSize;
-    port->TXStats.HighWater     = (port->RXStats.BufferSize << 1) / 3;
-    port->TXStats.LowWater      = port->RXStats.HighWater >> 1;
+    // Keep the marks in line with the queues that are already allocated
+    port->RXStats.FixedSize     = false;
+    port->RXStats.PendingSize   = 0;
+    port->RXStats.OverRun       = false;
+	
+    port->TXStats.BufferSize    = port->TX.Start ? port->TX.Size : defaultQueueSize( port->BaudRate );
+    port->TXStats.FixedSize     = false;
+    port->TXStats.PendingSize   = 0;
+    port->TXTransfers           = 0;
+    port->ControlTransfers      = 0;
+    port->ControlLineWrites     = 0;
+    port->ControlLineSkips      = 0;
+    port->QueueChecks           = 0;
+    port->QueueUpdates          = 0;
+    port->LateLineErrors        = 0;
     
     port->FlowControl           = (DEFAULT_AUTO | DEFAULT_NOTIFY);
     
@@ -1090,7 +1367,26 @@ void me_nozap_driver_PL2303::SetStructureDefaults( PortInfo_t *port, bool Init )
     port->DTRAsserted			= true;
     
     port->AreTransmitting		= FALSE;
+    
+    if ( Init )
+    {
+        port->ReadPackets       = kDefaultReadPackets;
+        port->ReadSize          = kDefaultReadPackets * kDefaultMaxPacketSize;
+        port->ReadPacketSize    = kDefaultMaxPacketSize;
+        port->ReadAhead         = kDefaultReadAhead;
+        port->WriteBatch        = kDefaultWriteBatch;
+        port->WritePacketSize   = kDefaultMaxPacketSize;
+        port->WriteBuffers      = kDefaultWriteBuffers;
+        port->WriteDelay        = kDefaultWriteDelay;
+        port->WriteThreshold    = kDefaultWriteThreshold;
+        port->VerifyLineCoding  = false;
+    }
 	
+    // The RX size and the marks depend on the rate and the transfer sizes, so they come last
+    port->RXStats.BufferSize    = port->RX.Start ? port->RX.Size : defaultRXQueueSize( port->BaudRate, port->ReadSize, port->ReadAhead * port->ReadSize );
+    setDefaultMarks( &port->RX, &port->RXStats );
+    setDefaultMarks( &port->TX, &port->TXStats );
+    
     for ( tmp=0; tmp < (256 >> SPECIAL_SHIFT); tmp++ )
 		port->SWspecial[ tmp ] = 0;
     
@@ -1124,9 +1420,11 @@ bool me_nozap_driver_PL2303::createSerialStream()
 	
     SetStructureDefaults( fPort, true );            // init the Port structure
     
-    // Allocate the request lock
+    // Allocate the request lock and the RX and TX locks, see PortInfo_t for the order
     fPort->serialRequestLock = IOLockAlloc();   // init lock used to protect code on MP
-    if ( !fPort->serialRequestLock )
+    fPort->RXLock = IOLockAlloc();
+    fPort->TXLock = IOLockAlloc();
+    if ( !fPort->serialRequestLock || !fPort->RXLock || !fPort->TXLock )
 	{
 		return false;
     }
@@ -1192,6 +1490,16 @@ me_nozap_driver_PL2303::destroySerialStream(void)
 		IOLockFree( fPort->serialRequestLock ); // free the Serial Request Lock
 		fPort->serialRequestLock = NULL;
 	}
+    if ( fPort->RXLock )
+	{
+		IOLockFree( fPort->RXLock );
+		fPort->RXLock = NULL;
+	}
+    if ( fPort->TXLock )
+	{
+		IOLockFree( fPort->TXLock );
+		fPort->TXLock = NULL;
+	}
 	
     // Remove all the buffers.
 	
@@ -1214,16 +1522,19 @@ Fail:
 bool me_nozap_driver_PL2303::startPipes( void )
 {
     IOReturn                    rtn;
+    UInt32                      i;
     DEBUG_IOLog(4,"%s(%p)::startPipes\n", getName(), this);
     
     if(!fPort) goto Fail;
-    if(!fpPipeInMDP) goto Fail;
-    if(!fpPipeOutMDP) goto Fail;
+    if(!fReadCount) goto Fail;
+    if(!fWriteCount) goto Fail;
     
-	// Read the data-in bulk pipe
-	rtn = fpInPipe->Read(fpPipeInMDP, &fReadCompletionInfo, NULL );
-    
-    if( !(rtn == kIOReturnSuccess) ) goto Fail;
+	// Read the data-in bulk pipe, all read-ahead requests in index order
+    fReadHead = 0;
+    for ( i = 0; i < fReadCount; i++ )
+    {
+        if ( !submitRead( &fReadRequests[i] ) ) goto Fail;
+    }
     
 	// Read the data-in interrupt pipe
     if(!fPort) goto Fail;
@@ -1244,6 +1555,35 @@ Fail:
 	return false;
 }/* end startPipes */
 
+//
+// queue one bulk-in read, the request moves to the back of the submission order
+//
+bool me_nozap_driver_PL2303::submitRead( ReadRequest *request )
+{
+    IOReturn                    rtn;
+    
+    IOLockLock( fPort->RXLock );
+    request->Pending = true;
+    request->Done = false;
+    // With MinLatency every packet completes on its own instead of filling a large transfer
+    request->Size = fPort->MinLatency ? fPort->ReadPacketSize : fPort->ReadSize;
+    IOLockUnlock( fPort->RXLock );
+    
+    request->MDP->setLength( request->Size );
+    rtn = fpInPipe->Read( request->MDP, &request->Completion, NULL );
+    if ( rtn != kIOReturnSuccess )
+    {
+        DEBUG_IOLog(4,"%s(%p)::submitRead failed %x\n", getName(), this, rtn);
+        IOLockLock( fPort->RXLock );
+        request->Pending = false;
+        IOLockUnlock( fPort->RXLock );
+        return false;
+    }
+    
+    return true;
+    
+}/* end submitRead */
+
 //
 // stop i/o on the pipes
 //
@@ -1296,6 +1636,8 @@ IOReturn me_nozap_driver_PL2303::message( UInt32 type, IOService *provider,  voi
 		case kIOMessageServiceIsTerminated:
 			DEBUG_IOLog(4,"%s(%p)::message - kIOMessageServiceIsTerminated sessions: %p\n", getName(), this,fSessions);
 			
+			fTerminate = true;      // we're being terminated (unplugged), stopSerial and the completions must know
+			
 			if ( fSessions ){
 				stopSerial( false );         // stop serial now
                 
@@ -1319,7 +1661,6 @@ IOReturn me_nozap_driver_PL2303::message( UInt32 type, IOService *provider,  voi
 			
 			DEBUG_IOLog(4,"%s(%p)::message - kIOMessageServiceIsTerminated terminated\n", getName(), this);
             
-			fTerminate = true;      // we're being terminated (unplugged)
 			/* We need to disconnect the user client interface */
 			break;
 			
@@ -1428,22 +1769,15 @@ IOReturn me_nozap_driver_PL2303::message( UInt32 type, IOService *provider,  voi
 //
 //      Outputs:    returnState - current state of the port
 //
-//      Desc:       Reads the current Port->State.
+//      Desc:       Reads the current Port->State, no lock needed.
 //
 /****************************************************************************************************/
 
 UInt32 me_nozap_driver_PL2303::readPortState( PortInfo_t *port )
 {
     UInt32              returnState;
-	DEBUG_IOLog(6,"me_nozap_driver_PL2303::readPortState IOLockLock( port->serialRequestLock );\n" );
-    
-    IOLockLock( port->serialRequestLock );
-	DEBUG_IOLog(6,"me_nozap_driver_PL2303::readPortState port->State\n", returnState );
-    
-	returnState = port->State;
-	DEBUG_IOLog(6,"me_nozap_driver_PL2303::readPortState IOLockUnLock( port->serialRequestLock );\n" );
     
-	IOLockUnlock( port->serialRequestLock);
+	returnState = loadStateWord( &port->State );
 	
 	DEBUG_IOLog(6,"me_nozap_driver_PL2303::readPortState returnstate: %p \n", returnState );
 	
@@ -1468,67 +1802,79 @@ UInt32 me_nozap_driver_PL2303::readPortState( PortInfo_t *port )
 
 void me_nozap_driver_PL2303::changeState( PortInfo_t *port, UInt32 state, UInt32 mask )
 {
-    UInt32              delta;
+    UInt32              delta, old, update;
     DEBUG_IOLog(6,"%s(%p)::changeState\n", getName(), this);
 	
-	DEBUG_IOLog(6,"me_nozap_driver_PL2303::changeState IOLockLock( port->serialRequestLock );\n" );
-    
-	IOLockLock( port->serialRequestLock );
-	
-    
 	DEBUG_IOLog(6,"state before: %p mask %p \n",state,mask);
     
-    state = (port->State & ~mask) | (state & mask); // compute the new state
+    // Masked update without the lock, retried if another thread got in first
+    old = changeStateWord( &port->State, state, mask, &update );
+    state = update;
 	DEBUG_IOLog(6,"state after: %p \n",state);
     
-    delta = state ^ port->State;                    // keep a copy of the diffs
-	DEBUG_IOLog(6,"state port: %p delta %p \n",port->State, delta);
-    
-    port->State = state;
+    delta = state ^ old;                            // keep a copy of the diffs
+	DEBUG_IOLog(6,"state port: %p delta %p \n",old, delta);
     
-    
-	// Wake up all threads asleep on WatchStateMask
+	// Wake up only the threads waiting for one of the bits that changed
 	
-    if ( delta & port->WatchStateMask )
+    if ( delta )
 	{
-		fCommandGate->commandWakeup((void *)&fPort->State);
+        wakeStateWaiters( port, delta );
 	}
     
-    
-	DEBUG_IOLog(6,"me_nozap_driver_PL2303::changeState IOLockUnLock( port->serialRequestLock );\n" );
-    
-    IOLockUnlock( port->serialRequestLock );
-    
 	// if any modem control signals changed, we need to do an setControlLines()
 	
-	if ((mask & PD_RS232_S_DTR) && ((port->FlowControl & PD_RS232_A_DTR) != PD_RS232_A_DTR))
-    {
-        if ((state & PD_RS232_S_DTR) != (fPort->State & PD_RS232_S_DTR))
-        {
-            if (state & PD_RS232_S_DTR)
-            {
-                port->State |= PD_RS232_S_DTR;
-                setControlLines( port );
-                
-            } else {
-                port->State &= ~PD_RS232_S_DTR;
-                setControlLines( port );
-                
-            }
-        }
-    }
-    
 	if (delta & ( PD_RS232_S_DTR | PD_RS232_S_RFR )){
 		DEBUG_IOLog(5,"setControlLines aanroepen\n");
         setControlLines( port );
     }
-    DEBUG_IOLog(6,"%s(%p)::changeState delta: %p Port->State: %p\n", getName(), this, delta, port->State);
+    DEBUG_IOLog(6,"%s(%p)::changeState delta: %p Port->State: %p\n", getName(), this, delta, state);
 	
     return;
     
 }/* end changeState */
 
 
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::wakeStateWaiters
+//
+//      Inputs:     port - the specified port, delta - state bits that changed, 0 to repeat
+//                  the wakeups already due
+//
+//      Outputs:    None
+//
+//      Desc:       Marks the privateWatchState threads waiting for one of the bits woken and
+//                  wakes the ones that went to sleep. Never takes the gate: the USB completions
+//                  call us and must not wait for a gated thread, which may itself be waiting
+//                  for a completion.
+//                  A waiter decides to sleep under the lock but only gets asleep in
+//                  commandSleep, holding the gate. A wakeup from outside the gate can land in
+//                  between and be lost, so it is repeated from the gate by fWakeTimer, which
+//                  can only run once the waiter is asleep.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::wakeStateWaiters( PortInfo_t *port, UInt32 delta )
+{
+    bool    again = false;
+    
+    IOLockLock( port->serialRequestLock );
+    for ( StateWaiter *waiter = port->Waiters; waiter; waiter = waiter->Next )
+    {
+        if ( stateWaiterDue( waiter, delta ) )
+        {
+            fCommandGate->commandWakeup((void *)waiter, true);
+            again = true;
+        }
+    }
+    IOLockUnlock( port->serialRequestLock );
+    
+    if ( again && fWakeTimer && !fWorkLoop->inGate() )
+        fWakeTimer->setTimeoutUS( 1 );
+    
+}/* end wakeStateWaiters */
+
 /****************************************************************************************************/
 //
 //		Method:		me_nozap_driver_PL2303::acquirePort
@@ -1905,7 +2251,8 @@ IOReturn me_nozap_driver_PL2303::watchStateAction(OSObject *owner, void *arg0, v
 //
 //      Method:     me_nozap_driver_PL2303::watchState
 //
-//      Inputs:     state - state to watch for, mask - state mask bits, refCon - the Port
+//      Inputs:     state - state to watch for, mask - state mask bits, deadline - uptime to
+//                  give up at (0 waits forever)
 //
 //      Outputs:    Return Code - kIOReturnSuccess or value returned from ::watchState
 //
@@ -1915,7 +2262,7 @@ IOReturn me_nozap_driver_PL2303::watchStateAction(OSObject *owner, void *arg0, v
 //
 /****************************************************************************************************/
 
-IOReturn me_nozap_driver_PL2303::watchStateGated( UInt32 *state, UInt32 mask)
+IOReturn me_nozap_driver_PL2303::watchStateGated( UInt32 *state, UInt32 mask, UInt64 deadline )
 {
     IOReturn    ret = kIOReturnNotOpen;
     DEBUG_IOLog(4,"%s(%p)::watchStateGated state: %p mask: %p\n", getName(), this, *state, mask);
@@ -1925,7 +2272,12 @@ IOReturn me_nozap_driver_PL2303::watchStateGated( UInt32 *state, UInt32 mask)
 	{
 		ret = kIOReturnSuccess;
 		mask &= EXTERNAL_MASK;
-		ret = privateWatchState( fPort, state, mask );
+        
+        // Someone waits for TX to drain, send what write combining holds back
+        if ( mask & *state & PD_S_TXQ_EMPTY )
+            setUpTransmit( true );
+        
+		ret = privateWatchState( fPort, state, mask, deadline );
 		*state &= EXTERNAL_MASK;
 	}
     
@@ -1950,16 +2302,10 @@ UInt32 me_nozap_driver_PL2303::nextEvent( void *refCon )
     DEBUG_IOLog(4,"%s(%p)::nextEvent\n", getName(), this);
     
 #if FIX_PARITY_PROCESSING
-    UInt8 t = 0;
-    UInt32 qret = peekBytefromQueue( &fPort->RX, &t, 1);
-    if(qret != kQueueEmpty) {
-        if(t == 0xff) {
-            qret = peekBytefromQueue( &fPort->RX, &t, 2);
-            if(qret != kQueueEmpty && t == 0x00) {
-                DEBUG_IOLog(5,"%s(%p)::nextEvent PD_E_INTEGRITY_ERROR\n", getName(), this);
-                return PD_E_INTEGRITY_ERROR;
-            }
-        }
+    UInt32 event;
+    if(getQueueStatus(&fPort->RX) != kQueueEmpty && cleanBytesinRX( &event ) == 0) {
+        DEBUG_IOLog(5,"%s(%p)::nextEvent error 0x%x\n", getName(), this, event);
+        return event;
     }
     
     if(getQueueStatus(&fPort->RX) != kQueueEmpty) {
@@ -2039,7 +2385,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 {
     PortInfo_t  *port = (PortInfo_t *) refCon;
     IOReturn    ret = kIOReturnSuccess;
-    UInt32      state, delta, old;
+    UInt32      state, delta, old, rate;
     int rtn;
 	DEBUG_IOLog(4,"%s(%p)::executeEventGated\n", getName(), this);
     
@@ -2094,7 +2440,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
                 request.wValue =  0;
                 request.wLength = 0;
                 request.pData = NULL;
-                rtn = fpDevice->DeviceRequest(&request);
+                rtn = queueControlRequest(&request);
                 DEBUG_IOLog(1,"%s(%p)::executeEvent - executeEvent - device request: %p \n", getName(), this,  rtn);
 				
                 port->FlowControlState = CONTINUE_SEND;
@@ -2111,7 +2457,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
                 request.wValue =  0;
                 request.wLength = 0;
                 request.pData = NULL;
-                rtn = fpDevice->DeviceRequest(&request);
+                rtn = queueControlRequest(&request);
                 DEBUG_IOLog(1,"%s(%p)::executeEvent - device request: %p \n", getName(), this,  rtn);
 				
                 port->FlowControlState = CONTINUE_SEND;
@@ -2140,7 +2486,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 				{
 					DEBUG_IOLog(1,"%s(%p)::executeEvent - PD_E_FLOW_CONTROL set RTS\n", getName(), this, port->FlowControl );
 					port->RTSAsserted = true;
-					port->State |= PD_RS232_S_RFR;		    // raise RTS again
+					changeState( port, PD_RS232_S_RFR, PD_RS232_S_RFR );		    // raise RTS again
 				}
 				
 				// if switching away from DTR flow control and we've lowered DTR, need to raise it to unblock
@@ -2148,7 +2494,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 				{
 					DEBUG_IOLog(1,"%s(%p)::executeEvent - PD_E_FLOW_CONTROL set DTR\n", getName(), this, port->FlowControl );
 					port->DTRAsserted = true;
-					port->State |= PD_RS232_S_DTR;		    // raise DTR again
+					changeState( port, PD_RS232_S_DTR, PD_RS232_S_DTR );		    // raise DTR again
 				}
                 
                 
@@ -2165,6 +2511,8 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
                 
 			}
             
+            // The queue bits may not move again for a while, apply the new mode now
+            checkQueues( port );
 			break;
 			
 		case PD_E_ACTIVE:
@@ -2183,7 +2531,8 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 					changeState( port, 0, (UInt32)PD_S_ACTIVE );
 				}
 			}
-			if( setSerialConfiguration() ){
+			changeSerialConfiguration();
+			if( commitSerialConfiguration() ){
 				DEBUG_IOLog(4,"%s(%p)::executeEvent Set Serial Configuration failed\n", getName(), this);
 			}
 			
@@ -2213,7 +2562,10 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 			
 		case PD_RS232_E_MIN_LATENCY:
 			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_RS232_E_MIN_LATENCY \n", getName(), this );
+            // Takes effect as reads are resubmitted: one packet per bulk-in transfer
+            IOLockLock( port->RXLock );
 			port->MinLatency = bool( data );
+            IOLockUnlock( port->RXLock );
 			break;
 			
 		case PD_E_DATA_INTEGRITY:
@@ -2227,9 +2579,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 				port->TX_Parity = data;
 				port->RX_Parity = PD_RS232_PARITY_DEFAULT;
 			}
-			if( setSerialConfiguration() ){
-				DEBUG_IOLog(4,"%s(%p)::executeEvent Set Serial Configuration failed\n", getName(), this);
-			}
+			changeSerialConfiguration();
 			break;
 			
 		case PD_E_DATA_RATE:
@@ -2237,15 +2587,32 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 			/* For API compatiblilty with Intel.    */
 			data >>= 1;
 			DEBUG_IOLog(4,"%s(%p)::executeEvent - actual data rate baudrate: %d \n", getName(), this, data );
-			if ( (data < kMinBaudRate) || (data > kMaxBaudRate) )       // Do we really care
+			// Checked against what this chip can do before anything goes to the device
+			rate = supportedBaudRate( port->type, data );
+			if ( !rate || (baudRateError( data, rate ) > kBaudRateTolerance) )
+			{
+				DEBUG_IOLog(4,"%s(%p)::executeEvent - %d bps not supported by chip type %d \n", getName(), this, data, port->type );
 				ret = kIOReturnBadArgument;
+			}
 			else
 			{
-				port->BaudRate = data;
+				if ( rate != data )
+					DEBUG_IOLog(4,"%s(%p)::executeEvent - %d bps rounded to %d \n", getName(), this, data, rate );
+				port->BaudRate = rate;
+                
+                // Keep kCirBufferTimeMS of buffering for the new rate unless the size was set explicitly,
+                // and the default marks in step with the rate either way
+                if ( !port->RXStats.FixedSize )
+                    resizeQueue( &port->RX, &port->RXStats, defaultRXQueueSize( port->BaudRate, port->ReadSize, port->ReadAhead * port->ReadSize ) );
+                else if ( !port->RXStats.FixedMarks )
+                    setDefaultMarks( &port->RX, &port->RXStats );
+                if ( !port->TXStats.FixedSize )
+                    resizeQueue( &port->TX, &port->TXStats, defaultQueueSize( port->BaudRate ) );
+                else if ( !port->TXStats.FixedMarks )
+                    setDefaultMarks( &port->TX, &port->TXStats );
+                checkQueues( port );
 			}
-            if( setSerialConfiguration() ){
-                DEBUG_IOLog(4,"%s(%p)::executeEvent Set Serial Configuration failed\n", getName(), this);
-            }
+            changeSerialConfiguration();
             break;
 			
 		case PD_E_DATA_SIZE:
@@ -2260,9 +2627,7 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 				
 				port->CharLength = data;
 			}
-            if( setSerialConfiguration() ){
-                DEBUG_IOLog(4,"%s(%p)::executeEvent Set Serial Configuration failed\n", getName(), this);
-            }
+            changeSerialConfiguration();
             break;
 			
 		case PD_RS232_E_STOP_BITS:
@@ -2273,16 +2638,14 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 			{
 				port->StopBits = data;
 			}
-            if( setSerialConfiguration() ){
-                DEBUG_IOLog(4,"%s(%p)::executeEvent Set Serial Configuration failed\n", getName(), this);
-            }
+            changeSerialConfiguration();
             break;
 			
 		case PD_E_RXQ_FLUSH:
 			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_FLUSH \n", getName(), this );
 		    flush( &port->RX );
-            //            state = maskMux(state, generateRxQState( port ), (PD_S_RXQ_MASK | kRxAutoFlow));
-            //            delta |= PD_S_RXQ_MASK | kRxAutoFlow;
+            checkRXQueue( port, true );         // now empty: update the RXQ bits, release flow control
+            resizePending( port );
 			break;
 			
 		case PD_E_RX_DATA_INTEGRITY:
@@ -2313,6 +2676,9 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 			
 		case PD_E_TXQ_FLUSH:
 			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_FLUSH\n", getName(), this );
+            // Flush as in push out: what is queued goes to the device now, nothing is discarded
+            setUpTransmit( true );              // don't hold anything back for write combining
+            resizePending( port );
 			break;
 			
 		case PD_RS232_E_LINE_BREAK:
@@ -2333,38 +2699,64 @@ IOReturn me_nozap_driver_PL2303::executeEventGated( UInt32 event, UInt32 data, v
 			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_DELAY\n", getName(), this );
             if (port->BreakState)					// It's the break delay in micro seconds
             {
-                IOSleep(data/1000);
+                breakDelay(data);
             } else {
                 port->CharLatInterval = long2tval(data * 1000);
             }
 			break;
 			
 		case PD_E_RXQ_SIZE:
-			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_SIZE\n", getName(), this );
+			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_SIZE size: %d\n", getName(), this, data );
+            // A size of zero goes back to the default for the current baud rate
+            ret = setQueueSize( &port->RX, &port->RXStats, data ? data : defaultRXQueueSize( port->BaudRate, port->ReadSize, port->ReadAhead * port->ReadSize ) );
+            if ( ret == kIOReturnSuccess )
+                port->RXStats.FixedSize = (data != 0);
+            checkQueues( port );
 			break;
 			
 		case PD_E_TXQ_SIZE:
-			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_SIZE\n", getName(), this );
+			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_SIZE size: %d\n", getName(), this, data );
+            ret = setQueueSize( &port->TX, &port->TXStats, data ? data : defaultQueueSize( port->BaudRate ) );
+            if ( ret == kIOReturnSuccess )
+                port->TXStats.FixedSize = (data != 0);
+            checkQueues( port );
 			break;
 			
 		case PD_E_RXQ_HIGH_WATER:
-			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_HIGH_WATER \n", getName(), this );
-            //            state = maskMux(state, generateRxQState( port ), (PD_S_RXQ_MASK | kRxAutoFlow));
-            //            delta |= PD_S_RXQ_MASK | kRxAutoFlow;
+			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_HIGH_WATER %d\n", getName(), this, data );
+            // Zero goes back to the default marks, otherwise the other mark has to fit around it
+            if ( !data )
+                setDefaultMarks( &port->RX, &port->RXStats );
+            else
+                ret = setWaterMarks( &port->RX, &port->RXStats, port->RXStats.LowWater, data );
+            checkRXQueue( port, true );
 			break;
 			
 		case PD_E_RXQ_LOW_WATER:
-			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_LOW_WATER \n", getName(), this );
-            //            state = maskMux(state, generateRxQState( port ), (PD_S_RXQ_MASK | kRxAutoFlow));
-            //            delta |= PD_S_RXQ_MASK | kRxAutoFlow;
+			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_RXQ_LOW_WATER %d\n", getName(), this, data );
+            if ( !data )
+                setDefaultMarks( &port->RX, &port->RXStats );
+            else
+                ret = setWaterMarks( &port->RX, &port->RXStats, data, port->RXStats.HighWater );
+            checkRXQueue( port, true );
 			break;
 			
 		case PD_E_TXQ_HIGH_WATER:
-			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_HIGH_WATER \n", getName(), this );
+			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_HIGH_WATER %d\n", getName(), this, data );
+            if ( !data )
+                setDefaultMarks( &port->TX, &port->TXStats );
+            else
+                ret = setWaterMarks( &port->TX, &port->TXStats, port->TXStats.LowWater, data );
+            checkTXQueue( port );
 			break;
 			
 		case PD_E_TXQ_LOW_WATER:
-			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_LOW_WATER \n", getName(), this );
+			DEBUG_IOLog(4,"%s(%p)::executeEvent - PD_E_TXQ_LOW_WATER %d\n", getName(), this, data );
+            if ( !data )
+                setDefaultMarks( &port->TX, &port->TXStats );
+            else
+                ret = setWaterMarks( &port->TX, &port->TXStats, data, port->TXStats.HighWater );
+            checkTXQueue( port );
 			break;
 			
 		default:
@@ -2490,26 +2882,22 @@ IOReturn me_nozap_driver_PL2303::requestEventGated( UInt32 event, UInt32 *data,
 				
 			case PD_E_TXQ_LOW_WATER:
 				DEBUG_IOLog(4,"%s(%p)::requestEvent - PD_E_TXQ_LOW_WATER\n", getName(), this);
-				*data = 0;
-				returnValue = kIOReturnBadArgument;
+				*data = (UInt32)port->TXStats.LowWater;
 				break;
 				
 			case PD_E_RXQ_LOW_WATER:
 				DEBUG_IOLog(4,"%s(%p)::requestEvent - PD_E_RXQ_LOW_WATER\n", getName(), this);
-				*data = 0;
-				returnValue = kIOReturnBadArgument;
+				*data = (UInt32)port->RXStats.LowWater;
 				break;
 				
 			case PD_E_TXQ_HIGH_WATER:
 				DEBUG_IOLog(4,"%s(%p)::requestEvent - PD_E_TXQ_HIGH_WATER\n", getName(), this);
-				*data = 0;
-				returnValue = kIOReturnBadArgument;
+				*data = (UInt32)port->TXStats.HighWater;
 				break;
 				
 			case PD_E_RXQ_HIGH_WATER:
 				DEBUG_IOLog(4,"%s(%p)::requestEvent - PD_E_RXQ_HIGH_WATER\n", getName(), this);
-				*data = 0;
-				returnValue = kIOReturnBadArgument;
+				*data = (UInt32)port->RXStats.HighWater;
 				break;
 				
 			case PD_E_TXQ_AVAILABLE:
@@ -2641,7 +3029,7 @@ IOReturn me_nozap_driver_PL2303::enqueueEvent( UInt32 event, UInt32 data, bool s
 			DEBUG_IOLog(2,"%s(%p)::enqueueEvent - PD_E_DELAY time: %d \n", getName(), this, data );
             if (port->BreakState)					// It's the break delay in micro seconds
             {
-                IOSleep(data/1000);
+                breakDelay(data);
             } else {
                 port->CharLatInterval = long2tval(data * 1000);
             }
@@ -2669,21 +3057,65 @@ IOReturn me_nozap_driver_PL2303::enqueueEvent( UInt32 event, UInt32 data, bool s
 //
 //      Inputs:     sleep - true (wait for it), false (don't), refCon - the Port
 //
-//      Outputs:    Return Code - kIOReturnSuccess, kIOReturnNotOpen
+//      Outputs:    Return Code - kIOReturnSuccess, kIOReturnBadArgument, kIOReturnNotOpen
 //
-//      Desc:       Not used by this driver.
+//      Desc:       set up for dequeueEventGated call. It consumes the RX queue, so it runs in
+//                  the gate like dequeueData and PD_E_RXQ_FLUSH.
 //
 /****************************************************************************************************/
 
 IOReturn me_nozap_driver_PL2303::dequeueEvent( UInt32 *event, UInt32 *data, bool sleep, void *refCon )
 {
-	DEBUG_IOLog(4,"%s(%p)::dequeueEvent\n", getName(), this);
+    IOReturn 	ret;
     
-    PortInfo_t *port = (PortInfo_t *) refCon;
+	DEBUG_IOLog(4,"%s(%p)::dequeueEvent\n", getName(), this);
     
     if ( (event == NULL) || (data == NULL) )
 		return kIOReturnBadArgument;
 	
+    retain();
+    ret = fCommandGate->runAction(dequeueEventAction, (void *)event, (void *)data, (void *)sleep, (void *)refCon);
+    release();
+    
+    return ret;
+    
+}/* end dequeueEvent */
+
+/****************************************************************************************************/
+//
+//		Method:		me_nozap_driver_PL2303::dequeueEventAction
+//
+//		Desc:		Dummy pass through for dequeueEventGated.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::dequeueEventAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+	DEBUG_IOLog(4,"me_nozap_driver_PL2303::dequeueEventAction\n");
+    
+    return ((me_nozap_driver_PL2303 *)owner)->dequeueEventGated((UInt32 *)arg0, (UInt32 *)arg1, arg2 != NULL, (void *)arg3);
+    
+}/* end dequeueEventAction */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::dequeueEventGated
+//
+//      Inputs:     sleep - true (wait for it), false (don't), refCon - the Port
+//
+//      Outputs:    event, data - the next RX event and its byte
+//                  Return Code - kIOReturnSuccess, kIOReturnNotOpen
+//
+//      Desc:       Hands out the next RX byte with its error, if any (FIX_PARITY_PROCESSING).
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::dequeueEventGated( UInt32 *event, UInt32 *data, bool sleep, void *refCon )
+{
+	DEBUG_IOLog(4,"%s(%p)::dequeueEventGated\n", getName(), this);
+    
+    PortInfo_t *port = (PortInfo_t *) refCon;
+    
     if ( readPortState( port ) & PD_S_ACTIVE )
 	{
 #ifdef FIX_PARITY_PROCESSING
@@ -2692,33 +3124,25 @@ IOReturn me_nozap_driver_PL2303::dequeueEvent( UInt32 *event, UInt32 *data, bool
         if(*event == PD_E_EOQ)
             return kIOReturnSuccess;
         
+        // A byte with several errors is handed out with each of them, and read with the last
         UInt8 Value;
-        UInt8 rtn = getBytetoQueue(&fPort->RX, &Value);
+        UInt8 rtn;
+        if ( (*event == PD_E_VALID_DATA) || takeRXError( *event ) )
+            rtn = getBytetoQueue(&fPort->RX, &Value);
+        else
+            rtn = peekBytefromQueue(&fPort->RX, &Value, 0);
         if(rtn != kIOReturnSuccess)
             return rtn;
         *data = Value;
         
-        DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueEvent held=[0x%X]\n", Value );
-        
-        if(Value == 0xff) {
-            while(getBytetoQueue(&fPort->RX, &Value) == kQueueEmpty){};
-            DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueEvent purged=[0x%X]\n", Value );
-        }
-        
-        if(*event == PD_E_INTEGRITY_ERROR) {
-            getBytetoQueue(&fPort->RX, &Value); // Purge marker
-            DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueEvent purged=[0x%X]\n", Value );
-            while(getBytetoQueue(&fPort->RX, &Value) == kQueueEmpty)
-                IOSleep(BYTE_WAIT_PENALTY); // in case it is not yet cool
-            DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueEvent purged=[0x%X]\n", Value );
-        }
+        DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueEventGated held=[0x%X]\n", Value );
 #endif
 		return kIOReturnSuccess;
 	}
 	
     return kIOReturnNotOpen;
     
-}/* end dequeueEvent */
+}/* end dequeueEventGated */
 
 /****************************************************************************************************/
 //
@@ -2833,9 +3257,13 @@ IOReturn me_nozap_driver_PL2303::enqueueDataGated( UInt8 *buffer, UInt32 size, U
 		return kIOReturnNotOpen;
 	}
     
+    // Data written after a parameter change must go out with the new line coding
+    commitSerialConfiguration();
+    resizePending( fPort );
+    
 	/* OK, go ahead and try to add something to the buffer  */
     *count = addtoQueue( &fPort->TX, buffer, size );
-    checkQueues( fPort );
+    checkTXQueue( fPort );
 	
 	/* Let the tranmitter know that we have something ready to go   */
     setUpTransmit( );
@@ -2854,7 +3282,7 @@ IOReturn me_nozap_driver_PL2303::enqueueDataGated( UInt8 *buffer, UInt32 size, U
 		}
 		
 		*count += addtoQueue( &fPort->TX, buffer + *count, size - *count );
-		checkQueues( fPort );
+		checkTXQueue( fPort );
 		
 		/* Let the tranmitter know that we have something ready to go.  */
 		
@@ -2900,6 +3328,46 @@ IOReturn me_nozap_driver_PL2303::dequeueData(UInt8 *buffer, UInt32 size, UInt32
 	
 }/* end dequeueData */
 
+/****************************************************************************************************/
+//
+//		Method:		me_nozap_driver_PL2303::rxDeadline
+//
+//		Inputs:		firstByte - uptime at which the current read got its first byte
+//
+//		Outputs:	Return value - uptime at which a blocked read returns what it has, 0 for never
+//
+//		Desc:		Combines the inter-character gap (PD_E_DELAY), counted from the last data
+//					the device delivered, and the data latency (PD_E_DATA_LATENCY), counted
+//					from the first byte of the read.
+//
+/****************************************************************************************************/
+
+UInt64 me_nozap_driver_PL2303::rxDeadline( UInt64 firstByte )
+{
+    UInt64      interval;
+    UInt64      deadline = 0;
+    UInt64      candidate;
+    
+    interval = tval2long( fPort->CharLatInterval );
+    if ( interval )
+    {
+        nanoseconds_to_absolutetime( interval, &candidate );
+        deadline = __atomic_load_n( &fRXTime, __ATOMIC_ACQUIRE ) + candidate;
+    }
+    
+    interval = tval2long( fPort->DataLatInterval );
+    if ( interval )
+    {
+        nanoseconds_to_absolutetime( interval, &candidate );
+        candidate += firstByte;
+        if ( !deadline || (candidate < deadline) )
+            deadline = candidate;
+    }
+    
+    return deadline;
+    
+}/* end rxDeadline */
+
 /****************************************************************************************************/
 //
 //		Method:		me_nozap_driver_PL2303::dequeueDatatAction
@@ -2950,6 +3418,7 @@ IOReturn me_nozap_driver_PL2303::dequeueDataGated( UInt8 *buffer, UInt32 size, U
 {
     IOReturn    rtn = kIOReturnSuccess;
     UInt32      state = 0;
+    UInt64      firstByte = 0;
     CirQueue *Queue;
     
     DEBUG_IOLog(4,"%s(%p)::dequeueDataGated\n", getName(), this);
@@ -2965,53 +3434,33 @@ IOReturn me_nozap_driver_PL2303::dequeueDataGated( UInt8 *buffer, UInt32 size, U
     
     Queue = &fPort->RX;
     
-#if FIX_PARITY_PROCESSING
-    while (*count < size) {
-        UInt8 Value;
-        if(peekBytefromQueue(Queue, &Value, 1) != kQueueEmpty && Value == 0xff) {
-            if (peekBytefromQueue(Queue, &Value, 2) != kQueueEmpty && Value == 0x00) {
-                checkQueues( fPort );
-                return kIOReturnSuccess;
-            }
-        }
-        if( (rtn = getBytetoQueue(Queue, &Value)) != kQueueNoError) {
-            if(rtn == kQueueEmpty)
-                break;
-            IOLog("%s(%p)::dequeueDataGated - INTERRUPTED while reading\n", getName(), this );
-            return rtn;
-        }
-        DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueDataGated held=[0x%X]\n", Value );
-        if(Value == 0xff) {
-            while(getBytetoQueue(Queue, &Value) == kQueueEmpty){}; // Read double 0xff
-            DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueDataGated purged=[0x%X]\n", Value );
-        }
-        *(buffer++) = Value;
-        ++(*count);
-    }
-#else
-    /* Get any data living in the queue.    */
-    *count = removefromQueue( Queue, buffer, size );
-#endif
+    /* Get any data living in the queue, up to a byte with an error.    */
+    *count = removeRXData( buffer, size );
+    if ( *count )
+        clock_get_uptime( &firstByte );
     
-    checkQueues( fPort );
+    checkRXQueue( fPort );
     while ( (min > 0) && (*count < min) )
     {
-
+        /* A byte with an error is next, return so dequeueEvent can report it   */
+        if ( usedSpaceinQueue( Queue ) && (cleanBytesinRX( NULL ) == 0) )
+        {
+            DEBUG_IOLog(4,"%s(%p)::dequeueDataGated error on queue -->Out Dequeue\n", getName(), this);
+            break;
+        }
         
         /* Figure out how many bytes we have left to queue up */
-        DEBUG_IOLog(4,"%s(%p)::dequeueDataGated - min: %d count: %d size: %d SizeQueue: %d InQueue: %d \n", getName(), this,min,*count, (size - *count), Queue->Size, Queue->InQueue );
+        DEBUG_IOLog(4,"%s(%p)::dequeueDataGated - min: %d count: %d size: %d SizeQueue: %d InQueue: %d \n", getName(), this,min,*count, (size - *count), Queue->Size, usedSpaceinQueue( Queue ) );
         
-#if FIX_PARITY_PROCESSING
-        /* Always prefer waiting for HIGH_WATER to waiting a little bit more for not empty queue */
-        state = PD_S_RXQ_HIGH_WATER;
-        rtn = watchStateGated( &state, PD_S_RXQ_EMPTY | PD_S_RXQ_HIGH_WATER);
-        if(!(state & PD_S_RXQ_HIGH_WATER))
-            IOSleep(BYTE_WAIT_PENALTY);
-#else
+        /* Wake as soon as a read completion has published data, or the latency timers run out */
         state = 0;
-        rtn = watchStateGated( &state, PD_S_RXQ_EMPTY);
-#endif
+        rtn = watchStateGated( &state, PD_S_RXQ_EMPTY, *count ? rxDeadline( firstByte ) : 0 );
         
+        if ( rtn == kIOReturnTimeout )
+        {
+            DEBUG_IOLog(4,"%s(%p)::dequeueDataGated - line idle, returning %d bytes\n", getName(), this, *count );
+            break;
+        }
         if ( rtn != kIOReturnSuccess )
         {
             IOLog("%s(%p)::dequeueDataGated - INTERRUPTED\n", getName(), this );
@@ -3019,38 +3468,14 @@ IOReturn me_nozap_driver_PL2303::dequeueDataGated( UInt8 *buffer, UInt32 size, U
             return rtn;
         }
         /* Try and get more data starting from where we left off */
-#if FIX_PARITY_PROCESSING
-        while (*count < size) {
-            UInt8 Value;
-            if(peekBytefromQueue(Queue, &Value, 1) != kQueueEmpty && Value == 0xff) {
-                if (peekBytefromQueue(Queue, &Value, 2) != kQueueEmpty && Value == 0x00) {
-                    DEBUG_IOLog(4,"%s(%p)::dequeueDataGated Parity error on queue -->Out Dequeue\n", getName(), this);
-                    checkQueues( fPort );
-                    return kIOReturnSuccess;
-                }
-            }
-            if( (rtn = getBytetoQueue(Queue, &Value)) != kQueueNoError) {
-                if(rtn == kQueueEmpty)
-                    break;
-                IOLog("%s(%p)::dequeueDataGated - INTERRUPTED while reading\n", getName(), this );
-                return rtn;
-            }
-            DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueDataGated held=[0x%X]\n", Value );
-            if(Value == 0xff) {
-                while(getBytetoQueue(Queue, &Value) == kQueueEmpty){}; // Read double 0xff
-                DATA_IOLog(2,"me_nozap_driver_PL2303::dequeueDataGated purged=[0x%X]\n", Value );
-            }
-            *(buffer++) = Value;
-            ++(*count);
-        }
-#else
-        count_read = removefromQueue( &fPort->RX, buffer + *count, (size - *count) );
-        *count += count_read;
-#endif
-        checkQueues( fPort );
+        if ( !*count )
+            clock_get_uptime( &firstByte );
+        *count += removeRXData( buffer + *count, (size - *count) );
+        checkRXQueue( fPort );
         
     }/* end while */
     
+    resizePending( fPort );
     DEBUG_IOLog(4,"%s(%p)::dequeueDataGated -->Out Dequeue\n", getName(), this);
     
     return kIOReturnSuccess;
@@ -3077,7 +3502,8 @@ UInt32 me_nozap_driver_PL2303::getState(void *refCon)
 	PortInfo_t  *port = (PortInfo_t *) refCon;
     UInt32      state;
     
-    checkQueues( port );
+    checkTXQueue( port );
+    checkRXQueue( port );
 	
     state = readPortState( port ) & EXTERNAL_MASK;
     
@@ -3093,50 +3519,46 @@ UInt32 me_nozap_driver_PL2303::getState(void *refCon)
 //
 //      Method:     me_nozap_driver_PL2303::StartTransmission
 //
-//      Inputs:     control_length - Length of control data
-//                  control_buffer - Control data
+//      Inputs:     request - the write request, its buffer already holds the data
 //                  data_length - Length of raw data
-//                  data_buffer - raw data
 //
 //      Outputs:    Return code - kIOReturnSuccess
 //
-//      Desc:       Start the transmisson. If both control and data length is zero then only
-//                  the change byte will be sent.
+//      Desc:       Start the transmisson of a filled write buffer.
 //
 /****************************************************************************************************/
 
-IOReturn me_nozap_driver_PL2303::startTransmit(UInt32 control_length, UInt8 *control_buffer, UInt32 data_length, UInt8 *data_buffer)
+IOReturn me_nozap_driver_PL2303::startTransmit(WriteRequest *request, UInt32 data_length)
 {
     IOReturn    ior;
+    bool        busy;
+    UInt32      timeout;
     
 	DEBUG_IOLog(1,"%s(%p)::StartTransmit\n", getName(), this);
-	if ( data_length != 0 )
-	{
-		bcopy(data_buffer, &fPipeOutBuffer[0], data_length);
-	}
     
-    // add up the total length to send off to the device
-    fCount = control_length + data_length;
-    fpPipeOutMDP->setLength( fCount );
+    request->Count = data_length;
+    request->Retries = 0;
+    request->MDP->setLength( request->Count );
 	
+    // account for it before the completion can run
+    IOLockLock( fPort->TXLock );
+    request->Pending = true;
+    fPort->TXTransfers++;
+    busy = (fWritesInFlight++ == 0);
+    fPort->AreTransmitting = true;
     fWriteActive = true;
-	changeState( fPort, PD_S_TX_BUSY ,PD_S_TX_BUSY );
-	
-    //    UInt32      state, delta;
-    //    delta = 0;
-    //    state = readPortState( port );
-    //	state &= ~PD_S_TX_BUSY;
-    //	delta |= PD_S_TX_BUSY;
-    //	setStateGated(state, delta, port);
-	
+    IOLockUnlock( fPort->TXLock );
+    
+    if ( busy )
+        changeState( fPort, PD_S_TX_BUSY ,PD_S_TX_BUSY );
 	
 #ifdef DATALOG
 	UInt8 *buf;
 	UInt32 buflen;
-	buflen = fCount;
-	buf = &fPipeOutBuffer[0];
+	buflen = request->Count;
+	buf = &request->Buffer[0];
 	
-	DATA_IOLog(1,"me_nozap_driver_PL2303: Send (bytes %d): ",fCount);
+	DATA_IOLog(1,"me_nozap_driver_PL2303: Send (bytes %d): ",request->Count);
 	while ( buflen ){
 		unsigned char c = *buf;
 		DATA_IOLog(1,"[%02x] ",c);
@@ -3145,8 +3567,24 @@ IOReturn me_nozap_driver_PL2303::startTransmit(UInt32 control_length, UInt8 *con
 	}
     
 #endif
-    ior = fpOutPipe->Write( fpPipeOutMDP, 1000, 1000, &fWriteCompletionInfo );  // 1 second timeouts
+    // A whole batch takes seconds at low rates, give it the time the line needs
+    timeout = writeTimeoutMS( request->Count, fPort->BaudRate );
+    ior = fpOutPipe->Write( request->MDP, timeout, timeout, &request->Completion );
     DEBUG_IOLog(1,"%s(%p)::StartTransmit return value %d\n", getName(), this, ior);
+    
+    if ( ior != kIOReturnSuccess )
+    {
+        IOLockLock( fPort->TXLock );
+        request->Pending = false;
+        fPort->TXTransfers--;
+        busy = (--fWritesInFlight != 0);
+        fPort->AreTransmitting = busy;
+        fWriteActive = busy;
+        IOLockUnlock( fPort->TXLock );
+        
+        if ( !busy )
+            changeState( fPort, 0, PD_S_TX_BUSY );
+    }
     return ior;
     
 }/* end StartTransmission */
@@ -3167,41 +3605,80 @@ void me_nozap_driver_PL2303::dataWriteComplete( void *obj, void *param, IOReturn
 {
     
     me_nozap_driver_PL2303  *me = (me_nozap_driver_PL2303*)obj;
-	DEBUG_IOLog(1,"me_nozap_driver_PL2303::dataWriteComplete return code c: %d, fcount: %d,  remaining: %d\n", rc, me->fCount,remaining );
-    
-    // Boolean done = true;                // write really finished?  // use is commented out below.
-    me->fWriteActive = false;
-    // BJA we zijn nu klaar dus zet TX BUSY weer uit
-    me->changeState( me->fPort, 0, PD_S_TX_BUSY );
-	me->fPort->AreTransmitting = false;
-	if (me->fTerminate)
-        return;
-	
-    
+    WriteRequest            *request = (WriteRequest*)param;
+    PortInfo_t              *port = me->fPort;
+    bool                    busy;
+    bool                    resend;
+    UInt32                  timeout;
+	DEBUG_IOLog(1,"me_nozap_driver_PL2303::dataWriteComplete return code c: %d, fcount: %d,  remaining: %d\n", rc, request->Count,remaining );
     
     // in a transmit complete, but need to manually transmit a zero-length packet
     // if it's a multiple of the max usb packet size for the bulk-out pipe (64 bytes)
     
-    if ( rc == kIOReturnSuccess )   // If operation returned ok
+    if ( (rc == kIOReturnSuccess) && !me->fTerminate )
     {
+		if ( request->Count > 0 )                   // Check if it was not a zero length write
+		{
+			if ( (request->Count % port->WritePacketSize) == 0 )    // If was a multiple of the packet size then we need to do a zero length write
+			{
+				request->MDP->setLength( 0 );
+				request->Count = 0;
+				if ( me->fpOutPipe->Write( request->MDP, 1000, 1000, &request->Completion ) == kIOReturnSuccess )
+					return;                 // buffer still in flight, complete on the zero length write
+			}
+		}
+    }
+    
+    // Timed out or failed part way: send the rest again, unless a later buffer is already
+    // on the bus. Taking the submitter role keeps setUpTransmit from starting one meanwhile.
+    // An aborted pipe or a device that stopped answering gets nothing more.
+    if ( (rc != kIOReturnSuccess) && (rc != kIOReturnAborted) && (rc != kIOReturnNotResponding) &&
+         !me->fTerminate && remaining && (remaining <= request->Count) )
+    {
+        IOLockLock( port->TXLock );
+        resend = (request->Retries < kWriteRetries) && (me->fWritesInFlight == 1) && !me->fWriteSubmitting;
+        if ( resend )
+            me->fWriteSubmitting = true;
+        IOLockUnlock( port->TXLock );
         
-        //		if ( me->fCount > 0 )                       // Check if it was not a zero length write
-        //		{
-        
-        //			if ( (me->fCount % 64) == 0 )               // If was a multiple of 64 bytes then we need to do a zero length write
-        //			{
-        //				me->changeState( me->fPort, PD_S_TX_BUSY ,PD_S_TX_BUSY );
-        //				me->fWriteActive = true;
-        //				me->fpPipeOutMDP->setLength( 0 );
-        //				me->fCount = 0;
-        //				me->fpOutPipe->Write( me->fpPipeOutMDP,1000,1000, &me->fWriteCompletionInfo );
-        //				done = false;               // don't complete back to irda quite yet
-        //			}
-        //		}
-		
-		me->setUpTransmit();						// just to keep it going??
+        if ( resend )
+        {
+            memmove( request->Buffer, request->Buffer + (request->Count - remaining), remaining );
+            request->Count = remaining;
+            request->Retries++;
+            request->MDP->setLength( request->Count );
+            timeout = writeTimeoutMS( request->Count, port->BaudRate );
+            rc = me->fpOutPipe->Write( request->MDP, timeout, timeout, &request->Completion );
+            
+            IOLockLock( port->TXLock );
+            me->fWriteSubmitting = false;
+            IOLockUnlock( port->TXLock );
+            
+            if ( rc == kIOReturnSuccess )
+            {
+                me->setUpTransmit();            // pick up what arrived while we held the role
+                return;
+            }
+        }
+        IOLog("me_nozap_driver_PL2303::dataWriteComplete - %d bytes not sent: %p\n", remaining, rc);
     }
     
+    // The buffer is free again; TX is only idle once every buffer is back
+    IOLockLock( port->TXLock );
+    request->Pending = false;
+    busy = (--me->fWritesInFlight != 0);
+    port->AreTransmitting = busy;
+    me->fWriteActive = busy;
+    IOLockUnlock( port->TXLock );
+    
+    if ( !busy )
+        me->changeState( port, 0, PD_S_TX_BUSY );
+    if (me->fTerminate)
+        return;
+	
+    // Refill the buffer that just came back, after a failure too so TX does not stall
+    me->setUpTransmit();
+    
     return;
     
 }/* end dataWriteComplete */
@@ -3234,7 +3711,7 @@ void me_nozap_driver_PL2303::interruptReadComplete( void *obj, void *param, IORe
 	
     if ( rc == kIOReturnSuccess )   /* If operation returned ok:    */
 	{
-		if ( (me->fpDevice->GetVendorID() == SIEMENS_VENDOR_ID ) && (me->fpDevice->GetProductID() == SIEMENS_PRODUCT_ID_X65) ) {
+		if ( port->Quirks & kQuirkShortStatus ) {
             status_idx = 0;
             length = 1;
             DEBUG_IOLog( 3, "me_nozap_driver_PL2303::interruptReadComplete interrupt Buff size = 1\n");
@@ -3263,13 +3740,24 @@ void me_nozap_driver_PL2303::interruptReadComplete( void *obj, void *param, IORe
 			if (buf[status_idx] & kRI)  stat |= PD_RS232_S_RI;
 			if (buf[status_idx] & kDCD) stat |= PD_RS232_S_CAR;
             // ++ Parity check
-            if(buf[status_idx] & kParityError) {
+            if(buf[status_idx] & (kParityError | kFrameError | kBreakError)) {
 #if FIX_PARITY_PROCESSING
-                DEBUG_IOLog(5,"me_nozap_driver_PL2303::interruptReadComplete PARITY ERROR\n");
-                me->addBytetoQueue(&me->fPort->RX, 0xff); // Internal parity error marker
-                me->addBytetoQueue(&me->fPort->RX, 0x00); // Internal parity error marker
+                DEBUG_IOLog(5,"me_nozap_driver_PL2303::interruptReadComplete LINE ERROR 0x%02x\n", buf[status_idx]);
+                // The error belongs to the last byte received by now, remember which one that is.
+                // Only one thread may fill the RX queue, if a read completion is at it, it records the error
+                IOLockLock( port->RXLock );
+                if ( !me->fLineErrors )
+                    me->fLineErrorPosition = __atomic_load_n( &port->RX.Added, __ATOMIC_ACQUIRE );
+                me->fLineErrors |= buf[status_idx] & (kParityError | kFrameError | kBreakError);
+                if ( !me->fReadDelivering )
+                {
+                    me->fReadDelivering = true;
+                    me->queueLineErrors();
+                    me->fReadDelivering = false;
+                }
+                IOLockUnlock( port->RXLock );
 #else
-                DEBUG_IOLog(5,"me_nozap_driver_PL2303::interruptReadComplete PARITY ERROR (ignored)\n");
+                DEBUG_IOLog(5,"me_nozap_driver_PL2303::interruptReadComplete LINE ERROR (ignored)\n");
 #endif
             }
             me->setStateGated( stat, kHandshakeInMask , port); // refresh linestate in State
@@ -3281,7 +3769,7 @@ void me_nozap_driver_PL2303::interruptReadComplete( void *obj, void *param, IORe
 		me->fpInterruptPipe->Read( me->fpinterruptPipeMDP, &me->finterruptCompletionInfo, NULL );
         
 #if FIX_PARITY_PROCESSING
-        me->checkQueues( port );
+        me->checkRXQueue( port );
 #endif
     } else {
         DEBUG_IOLog(1,"me_nozap_driver_PL2303::interruptReadComplete wrong return code: %p", rc );
@@ -3295,11 +3783,14 @@ void me_nozap_driver_PL2303::interruptReadComplete( void *obj, void *param, IORe
 //
 //      Method:     me_nozap_driver_PL2303::dataReadComplete
 //
-//      Inputs:     obj - me, param - parameter block(the Port), rc - return code, remaining - what's left
+//      Inputs:     obj - me, param - the ReadRequest, rc - return code, remaining - what's left
 //
 //      Outputs:    None
 //
-//      Desc:       BulkIn pipe (Data interface) read completion routine
+//      Desc:       BulkIn pipe (Data interface) read completion routine. Several reads are kept
+//                  outstanding; whichever completion finds no delivery in progress delivers all
+//                  completed requests to the RX queue in submission order, starting at fReadHead,
+//                  and queues each of them again.
 //
 /****************************************************************************************************/
 
@@ -3307,13 +3798,45 @@ void me_nozap_driver_PL2303::dataReadComplete( void *obj, void *param, IOReturn
 {
 	DEBUG_IOLog(4,"me_nozap_driver_PL2303::dataReadComplete\n");
     me_nozap_driver_PL2303  *me = (me_nozap_driver_PL2303*)obj;
-    PortInfo_t      *port = (PortInfo_t*)param;
-    UInt16          dtlength;
-    IOReturn        ior = kIOReturnSuccess;
-    if ( rc == kIOReturnSuccess )   /* If operation returned ok:    */
-	{
-		me->fReadActive = false;
-		dtlength = USBLapPayLoad - remaining;
+    ReadRequest     *request = (ReadRequest*)param;
+    PortInfo_t      *port = me->fPort;
+    UInt32          dtlength;
+    UInt32          idle;
+    size_t          queued;
+    UInt64          now;
+    bool            delivered = false;
+    
+    if ( !(port && port->RXLock ) ) goto Fail;
+    
+    IOLockLock( port->RXLock );
+    
+    request->Pending = false;
+    request->Done = true;
+    request->Status = rc;
+    request->Length = (rc == kIOReturnSuccess) ? request->Size - remaining : 0;      // a short packet ends the transfer early
+    
+    if ( me->fReadDelivering )
+    {
+        // The delivering thread picks this one up when its turn comes
+        IOLockUnlock( port->RXLock );
+        return;
+    }
+    me->fReadDelivering = true;
+    
+    while ( (request = nextReadDone( me->fReadRequests, me->fReadCount, &me->fReadHead )) )
+    {
+        dtlength = request->Length;
+        
+        if ( request->Status != kIOReturnSuccess )
+        {
+            /* Read returned with error */
+            DEBUG_IOLog(4,"me_nozap_driver_PL2303::dataReadComplete - io err %x\n", request->Status );
+        } else {
+            // Errors the interrupt pipe reported meanwhile go on the list before this chunk
+            me->queueLineErrors();
+        }
+        IOLockUnlock( port->RXLock );
+        
 		if ( dtlength > 0 )
 		{
 #ifdef DATALOG
@@ -3321,7 +3844,7 @@ void me_nozap_driver_PL2303::dataReadComplete( void *obj, void *param, IOReturn
 			UInt8 *buf;
 			UInt32 buflen;
 			buflen = dtlength;
-			buf = &me->fPipeInBuffer[0];
+			buf = &request->Buffer[0];
 			DATA_IOLog(1,"me_nozap_driver_PL2303: Receive: ");
 			while ( buflen ){
 				unsigned char c = *buf;
@@ -3331,45 +3854,233 @@ void me_nozap_driver_PL2303::dataReadComplete( void *obj, void *param, IOReturn
 			}
             
 #endif
+			queued = me->addtoQueue( &port->RX, &request->Buffer[0], dtlength );
+            clock_get_uptime( &now );           // restarts the readers' inter-character timer, see rxDeadline
+            __atomic_store_n( &me->fRXTime, now, __ATOMIC_RELEASE );
+            if ( queued < dtlength )
+            {
+                port->RXStats.OverRun = true;
+                DEBUG_IOLog(1,"me_nozap_driver_PL2303::dataReadComplete RX queue overrun, %d bytes dropped\n", dtlength - queued );
+            }
+            delivered = true;
             
-#if FIX_PARITY_PROCESSING
-            if ( !(me->fPort && me->fPort->serialRequestLock ) ) goto Fail;
-            DEBUG_IOLog(2,"me_nozap_driver_PL2303::dataReadComplete IOLockLock( port->serialRequestLock );\n" );
-            
-            IOLockLock( me->fPort->serialRequestLock );
-            
-            clock_get_system_nanotime(&me->_fReadTimestampSecs, &me->_fReadTimestampNanosecs);
-            
-            DEBUG_IOLog(2,"me_nozap_driver_PL2303::dataReadComplete IOLockUnLock( port->serialRequestLock ); kQueueNoError\n" );
-            
-            IOLockUnlock( me->fPort->serialRequestLock);
-#endif
-			ior = me->addtoQueue( &me->fPort->RX, &me->fPipeInBuffer[0], dtlength );
-		}
-		
-		/* Queue the next read 	*/
-		ior = me->fpInPipe->Read( me->fpPipeInMDP, &me->fReadCompletionInfo, NULL );
-	    
-		if ( ior == kIOReturnSuccess )
-		{
-			me->fReadActive = true;
-			me->checkQueues( port );
-			return;
-		} else {
-			DEBUG_IOLog(4,"me_nozap_driver_PL2303::dataReadComplete dataReadComplete - queueing bulk read failed\n");
+            // Low latency: wake readers per chunk, not after all completed reads are delivered
+            if ( port->MinLatency )
+                me->checkRXQueue( port );
 		}
 		
-	} else {
-    Fail:
-		/* Read returned with error */
-		DEBUG_IOLog(4,"me_nozap_driver_PL2303::dataReadComplete - io err %x\n",rc );
-		
-	}
+		/* Queue the next read, after an error too unless the pipe was aborted or the device is gone */
+        if ( me->fTerminate || (request->Status == kIOReturnAborted) || (request->Status == kIOReturnNotResponding) ||
+             !me->submitRead( request ) )
+        {
+            DEBUG_IOLog(4,"me_nozap_driver_PL2303::dataReadComplete dataReadComplete - queueing bulk read failed\n");
+        }
+        
+        IOLockLock( port->RXLock );
+    }
+    
+    me->queueLineErrors();
+    me->fReadDelivering = false;
+    me->fReadActive = false;
+    for ( idle = 0; idle < me->fReadCount; idle++ )
+    {
+        if ( me->fReadRequests[idle].Pending )
+            me->fReadActive = true;
+    }
+    
+    IOLockUnlock( port->RXLock );
+    
+    if ( delivered )
+        me->checkRXQueue( port );
 	
+Fail:
     return;
     
 }/* end dataReadComplete */
 
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::queueLineErrors
+//
+//      Inputs:
+//
+//      Outputs:
+//
+//      Desc:       Records the pending line status errors against the byte that was last
+//                  received when they were reported (fLineErrorPosition), all in one entry.
+//                  Called with the RXLock held by the thread that owns
+//                  fReadDelivering, so it is the only producer of the RX error list.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::queueLineErrors( void )
+{
+    RXErrorList     *List = &fPort->RXErrors;
+    RXError         *Entry;
+    
+    if ( !fLineErrors )
+        return;
+    
+    if ( !fLineErrorPosition )
+    {
+        // Nothing received yet, there is no byte to charge it to
+        fPort->LateLineErrors++;
+        DEBUG_IOLog(1,"%s(%p)::queueLineErrors error 0x%x before any data, dropped\n", getName(), this, fLineErrors );
+    }
+    else if ( (List->Added - __atomic_load_n( &List->Removed, __ATOMIC_ACQUIRE )) >= kRXErrorListSize )
+    {
+        DEBUG_IOLog(1,"%s(%p)::queueLineErrors error list full, 0x%x dropped\n", getName(), this, fLineErrors );
+    }
+    else
+    {
+        Entry = &List->Entries[List->Added % kRXErrorListSize];
+        Entry->Position = fLineErrorPosition - 1;
+        Entry->Errors = fLineErrors;
+        __atomic_store_n( &List->Added, List->Added + 1, __ATOMIC_RELEASE );
+    }
+    fLineErrors = 0;
+    
+}/* end queueLineErrors */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::cleanBytesinRX
+//
+//      Inputs:
+//
+//      Outputs:    Event - the next error to report for the byte at the end of the clean
+//                  bytes, may be NULL.
+//                  Return value - bytes at the head of RX before the next byte in error,
+//                  (size_t)-1 if no error is recorded.
+//
+//      Desc:       Looks up the oldest recorded error. Errors whose byte has already been
+//                  read are dropped and counted in LateLineErrors. RX consumer only.
+//
+/****************************************************************************************************/
+
+size_t me_nozap_driver_PL2303::cleanBytesinRX( UInt32 *Event )
+{
+    RXErrorList     *List = &fPort->RXErrors;
+    RXError         *Entry = NULL;
+    size_t          Head = fPort->RX.Removed;
+    size_t          Removed = List->Removed;
+    size_t          Added = __atomic_load_n( &List->Added, __ATOMIC_ACQUIRE );
+    
+    for ( ; Removed != Added; Removed++ )
+    {
+        Entry = &List->Entries[Removed % kRXErrorListSize];
+        if ( Entry->Position >= Head )
+            break;
+        fPort->LateLineErrors++;
+    }
+    if ( Removed != List->Removed )
+        __atomic_store_n( &List->Removed, Removed, __ATOMIC_RELEASE );
+    
+    if ( Removed == Added )
+        return (size_t)-1;
+    
+    // break before parity before framing
+    if ( Event )
+    {
+        if ( Entry->Errors & kBreakError )
+            *Event = PD_RS232_E_LINE_BREAK;
+        else if ( Entry->Errors & kParityError )
+            *Event = PD_E_INTEGRITY_ERROR;
+        else
+            *Event = PD_E_FRAMING_ERROR;
+    }
+    
+    return Entry->Position - Head;
+    
+}/* end cleanBytesinRX */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::takeRXError
+//
+//      Inputs:     Event - the error cleanBytesinRX returned for the byte at the head of RX
+//
+//      Outputs:    Return value - true when this was the byte's last error and the caller
+//                  must remove the byte, false when more errors are to be reported for it
+//
+//      Desc:       Marks one error of the head byte as reported. RX consumer only.
+//
+/****************************************************************************************************/
+
+bool me_nozap_driver_PL2303::takeRXError( UInt32 Event )
+{
+    RXErrorList     *List = &fPort->RXErrors;
+    RXError         *Entry;
+    
+    if ( cleanBytesinRX( NULL ) != 0 )
+        return true;
+    
+    Entry = &List->Entries[List->Removed % kRXErrorListSize];
+    if ( Event == PD_RS232_E_LINE_BREAK )
+        Entry->Errors &= ~kBreakError;
+    else if ( Event == PD_E_INTEGRITY_ERROR )
+        Entry->Errors &= ~kParityError;
+    else
+        Entry->Errors &= ~kFrameError;
+    if ( Entry->Errors )
+        return false;
+    
+    __atomic_store_n( &List->Removed, List->Removed + 1, __ATOMIC_RELEASE );
+    
+    // Reported again before the byte was read, the next entry is for the same byte
+    return cleanBytesinRX( NULL ) != 0;
+    
+}/* end takeRXError */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::dropRXErrors
+//
+//      Inputs:
+//
+//      Outputs:
+//
+//      Desc:       Forgets the errors of bytes that have been read. RX consumer only.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::dropRXErrors( void )
+{
+    RXErrorList     *List = &fPort->RXErrors;
+    size_t          Removed = List->Removed;
+    size_t          Added = __atomic_load_n( &List->Added, __ATOMIC_ACQUIRE );
+    
+    while ( (Removed != Added) && (List->Entries[Removed % kRXErrorListSize].Position < fPort->RX.Removed) )
+        Removed++;
+    
+    __atomic_store_n( &List->Removed, Removed, __ATOMIC_RELEASE );
+    
+}/* end dropRXErrors */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::removeRXData
+//
+//      Inputs:     MaxSize - size of buffer
+//
+//      Outputs:    Buffer - Where to put the data, Number of bytes actually put in Buffer.
+//
+//      Desc:       Reads RX data up to, but not including, the next byte in error, which is
+//                  left for dequeueEvent to report.
+//
+/****************************************************************************************************/
+
+size_t me_nozap_driver_PL2303::removeRXData( UInt8 *Buffer, size_t MaxSize )
+{
+    size_t      Clean = cleanBytesinRX( NULL );
+    
+    if ( MaxSize > Clean )
+        MaxSize = Clean;
+    
+    return removefromQueue( &fPort->RX, Buffer, MaxSize );
+    
+}/* end removeRXData */
+
 /****************************************************************************************************/
 //
 //      Method:     me_nozap_driver_PL2303::allocateRingBuffer
@@ -3386,13 +4097,16 @@ bool me_nozap_driver_PL2303::allocateRingBuffer( CirQueue *Queue, size_t BufferS
 {
     UInt8       *Buffer;
 	
-	// Size is ignored and kMaxCirBufferSize, which is 4096, is used.
-	// BJA Hack
-#define kCirBufferSize 1
-    DEBUG_IOLog(4,"%s(%p)::allocateRingBuffer\n", getName(), this );
-    Buffer = (UInt8*)IOMalloc( kMaxCirBufferSize );
+    DEBUG_IOLog(4,"%s(%p)::allocateRingBuffer size: %d\n", getName(), this, BufferSize );
+    
+    if ( BufferSize < kMinCirBufferSize )
+        BufferSize = kMinCirBufferSize;
+    if ( BufferSize > kMaxCirBufferSize )
+        BufferSize = kMaxCirBufferSize;
+    
+    Buffer = (UInt8*)allocBuffer( BufferSize );
 	
-    initQueue( Queue, Buffer, kMaxCirBufferSize );
+    initQueue( Queue, Buffer, Buffer ? BufferSize : 0 );
 	
     if ( Buffer )
 		return true;
@@ -3403,220 +4117,898 @@ bool me_nozap_driver_PL2303::allocateRingBuffer( CirQueue *Queue, size_t BufferS
 
 /****************************************************************************************************/
 //
-//      Method:     me_nozap_driver_PL2303::freeRingBuffer
+//      Method:     me_nozap_driver_PL2303::setQueueSize
 //
-//      Inputs:     Queue - the specified queue to free
+//      Inputs:     Queue - the queue to resize, Stats - its marks, BufferSize - the new size
+//
+//      Outputs:    return Code - kIOReturnSuccess, kIOReturnBusy (queue not quiescent) or kIOReturnNoMemory
+//
+//      Desc:       Replaces the ring buffer of the queue by one of BufferSize bytes and updates the
+//                  water marks. The buffer is only swapped while the queue is empty and, for TX,
+//                  nothing is being transmitted, so no data is lost or moved.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::setQueueSize( CirQueue *Queue, BufferMarks *Stats, size_t BufferSize )
+{
+    UInt8       *Buffer;
+    UInt8       *OldBuffer;
+    size_t      OldSize;
+    IOLock      *lock;
+    
+    DEBUG_IOLog(4,"%s(%p)::setQueueSize size: %d\n", getName(), this, BufferSize );
+    
+    if ( !(fPort && fPort->RXLock && fPort->TXLock) ) return kIOReturnNotOpen;
+    
+    if ( BufferSize < kMinCirBufferSize )
+        BufferSize = kMinCirBufferSize;
+    if ( BufferSize > kMaxCirBufferSize )
+        BufferSize = kMaxCirBufferSize;
+    
+    if ( BufferSize != Queue->Size )
+    {
+        Buffer = (UInt8*)allocBuffer( BufferSize );
+        if ( !Buffer )
+            return kIOReturnNoMemory;
+        
+        lock = (Queue == &fPort->RX) ? fPort->RXLock : fPort->TXLock;
+        IOLockLock( lock );
+        // Both sides must be idle: the RX producer and the TX consumer claim their
+        // role under their queue's lock, TX producers hold it
+        if ( usedSpaceinQueue( Queue ) ||
+             ((Queue == &fPort->RX) && fReadDelivering) ||
+             ((Queue == &fPort->TX) && (fPort->AreTransmitting || fWriteSubmitting)) )
+        {
+            IOLockUnlock( lock );
+            freeBuffer( Buffer, BufferSize );
+            DEBUG_IOLog(4,"%s(%p)::setQueueSize queue busy\n", getName(), this );
+            return kIOReturnBusy;
+        }
+        OldBuffer = Queue->Start;
+        OldSize = Queue->Size;
+        Queue->Start    = Buffer;
+        Queue->End      = Buffer + BufferSize;
+        Queue->Size     = BufferSize;
+        Queue->Added    = 0;
+        Queue->Removed  = 0;
+        if ( Queue == &fPort->RX )
+            fPort->RXErrors.Added = fPort->RXErrors.Removed = 0;
+        IOLockUnlock( lock );
+        
+        if ( OldBuffer )
+            freeBuffer( OldBuffer, OldSize );
+    }
+    
+    Stats->BufferSize   = BufferSize;
+    Stats->PendingSize  = 0;
+    
+    // Marks set by the user stay as long as they still fit
+    if ( !Stats->FixedMarks || !validWaterMarks( BufferSize, Stats->LowWater, Stats->HighWater, markEvent( Queue ) ) )
+        setDefaultMarks( Queue, Stats );
+    
+    return kIOReturnSuccess;
+    
+}/* end setQueueSize */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::resizeQueue
+//
+//      Inputs:     Queue - the queue to resize, Stats - its marks, BufferSize - the new default size
 //
 //      Outputs:    None
 //
-//      Desc:       Frees all resources assocated with the queue, then sets all queue parameters
-//                  to safe values.
+//      Desc:       Follows a baud rate change. A queue that still holds data keeps its size and
+//                  gets the new one from resizePending once it has drained, the marks follow
+//                  the new rate right away.
 //
 /****************************************************************************************************/
 
-void me_nozap_driver_PL2303::freeRingBuffer( CirQueue *Queue )
+void me_nozap_driver_PL2303::resizeQueue( CirQueue *Queue, BufferMarks *Stats, size_t BufferSize )
 {
-    DEBUG_IOLog(4,"%s(%p)::freeRingBuffer\n", getName(), this );
-    if( !(Queue->Start) )  goto Bogus;
+    IOReturn    rtn;
     
-    IOFree( Queue->Start, Queue->Size );
-    closeQueue( Queue );
-	
-Bogus:
-    return;
+    rtn = setQueueSize( Queue, Stats, BufferSize );
+    if ( rtn == kIOReturnBusy )
+    {
+        DEBUG_IOLog(4,"%s(%p)::resizeQueue %d bytes once the queue is idle\n", getName(), this, BufferSize );
+        Stats->PendingSize = BufferSize;
+        if ( !Stats->FixedMarks )
+            setDefaultMarks( Queue, Stats );
+    }
+    else if ( rtn != kIOReturnSuccess )
+    {
+        IOLog("%s(%p)::resizeQueue %d bytes failed: %p\n", getName(), this, BufferSize, rtn );
+    }
     
-}/* end freeRingBuffer */
+}/* end resizeQueue */
 
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::resizePending
+//
+//      Inputs:     port - the specified port
+//
+//      Outputs:    None
+//
+//      Desc:       Gives a queue the size resizeQueue could not, if it is idle now. Called from
+//                  the gated paths that leave a queue empty.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::resizePending( PortInfo_t *port )
+{
+    if ( port->RXStats.PendingSize &&
+         (setQueueSize( &port->RX, &port->RXStats, port->RXStats.PendingSize ) != kIOReturnBusy) )
+    {
+        port->RXStats.PendingSize = 0;
+        checkRXQueue( port, true );
+    }
+    if ( port->TXStats.PendingSize &&
+         (setQueueSize( &port->TX, &port->TXStats, port->TXStats.PendingSize ) != kIOReturnBusy) )
+    {
+        port->TXStats.PendingSize = 0;
+        checkTXQueue( port );
+    }
+    
+}/* end resizePending */
 
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::markEvent
+//
+//      Inputs:     Queue - the RX or TX queue
+//
+//      Outputs:    the most the queue moves by at once
+//
+//      Desc:       The BIGGEST_EVENT of generateRxQState: a whole bulk-in transfer for RX,
+//                  one bulk-out packet for TX.
+//
+/****************************************************************************************************/
 
+size_t me_nozap_driver_PL2303::markEvent( CirQueue *Queue )
+{
+    return (Queue == &fPort->RX) ? fPort->ReadSize : fPort->WritePacketSize;
+    
+}/* end markEvent */
 
 /****************************************************************************************************/
 //
-//      Method:     me_nozap_driver_PL2303::SetSpeed
+//      Method:     me_nozap_driver_PL2303::setDefaultMarks
 //
-//      Inputs:     brate - the requested baud rate
+//      Inputs:     Queue - the RX or TX queue, Stats - its marks
 //
-//      Outputs:    return word - baud coding
+//      Outputs:    None
 //
-//      Desc:       Set the baudrate for the device
+//      Desc:       Derives the water marks from the queue size, the baud rate and the transfer
+//                  sizes with defaultWaterMarks. RX flow control goes on while there is still
+//                  room for what arrives in kFlowControlLatencyMS plus all the read-ahead,
+//                  TX writers are woken while the latency and a write batch are still queued.
 //
 /****************************************************************************************************/
 
-IOReturn me_nozap_driver_PL2303::setSerialConfiguration( void )
+void me_nozap_driver_PL2303::setDefaultMarks( CirQueue *Queue, BufferMarks *Stats )
 {
-	IOReturn rtn;
-	IOUSBDevRequest request;
-	char * buf;
-    DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration baudrate: %d \n", getName(), this, fPort->BaudRate );
-	buf = (char *)IOMalloc( 10 );
-	memset(buf, 0x00, 0x07);
+    size_t  size = Stats->BufferSize;
+    size_t  latency = bytesInTime( fPort->BaudRate, kFlowControlLatencyMS );
+    bool    rx = (Queue == &fPort->RX);
+    size_t  high;
+    size_t  low;
     
-    fCurrentBaud = fPort->BaudRate;
+    defaultWaterMarks( rx, size, markEvent( Queue ), latency,
+                       rx ? (size_t)fPort->ReadAhead * fPort->ReadSize : fPort->WriteBatch, &low, &high );
     
-    switch (fPort->BaudRate){
-		case 75:
-			fBaudCode = kLinkSpeed75;     // 0x01
-			break;
-		case 150:
-			fBaudCode = kLinkSpeed150;     // 0x01
-			break;
-		case 300:
-			fBaudCode = kLinkSpeed300;     // 0x01
-			break;
-		case 600:
-			fBaudCode = kLinkSpeed600;     // 0x01
-			break;
-		case 1200:
-			fBaudCode = kLinkSpeed1200;     // 0x01
-			break;
-		case 1800:
-			fBaudCode = kLinkSpeed1800;     // 0x01
-			break;
-		case 2400:
-			fBaudCode = kLinkSpeed2400;     // 0x01
-			break;
-		case 3600:
-			fBaudCode = kLinkSpeed3600;     // 0x01
-			break;
-		case 4800:
-			fBaudCode = kLinkSpeed4800;     // 0x01
-			break;
-		case 7200:
-			fBaudCode = kLinkSpeed7200;     // 0x01
-			break;
-		case 9600:
-			fBaudCode = kLinkSpeed9600;     // 0x02
-			break;
-		case 19200:
-			fBaudCode = kLinkSpeed19200;    // 0x03
-			break;
-		case 38400:
-			fBaudCode = kLinkSpeed38400;    // 0x04
-			break;
-		case 57600:
-			fBaudCode = kLinkSpeed57600;    // 0x05
-			break;
-		case 115200:
-			fBaudCode = kLinkSpeed115200;   // 0x06
-			break;
-		case 230400:
-			fBaudCode = kLinkSpeed230400;   // 0x07
-			break;
-		case 460800:
-			fBaudCode = kLinkSpeed460800;  // 0x08
-			break;
-		case 614400:
-			fBaudCode = kLinkSpeed614400;  // 0x08
-			break;
-		case 921600:
-			fBaudCode = kLinkSpeed921600;  // 0x08
-			break;
-		case 1228800:
-			fBaudCode = kLinkSpeed1228800;  // 0x08
-			break;
-		case 1843200:
-			fBaudCode = kLinkSpeed1843200;  // 0x08
-			break;
-		case 2457600:
-			fBaudCode = kLinkSpeed2457600;  // 0x08
-			break;
-		case 3000000:
-			fBaudCode = kLinkSpeed3000000;  // 0x08
-			break;
-		case 6000000:
-			fBaudCode = kLinkSpeed6000000;  // 0x08
-			break;
-			
-            // Other baudrates may be depend on the model (see manual on page 19)
-            // I changed the error into a warning...
-		default:
-			IOLog("%s(%p)::setSerialConfiguration - Requesting non standard baud rate\n", getName(), this);
-			fBaudCode = fPort->BaudRate;
-			break;
-    }
-	
-	if(fBaudCode) {
-		buf[3] = fBaudCode & 0xff;
-		buf[2] = (fBaudCode >> 8) & 0xff;
-		buf[1] = (fBaudCode >> 16) & 0xff;
-		buf[0] = (fBaudCode >> 24) & 0xff;
-	}
+    Stats->HighWater    = high;
+    Stats->LowWater     = low;
+    Stats->FixedMarks   = false;
+    
+    DEBUG_IOLog(4,"%s(%p)::setDefaultMarks %s size: %d low: %d high: %d\n", getName(), this,
+                (Queue == &fPort->RX) ? "RX" : "TX", size, low, high );
+    
+}/* end setDefaultMarks */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::setWaterMarks
+//
+//      Inputs:     Queue - the RX or TX queue, Stats - its marks, LowWater, HighWater - the new marks
+//
+//      Outputs:    return Code - kIOReturnSuccess or kIOReturnBadArgument
+//
+//      Desc:       Sets marks asked for with PD_E_*Q_HIGH_WATER / LOW_WATER. They are refused
+//                  unless they leave a whole event between low and high and at either end,
+//                  so the RX flow control keeps its hysteresis and cannot overrun the queue.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::setWaterMarks( CirQueue *Queue, BufferMarks *Stats, size_t LowWater, size_t HighWater )
+{
+    DEBUG_IOLog(4,"%s(%p)::setWaterMarks low: %d high: %d\n", getName(), this, LowWater, HighWater );
+    
+    if ( !validWaterMarks( Stats->BufferSize, LowWater, HighWater, markEvent( Queue ) ) )
+    {
+        DEBUG_IOLog(4,"%s(%p)::setWaterMarks marks do not fit a %d byte queue\n", getName(), this, Stats->BufferSize );
+        return kIOReturnBadArgument;
+    }
+    
+    Stats->LowWater     = LowWater;
+    Stats->HighWater    = HighWater;
+    Stats->FixedMarks   = true;
+    
+    return kIOReturnSuccess;
+    
+}/* end setWaterMarks */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::freeRingBuffer
+//
+//      Inputs:     Queue - the specified queue to free
+//
+//      Outputs:    None
+//
+//      Desc:       Frees all resources assocated with the queue, then sets all queue parameters
+//                  to safe values.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::freeRingBuffer( CirQueue *Queue )
+{
+    DEBUG_IOLog(4,"%s(%p)::freeRingBuffer\n", getName(), this );
+    if( !(Queue->Start) )  goto Bogus;
+    
+    freeBuffer( Queue->Start, Queue->Size );
+    closeQueue( Queue );
+	
+Bogus:
+    return;
+    
+}/* end freeRingBuffer */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::allocBuffer
+//
+//      Inputs:     Size - bytes to allocate
+//
+//      Outputs:    the buffer, NULL on failure
+//
+//      Desc:       Allocates driver memory and counts it in fAllocations. Only setup and
+//                  reconfiguration allocate, moving data must leave the count alone.
+//
+/****************************************************************************************************/
+
+void *me_nozap_driver_PL2303::allocBuffer( size_t Size )
+{
+    void    *Buffer;
+    
+    Buffer = IOMalloc( Size );
+    if ( Buffer )
+        OSIncrementAtomic( &fAllocations );
+    
+    return Buffer;
+    
+}/* end allocBuffer */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::freeBuffer
+//
+//      Inputs:     Buffer - memory from allocBuffer
+//                  Size - its size
+//
+//      Outputs:
+//
+//      Desc:       Frees memory obtained from allocBuffer.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::freeBuffer( void *Buffer, size_t Size )
+{
+    if ( Buffer )
+        IOFree( Buffer, Size );
+    
+}/* end freeBuffer */
+
+
+
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::SetSpeed
+//
+//      Inputs:     brate - the requested baud rate
+//
+//      Outputs:    return word - baud coding
+//
+//      Desc:       Set the baudrate for the device
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::setSerialConfiguration( void )
+{
+	IOReturn rtn;
+	IOUSBDevRequest request;
+	UInt8 buf[kLineCodingSize];
+	LineCoding coding;
+    UInt32 current;
+    bool start = false;
+    DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration baudrate: %d \n", getName(), this, fPort->BaudRate );
+	memset(buf, 0x00, sizeof(buf));
+    
+    current = fPort->BaudRate;
+    
+    // Standard rates go as they are, the HX generator takes any other rate as a divisor
+    fBaudCode = fPort->BaudRate;
+    if ( !isStandardBaudRate( fPort->BaudRate ) )
+    {
+        if ( kBaudCapabilities[fPort->type].Divisor )
+        {
+            UInt32 achieved;
+            UInt32 code = divisorBaudRate( fPort->BaudRate, &achieved );
+            UInt32 error = baudRateError( fPort->BaudRate, achieved );
+            
+            DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - divisor 0x%x gives %d bps, error %d.%02d%% \n", getName(), this,
+                        code, achieved, error / 100, error % 100);
+            if ( error > kBaudRateTolerance )
+                IOLog("%s(%p)::setSerialConfiguration - %d bps is off by %d.%02d%% at %d bps\n", getName(), this,
+                      achieved, error / 100, error % 100, fPort->BaudRate);
+            fBaudCode = code;
+            current = achieved;
+        } else {
+            IOLog("%s(%p)::setSerialConfiguration - Requesting non standard baud rate\n", getName(), this);
+        }
+    }
+	
+	coding.Rate = fBaudCode;
 	
     switch (fPort->StopBits) {
         case 0:
-            buf[4] = 0;
+            coding.StopBits = 0;
             break;
             
         case 2:
-            buf[4] = 0; // 1 stop bit
+            coding.StopBits = 0; // 1 stop bit
             break;
             
         case 3:
-            buf[4] = 1; // 1.5 stop bits
+            coding.StopBits = 1; // 1.5 stop bits
             break;
             
         case 4:
-            buf[4] = 2; // 2 stop bits
+            coding.StopBits = 2; // 2 stop bits
             break;
             
         default:
-            buf[4] = 0;
+            coding.StopBits = 0;
             break;
     }
-	DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - StopBits: %d \n", getName(), this,  buf[4]);
+	DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - StopBits: %d \n", getName(), this,  coding.StopBits);
 	
 	
     switch(fPort->TX_Parity)
     {
         case PD_RS232_PARITY_NONE:
-            buf[5] = 0;
+            coding.Parity = 0;
 			DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - PARITY_NONE \n", getName(), this);
             break;
             
         case PD_RS232_PARITY_ODD:
-            buf[5] = 1;
+            coding.Parity = 1;
 			DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - PARITY_ODD \n", getName(), this);
             break;
             
         case PD_RS232_PARITY_EVEN:
-            buf[5] = 2;
+            coding.Parity = 2;
 			DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - PARITY_EVEN \n", getName(), this);
             break;
             
         case PD_RS232_PARITY_MARK:
-			buf[5] = 3;
+			coding.Parity = 3;
 			DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - PARITY_MARK \n", getName(), this);
 			break;
 			
 		case PD_RS232_PARITY_SPACE:
-			buf[5] = 4;
+			coding.Parity = 4;
 			DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - PARITY_SPACE \n", getName(), this);
 			break;
 			
         default:
-			buf[5] = 0;
+			coding.Parity = 0;
 			DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - PARITY_NONE \n", getName(), this);
     }
 	
 	if (fPort->CharLength >= 5 && fPort->CharLength <= 8){
-		buf[2] = fPort->CharLength;
+		coding.DataBits = fPort->CharLength;
+    } else {
+		coding.DataBits = 8;
+    }
+	DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - Bits: %d \n", getName(), this,  coding.DataBits);
+	
+    encodeLineCoding( &coding, buf );
+	
+	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
+    request.bRequest = SET_LINE_REQUEST;
+	request.wValue =  0;
+	request.wIndex = 0;
+	request.wLength = kLineCodingSize;
+	request.pData = buf;
+    
+    // The line coding cache is shared with finishControlRequest, which runs on the
+    // completion thread, so compare, queue and update it in one go under the lock
+    fLineCodingPending = false;
+    IOLockLock( fPort->serialRequestLock );
+    fCurrentBaud = current;
+    if ( fLineCodingValid && !memcmp( buf, fLineCoding, sizeof(buf) ) )
+    {
+        IOLockUnlock( fPort->serialRequestLock );
+        DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - unchanged \n", getName(), this);
+        return kIOReturnSuccess;
+    }
+	rtn = fpDevice ? addControlRequest( &request, NULL, &start ) : kIOReturnBadArgument;
+    
+    // Assume it will be taken, finishControlRequest drops the cache if it is not
+    fLineCodingValid = (rtn == kIOReturnSuccess);
+    if ( fLineCodingValid )
+        memcpy( fLineCoding, buf, sizeof(buf) );
+    IOLockUnlock( fPort->serialRequestLock );
+    
+    if ( start )
+        startControlRequest();
+	DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - return: %p \n", getName(), this,  rtn);
+    
+    // Optionally ask the chip what it made of it, it may round or ignore the rate
+    if ( (rtn == kIOReturnSuccess) && fPort->VerifyLineCoding )
+    {
+        request.bmRequestType = GET_LINE_REQUEST_TYPE;
+        request.bRequest = GET_LINE_REQUEST;
+        request.wValue =  0;
+        request.wIndex = 0;
+        request.wLength = kLineCodingSize;
+        request.pData = NULL;
+        queueControlRequest( &request, buf );
+    }
+    
+    return rtn;
+}/* end SetSpeed */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::changeSerialConfiguration
+//
+//      Inputs:
+//
+//      Outputs:
+//
+//      Desc:       A line parameter changed. Open the line coding window so the rest of a
+//                  burst (one tcsetattr sets rate, size, parity and stop bits) is sent along.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::changeSerialConfiguration( void )
+{
+    
+    if ( !fLineCodingPending && fLineTimer )
+        fLineTimer->setTimeoutMS( kLineCodingDelay );
+    fLineCodingPending = true;
+    
+}/* end changeSerialConfiguration */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::commitSerialConfiguration
+//
+//      Inputs:
+//
+//      Outputs:    return code - from setSerialConfiguration, success when nothing changed
+//
+//      Desc:       Send a pending line coding now. Called from the gate.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::commitSerialConfiguration( void )
+{
+    
+    if ( !fLineCodingPending )
+        return kIOReturnSuccess;
+    
+    if ( fLineTimer )
+        fLineTimer->cancelTimeout();
+    
+    return setSerialConfiguration();
+    
+}/* end commitSerialConfiguration */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::wakeTimeout
+//
+//      Inputs:     owner - this driver, sender - fWakeTimer
+//
+//      Outputs:    None
+//
+//      Desc:       Runs in the gate, so every waiter that decided to sleep is asleep by now.
+//                  Repeats the wakeups a completion gave, see wakeStateWaiters and
+//                  controlSleep.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::wakeTimeout( OSObject *owner, IOTimerEventSource *sender )
+{
+    me_nozap_driver_PL2303  *me = (me_nozap_driver_PL2303 *)owner;
+    
+    bool                    control;
+    
+    if ( !me || !me->fPort )
+        return;
+    
+    me->wakeStateWaiters( me->fPort, 0 );
+    
+    IOLockLock( me->fPort->serialRequestLock );
+    control = (me->fControlWaiters != 0);
+    IOLockUnlock( me->fPort->serialRequestLock );
+    if ( control )
+    {
+        me->fCommandGate->commandWakeup( &me->fControlBusy );
+        me->fCommandGate->commandWakeup( &me->fBreakOnTime );
+    }
+    
+}/* end wakeTimeout */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::lineTimeout
+//
+//      Inputs:     owner - this driver, sender - fLineTimer
+//
+//      Outputs:
+//
+//      Desc:       The line coding window closed, send the parameters set so far.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::lineTimeout( OSObject *owner, IOTimerEventSource *sender )
+{
+    me_nozap_driver_PL2303  *me = (me_nozap_driver_PL2303 *)owner;
+    
+    if ( !me || !me->fPort || me->fTerminate )
+        return;
+    
+    if ( me->commitSerialConfiguration() )
+        DEBUG_IOLog(4,"%s(%p)::lineTimeout Set Serial Configuration failed\n", me->getName(), me);
+    
+}/* end lineTimeout */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::deviceRequest
+//
+//      Inputs:     request - the control request
+//
+//      Outputs:    return code - from the device
+//
+//      Desc:       Send a synchronous control request on the default pipe and count it.
+//                  Only the start up sequence waits like this, see queueControlRequest.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::deviceRequest( IOUSBDevRequest *request )
+{
+    
+    if ( fPort )
+        fPort->ControlTransfers++;
+    
+    return fpDevice->DeviceRequest( request );
+    
+}/* end deviceRequest */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::queueControlRequest
+//
+//      Inputs:     request - the control request, its data is copied
+//                  expect - for GET_LINE_REQUEST, the line coding it should return
+//
+//      Outputs:    return code - kIOReturnNoResources when the queue is full
+//
+//      Desc:       Queue a control request behind the ones already waiting and start it
+//                  when the default pipe is free. Does not wait for the device.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::queueControlRequest( IOUSBDevRequest *request, const UInt8 *expect )
+{
+    IOReturn    rtn;
+    bool        start = false;
+    
+    if ( !fPort || !fpDevice || request->wLength > kLineCodingSize )
+        return kIOReturnBadArgument;
+    
+    IOLockLock( fPort->serialRequestLock );
+    rtn = addControlRequest( request, expect, &start );
+    IOLockUnlock( fPort->serialRequestLock );
+    
+    if ( start )
+        startControlRequest();
+    
+    return rtn;
+    
+}/* end queueControlRequest */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::addControlRequest
+//
+//      Inputs:     request, expect - see queueControlRequest
+//
+//      Outputs:    start - set when the caller must call startControlRequest after unlocking
+//                  return code - kIOReturnNoResources when the queue is full
+//
+//      Desc:       queueControlRequest with serialRequestLock already held.
+//
+/****************************************************************************************************/
+
+IOReturn me_nozap_driver_PL2303::addControlRequest( IOUSBDevRequest *request, const UInt8 *expect, bool *start )
+{
+    ControlRequest  *block;
+    
+    // A newer modem line or line coding setting replaces one still waiting
+    block = controlRequestSlot( fControlRequests, fControlHead, &fControlCount, fControlBusy, request );
+    if ( !block )
+    {
+        IOLog("%s(%p)::queueControlRequest - queue full, request 0x%x dropped\n", getName(), this, request->bRequest);
+        return kIOReturnNoResources;
+    }
+    
+    block->Request = *request;
+    block->Request.pData = request->wLength ? block->Data : NULL;
+    if ( request->wLength && request->pData && !(request->bmRequestType & (kUSBIn << kUSBRqDirnShift)) )
+        memcpy( block->Data, request->pData, request->wLength );
+    if ( expect )
+        memcpy( block->Expect, expect, kLineCodingSize );
+    
+    if ( !fControlBusy )
+    {
+        fControlBusy = true;
+        *start = true;
+    }
+    
+    return kIOReturnSuccess;
+    
+}/* end addControlRequest */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::startControlRequest
+//
+//      Inputs:
+//
+//      Outputs:
+//
+//      Desc:       Put the oldest queued request on the bus. Only called by the owner of
+//                  fControlBusy, so the head does not move underneath us.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::startControlRequest( void )
+{
+    ControlRequest  *block;
+    IOReturn        rtn;
+    
+    do {
+        block = &fControlRequests[fControlHead];
+        
+        fPort->ControlTransfers++;
+        rtn = fpDevice->DeviceRequest( &block->Request, kControlTimeoutMS, kControlTimeoutMS, &fControlCompletion );
+        if ( rtn == kIOReturnSuccess )
+            return;
+        
+        IOLog("%s(%p)::startControlRequest - request 0x%x failed: %p\n", getName(), this, block->Request.bRequest, rtn);
+    } while ( finishControlRequest( rtn, block->Request.wLength ) );
+    
+}/* end startControlRequest */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::finishControlRequest
+//
+//      Inputs:     ior - how the request at the head ended, remaining - bytes not transferred
+//
+//      Outputs:    return - true when the caller owns the next request and must start it
+//
+//      Desc:       Act on the result of the head request and take it off the queue.
+//
+/****************************************************************************************************/
+
+bool me_nozap_driver_PL2303::finishControlRequest( IOReturn ior, UInt32 remaining )
+{
+    ControlRequest  *block = &fControlRequests[fControlHead];
+    bool            lineCodingTaken = true;
+    UInt32          acceptedRate = 0;
+    bool            more;
+    bool            wake;
+    
+    if ( block->Request.bRequest == SET_LINE_REQUEST && ior != kIOReturnSuccess )
+    {
+        DEBUG_IOLog(3,"%s(%p)::finishControlRequest - line coding not taken: %p \n", getName(), this, ior);
+        lineCodingTaken = false;
+    }
+    
+    if ( block->Request.bRequest == GET_LINE_REQUEST && ior == kIOReturnSuccess &&
+         block->Request.wLength - remaining >= kLineCodingSize )
+    {
+        LineCoding  asked, accepted;
+        
+        decodeLineCoding( block->Expect, &asked );
+        decodeLineCoding( block->Data, &accepted );
+        DEBUG_IOLog(3,"%s(%p)::finishControlRequest - rate: %d bits: %d parity: %d stop: %d \n", getName(), this,
+                    accepted.Rate, accepted.DataBits, accepted.Parity, accepted.StopBits);
+        if ( memcmp( block->Expect, block->Data, kLineCodingSize ) )
+        {
+            IOLog("%s(%p)::setSerialConfiguration - asked for %d %d/%d/%d, device has %d %d/%d/%d\n", getName(), this,
+                  asked.Rate, asked.DataBits, asked.Parity, asked.StopBits,
+                  accepted.Rate, accepted.DataBits, accepted.Parity, accepted.StopBits);
+            lineCodingTaken = false;
+        }
+        if ( !(accepted.Rate & kBaudDivisorFlag) )
+            acceptedRate = accepted.Rate;
+    }
+    
+    // The line coding cache and the modem line cache belong to the gated side too
+    IOLockLock( fPort->serialRequestLock );
+    if ( !lineCodingTaken )
+        fLineCodingValid = false;
+    if ( acceptedRate )
+        fCurrentBaud = acceptedRate;
+    if ( block->Request.bRequest == BREAK_REQUEST && block->Request.wValue == BREAK_ON )
+        clock_get_uptime( &fBreakOnTime );  // the break is on the line from here, see breakDelay
+    if ( block->Request.bRequest == SET_CONTROL_REQUEST && ior != kIOReturnSuccess )
+        fControlLinesValid = false;         // send the next update whatever it is
+    fControlHead = (fControlHead + 1) % kControlQueueSize;
+    fControlCount--;
+    more = (fControlCount != 0);
+    fControlBusy = more;
+    wake = (fControlWaiters != 0);
+    IOLockUnlock( fPort->serialRequestLock );
+    
+    // drainControlRequests and breakDelay, see controlSleep
+    if ( wake )
+    {
+        fCommandGate->commandWakeup( &fControlBusy );
+        fCommandGate->commandWakeup( &fBreakOnTime );
+        if ( fWakeTimer && !fWorkLoop->inGate() )
+            fWakeTimer->setTimeoutUS( 1 );
+    }
+    
+    return more;
+    
+}/* end finishControlRequest */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::controlRequestComplete
+//
+//      Inputs:     obj - me, ior - completion status, remaining - bytes not transferred
+//
+//      Outputs:
+//
+//      Desc:       A queued control request is done, send the next one.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::controlRequestComplete( void *obj, void *param, IOReturn ior, UInt32 remaining )
+{
+    me_nozap_driver_PL2303  *me = (me_nozap_driver_PL2303*)obj;
+    
+    if ( ior != kIOReturnSuccess )
+        DEBUG_IOLog(3,"%s(%p)::controlRequestComplete - request 0x%x: %p \n", me->getName(), me, me->fControlRequests[me->fControlHead].Request.bRequest, ior);
+    
+    if ( me->finishControlRequest( ior, remaining ) )
+        me->startControlRequest();
+    
+}/* end controlRequestComplete */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::drainControlRequests
+//
+//      Inputs:
+//
+//      Outputs:    return - true when no request is on the bus any more, only then may
+//                  the queue be reset
+//
+//      Desc:       Wait up to kControlDrainMS for the queued control requests to go out.
+//                  After an unplug only the one on the bus is waited for. Past that the
+//                  waiting ones are dropped and the default pipe is aborted, and the one
+//                  on the bus gets kControlTimeoutMS more to complete.
+//
+/****************************************************************************************************/
+
+bool me_nozap_driver_PL2303::drainControlRequests( void )
+{
+    IOUSBPipe   *pipe;
+    UInt64      deadline, now;
+    bool        aborted = false;
+    bool        busy, sleep;
+    
+    if ( !fPort )
+        return true;
+    
+    clock_interval_to_deadline( kControlDrainMS, kMillisecondScale, &deadline );
+    for (;;)
+    {
+        clock_get_uptime( &now );
+        IOLockLock( fPort->serialRequestLock );
+        if ( (fTerminate || aborted) && fControlBusy )
+            fControlCount = 1;
+        busy = fControlBusy;
+        sleep = busy && now < deadline;
+        if ( sleep )
+            fControlWaiters++;
+        IOLockUnlock( fPort->serialRequestLock );
+        
+        if ( !busy )
+            return true;
+        if ( sleep )
+        {
+            controlSleep( &fControlBusy, deadline );
+            continue;
+        }
+        if ( aborted )
+        {
+            IOLog("%s(%p)::drainControlRequests - request 0x%x never completed\n", getName(), this,
+                  fControlRequests[fControlHead].Request.bRequest);
+            return false;
+        }
+        
+        IOLog("%s(%p)::drainControlRequests - control requests still queued, aborting\n", getName(), this);
+        IOLockLock( fPort->serialRequestLock );
+        if ( fControlBusy )
+            fControlCount = 1;              // only the one on the bus is left
+        IOLockUnlock( fPort->serialRequestLock );
+        pipe = fpDevice ? fpDevice->GetPipeZero() : NULL;
+        if ( pipe )
+            pipe->Abort();
+        aborted = true;
+        clock_interval_to_deadline( kControlTimeoutMS, kMillisecondScale, &deadline );
+    }
+    
+}/* end drainControlRequests */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::controlSleep
+//
+//      Inputs:     event - &fControlBusy or &fBreakOnTime, deadline - when to give up
+//
+//      Outputs:
+//
+//      Desc:       Wait for finishControlRequest to wake event, at most until deadline. The
+//                  caller checked what it waits for and counted itself in fControlWaiters
+//                  under serialRequestLock, we take it out again. In the gate the gate is
+//                  given up meanwhile so the other gated callers get on, message() calls us
+//                  outside it and there we only nap.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::controlSleep( void *event, UInt64 deadline )
+{
+    if ( fWorkLoop && fWorkLoop->inGate() )
+    {
+        retain();
+        fCommandGate->retain();
+        fCommandGate->commandSleep( event, deadline, THREAD_UNINT );
+        fCommandGate->release();
+        release();
+    } else {
+        IOSleep( 1 );
     }
-	DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - Bits: %d \n", getName(), this,  buf[6]);
-	
-	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
-    request.bRequest = SET_LINE_REQUEST;
-	request.wValue =  0;
-	request.wIndex = 0;
-	request.wLength = 2;
-	request.pData = buf;
-	rtn =  fpDevice->DeviceRequest(&request);
-	DEBUG_IOLog(3,"%s(%p)::setSerialConfiguration - return: %p \n", getName(), this,  rtn);
-	IOFree( buf, 10 );
-	
     
+    IOLockLock( fPort->serialRequestLock );
+    fControlWaiters--;
+    IOLockUnlock( fPort->serialRequestLock );
     
-	return rtn;
-}/* end SetSpeed */
+}/* end controlSleep */
 
 
 /* QueuePrimatives  */
@@ -3635,35 +5027,23 @@ IOReturn me_nozap_driver_PL2303::setSerialConfiguration( void )
 
 QueueStatus me_nozap_driver_PL2303::addBytetoQueue( CirQueue *Queue, char Value )
 {
-    /* Check to see if there is space by comparing the next pointer,    */
-    /* with the last, If they match we are either Empty or full, so     */
-    /* check the InQueue of being zero.                 */
+    UInt8       Byte = Value;
+    size_t      Added;
     DEBUG_IOLog(4,"me_nozap_driver_PL2303(%p)::AddBytetoQueue\n", this );
 	
-    if ( !(fPort && fPort->serialRequestLock ) ) goto Fail;
-	DEBUG_IOLog(2,"me_nozap_driver_PL2303::addBytetoQueue IOLockLock( port->serialRequestLock );\n" );
-	
-    IOLockLock( fPort->serialRequestLock );
-	
-    if ( (Queue->NextChar == Queue->LastChar) && Queue->InQueue ) {
-		DEBUG_IOLog(2,"me_nozap_driver_PL2303::addBytetoQueue IOLockUnLock( port->serialRequestLock ); kQueueFull\n" );
-        
-		IOLockUnlock( fPort->serialRequestLock);
-		return kQueueFull;
-	}
-	
-    *Queue->NextChar++ = Value;
-    Queue->InQueue++;
+    if ( !(fPort && fPort->TXLock ) ) goto Fail;
 	
-	/* Check to see if we need to wrap the pointer. */
+    // TX has several producers, they take turns under the TX lock
+    if ( Queue == &fPort->TX )
+        IOLockLock( fPort->TXLock );
 	
-    if ( Queue->NextChar >= Queue->Start )
-		Queue->NextChar =  Queue->Start;
+    Added = copyintoQueue( Queue, &Byte, 1 );
     
-	DEBUG_IOLog(2,"me_nozap_driver_PL2303::addBytetoQueue IOLockUnLock( port->serialRequestLock ); kQueueNoError\n" );
-	
-    IOLockUnlock( fPort->serialRequestLock);
-    return kQueueNoError;
+    if ( Queue == &fPort->TX )
+        IOLockUnlock( fPort->TXLock );
+    
+    if ( Added )
+        return kQueueNoError;
     
 Fail:
     return kQueueFull;       // for lack of a better error
@@ -3687,47 +5067,9 @@ QueueStatus me_nozap_driver_PL2303::getBytetoQueue( CirQueue *Queue, UInt8 *Valu
     DEBUG_IOLog(4,"%s(%p)::GetBytetoQueue\n", getName(), this );
 	
     if( !(fPort && fPort->serialRequestLock) ) goto Fail;
-	DEBUG_IOLog(2,"me_nozap_driver_PL2303::getBytetoQueue IOLockLock( port->serialRequestLock ); \n" );
-    
-    IOLockLock( fPort->serialRequestLock );
-	
-	/* Check to see if the queue has something in it.   */
-	
-    if ( (Queue->NextChar == Queue->LastChar) && !Queue->InQueue ) {
-		DEBUG_IOLog(2,"me_nozap_driver_PL2303::getBytetoQueue IOLockUnLock( port->serialRequestLock ); kQueueEmpty\n" );
-        
-		IOLockUnlock(fPort->serialRequestLock);
-		return kQueueEmpty;
-	}
-    
-#if FIX_PARITY_PROCESSING
-    // If queue has only one byte, check with timestamp, to allow cooldown grace period
-    if(Queue->InQueue == 1) {
-        clock_sec_t			secs;
-        clock_nsec_t        nanosecs;
-        clock_get_system_nanotime(&secs, &nanosecs);
-        if( secs == _fReadTimestampSecs && nanosecs < _fReadTimestampNanosecs + LAST_BYTE_COOLDOWN ) {
-            // Pretend it is empty
-            DEBUG_IOLog(2,"me_nozap_driver_PL2303::getBytetoQueue IOLockUnLock( port->serialRequestLock ); (cooldown - queue empty)\n" );
-            
-            IOLockUnlock(fPort->serialRequestLock);
-            return kQueueEmpty;
-        }
-    }
-#endif
-    
-    *Value = *Queue->LastChar++;
-    Queue->InQueue--;
-	
-	/* Check to see if we need to wrap the pointer. */
-	
-    if ( Queue->LastChar >= Queue->End )
-		Queue->LastChar =  Queue->Start;
-	
-	DEBUG_IOLog(2,"me_nozap_driver_PL2303::getBytetoQueue IOLockUnLock( port->serialRequestLock ); kQueueNoError\n" );
 	
-    IOLockUnlock(fPort->serialRequestLock);
-    return kQueueNoError;
+    if ( copyfromQueue( Queue, Value, 1 ) )
+        return kQueueNoError;
     
 Fail:
     return kQueueEmpty;          // can't get to it, pretend it's empty
@@ -3748,30 +5090,20 @@ Fail:
 
 QueueStatus me_nozap_driver_PL2303::peekBytefromQueue( CirQueue *Queue, UInt8 *Value, size_t offset = 0)
 {
+    size_t      Added;
+    size_t      Removed;
     DEBUG_IOLog(4,"%s(%p)::peekBytefromQueue\n", getName(), this );
     
-    if( !(fPort && fPort->serialRequestLock) ) goto Fail;
-	DEBUG_IOLog(2,"me_nozap_driver_PL2303::peekBytefromQueue IOLockLock( port->serialRequestLock ); \n" );
-    
-    IOLockLock( fPort->serialRequestLock );
+    if( !(fPort && fPort->serialRequestLock) || !Queue->Size ) goto Fail;
     
-	/* Check to see if the queue has something in it.   */
+	/* Check to see if the queue has something in it, only the consumer peeks   */
     
-    if ( ((Queue->NextChar == Queue->LastChar) && !Queue->InQueue) || Queue->InQueue <= offset ) {
-		DEBUG_IOLog(2,"me_nozap_driver_PL2303::peekBytefromQueue IOLockUnLock( port->serialRequestLock ); kQueueEmpty\n" );
-        
-		IOLockUnlock(fPort->serialRequestLock);
+    Removed = Queue->Removed;
+    Added = __atomic_load_n( &Queue->Added, __ATOMIC_ACQUIRE );
+    if ( (Added - Removed) <= offset )
 		return kQueueEmpty;
-	}
-    
-    if(Queue->LastChar + offset >= Queue->End) {
-        *Value = *( Queue->Start + (offset - (Queue->End - Queue->LastChar)) );
-    } else
-        *Value = Queue->LastChar[offset];
-    
-	DEBUG_IOLog(2,"me_nozap_driver_PL2303::peekBytefromQueue IOLockUnLock( port->serialRequestLock ); kQueueNoError\n" );
     
-    IOLockUnlock(fPort->serialRequestLock);
+    *Value = Queue->Start[(Removed + offset) % Queue->Size];
     
 	DEBUG_IOLog(5,"me_nozap_driver_PL2303::peekBytefromQueue offset = %u [0x%02x]\n", (unsigned) offset, *Value );
     return kQueueNoError;
@@ -3800,9 +5132,8 @@ QueueStatus me_nozap_driver_PL2303::initQueue( CirQueue *Queue, UInt8 *Buffer, s
     Queue->Start    = Buffer;
     Queue->End      = (UInt8*)((size_t)Buffer + Size);
     Queue->Size     = Size;
-    Queue->NextChar = Buffer;
-    Queue->LastChar = Buffer;
-    Queue->InQueue  = 0;
+    Queue->Added    = 0;
+    Queue->Removed  = 0;
 	
     IOSleep( 1 );
     
@@ -3828,9 +5159,9 @@ QueueStatus me_nozap_driver_PL2303::closeQueue( CirQueue *Queue )
 	
     Queue->Start    = 0;
     Queue->End      = 0;
-    Queue->NextChar = 0;
-    Queue->LastChar = 0;
     Queue->Size     = 0;
+    Queue->Added    = 0;
+    Queue->Removed  = 0;
 	
     return kQueueNoError;
     
@@ -3852,11 +5183,14 @@ QueueStatus me_nozap_driver_PL2303::flush( CirQueue *Queue )
 {
     DEBUG_IOLog(4,"%s(%p)::flush\n", getName(), this );
 	
-    Queue->NextChar = Queue->LastChar = Queue->Start;
+    // Called by the consumer: drop everything the producer has published so far
+    __atomic_store_n( &Queue->Removed, __atomic_load_n( &Queue->Added, __ATOMIC_ACQUIRE ), __ATOMIC_RELEASE );
+    if ( fPort && (Queue == &fPort->RX) )
+        dropRXErrors();
 	
     return kQueueNoError;
     
-}/* end CloseQueue */
+}/* end flush */
 
 /****************************************************************************************************/
 //
@@ -3866,7 +5200,8 @@ QueueStatus me_nozap_driver_PL2303::flush( CirQueue *Queue )
 //
 //      Outputs:    BytesWritten - Number of bytes actually put in the queue.
 //
-//      Desc:       Add an entire buffer to the queue.
+//      Desc:       Add an entire buffer to the queue. RX is filled by its single producer
+//                  without locking, TX producers are serialized by the TXLock.
 //
 /****************************************************************************************************/
 
@@ -3875,16 +5210,17 @@ size_t me_nozap_driver_PL2303::addtoQueue( CirQueue *Queue, UInt8 *Buffer, size_
     size_t      BytesWritten = 0;
     DEBUG_IOLog(4,"%s(%p)::AddtoQueue\n", getName(), this );
 	
-    while ( freeSpaceinQueue( Queue ) && (Size > BytesWritten) )
-	{
-#if FIX_PARITY_PROCESSING
-        if(*Buffer == 0xff)
-            addBytetoQueue(Queue, 0xff);
-#endif
-		addBytetoQueue( Queue, *Buffer++ );
-		BytesWritten++;
-	}
+    if ( !(fPort && fPort->TXLock ) ) goto Fail;
+	
+    if ( Queue == &fPort->TX )
+        IOLockLock( fPort->TXLock );
+	
+    BytesWritten = copyintoQueue( Queue, Buffer, Size );
+	
+    if ( Queue == &fPort->TX )
+        IOLockUnlock( fPort->TXLock );
 	
+Fail:
     return BytesWritten;
     
 }/* end AddtoQueue */
@@ -3897,24 +5233,23 @@ size_t me_nozap_driver_PL2303::addtoQueue( CirQueue *Queue, UInt8 *Buffer, size_
 //
 //      Outputs:    Buffer - Where to put the data, BytesReceived - Number of bytes actually put in Buffer.
 //
-//      Desc:       Get a buffers worth of data from the queue.
+//      Desc:       Get a buffers worth of data from the queue. Only the queue's consumer
+//                  calls this, so no lock is needed.
 //
 /****************************************************************************************************/
 
 size_t me_nozap_driver_PL2303::removefromQueue( CirQueue *Queue, UInt8 *Buffer, size_t MaxSize )
 {
     size_t      BytesReceived = 0;
-    UInt8       Value;
     DEBUG_IOLog(4,"%s(%p)::RemovefromQueue\n", getName(), this );
     
-    while( (MaxSize > BytesReceived) && (getBytetoQueue(Queue, &Value) == kQueueNoError) )
-	{
-		*Buffer++ = Value;
-		BytesReceived++;
-	}/* end while */
+    if( !(fPort && fPort->serialRequestLock) ) goto Fail;
 	
+    BytesReceived = copyfromQueue( Queue, Buffer, MaxSize );
+	
+Fail:
     return BytesReceived;
-    
+	
 }/* end RemovefromQueue */
 
 /****************************************************************************************************/
@@ -3931,21 +5266,9 @@ size_t me_nozap_driver_PL2303::removefromQueue( CirQueue *Queue, UInt8 *Buffer,
 
 size_t me_nozap_driver_PL2303::freeSpaceinQueue( CirQueue *Queue )
 {
-    size_t  retVal = 0;
     DEBUG_IOLog(6,"%s(%p)::FreeSpaceinQueue\n", getName(), this );
 	
-    if( !(fPort && fPort->serialRequestLock ) ) goto Fail;
-	DEBUG_IOLog(6,"me_nozap_driver_PL2303::freeSpaceinQueue IOLockLock( port->serialRequestLock );\n");
-    
-	IOLockLock( fPort->serialRequestLock );
-	
-    retVal = Queue->Size - Queue->InQueue;
- 	DEBUG_IOLog(6,"me_nozap_driver_PL2303::freeSpaceinQueue IOLockUnLock( port->serialRequestLock );\n");
-    
-    IOLockUnlock(fPort->serialRequestLock);
-    
-Fail:
-    return retVal;
+    return Queue->Size - usedSpaceinQueue( Queue );
     
 }/* end FreeSpaceinQueue */
 
@@ -3963,9 +5286,17 @@ Fail:
 
 size_t me_nozap_driver_PL2303::usedSpaceinQueue( CirQueue *Queue )
 {
+    size_t  Removed;
+    size_t  Used;
     DEBUG_IOLog(6,"%s(%p)::UsedSpaceinQueue\n", getName(), this );
     
-    return Queue->InQueue;
+    // Removed first: it never passes Added, so the difference can't go negative
+    Removed = __atomic_load_n( &Queue->Removed, __ATOMIC_ACQUIRE );
+    Used = __atomic_load_n( &Queue->Added, __ATOMIC_ACQUIRE ) - Removed;
+    if ( Used > Queue->Size )
+        Used = Queue->Size;
+    
+    return Used;
     
 }/* end UsedSpaceinQueue */
 
@@ -4003,9 +5334,11 @@ size_t me_nozap_driver_PL2303::getQueueSize( CirQueue *Queue )
 
 QueueStatus me_nozap_driver_PL2303::getQueueStatus( CirQueue *Queue )
 {
-    if ( (Queue->NextChar == Queue->LastChar) && Queue->InQueue )
+    size_t  Used = usedSpaceinQueue( Queue );
+    
+    if ( Used && (Used == Queue->Size) )
         return kQueueFull;
-    else if ( (Queue->NextChar == Queue->LastChar) && !Queue->InQueue )
+    else if ( !Used )
         return kQueueEmpty;
     
     return kQueueNoError ;
@@ -4020,77 +5353,97 @@ QueueStatus me_nozap_driver_PL2303::getQueueStatus( CirQueue *Queue )
 //
 //      Outputs:    None
 //
-//      Desc:       Checks the various queue's etc and manipulates the state(s) accordingly
+//      Desc:       Checks the various queue's etc and manipulates the state(s) accordingly.
+//                  Re-applies the flow control for RX even when no queue bit moved, for
+//                  changes of size, marks or flow control mode. Data movement uses the
+//                  incremental checkTXQueue / checkRXQueue instead.
 //
 /****************************************************************************************************/
 
 void me_nozap_driver_PL2303::checkQueues( PortInfo_t *port )
 {
-    unsigned long   Used;
-    unsigned long   Free;
-    unsigned long   QueuingState;
-    unsigned long   DeltaState;
-    UInt32	SW_FlowControl;
-    UInt32	RTS_FlowControl;
-    UInt32	DTR_FlowControl;
     DEBUG_IOLog(6,"%s(%p)::CheckQueues\n", getName(), this );
-	
-    // Initialise the QueueState with the current state.
-	
-    QueuingState = readPortState( port );
     
-    Used = usedSpaceinQueue( &port->TX );
-    Free = freeSpaceinQueue( &port->TX );
-    if ( Free == 0 )
-	{
-        
-		QueuingState |=  PD_S_TXQ_FULL;
-		QueuingState &= ~PD_S_TXQ_EMPTY;
-	}
-	else if ( Used == 0 )
-	{
-		QueuingState &= ~PD_S_TXQ_FULL;
-		QueuingState |=  PD_S_TXQ_EMPTY;
-	}
-	else
-	{
-		QueuingState &= ~PD_S_TXQ_FULL;
-		QueuingState &= ~PD_S_TXQ_EMPTY;
-	}
+    checkTXQueue( port );
+    checkRXQueue( port, true );
     
-	
-	/* Check to see if we are below the low water mark. */
-    if ( Used < port->TXStats.LowWater )
-		QueuingState |=  PD_S_TXQ_LOW_WATER;
-	else QueuingState &= ~PD_S_TXQ_LOW_WATER;
-	
-    if ( Used > port->TXStats.HighWater )
-        
-		QueuingState |= PD_S_TXQ_HIGH_WATER;
-	else QueuingState &= ~PD_S_TXQ_HIGH_WATER;
+}/* end CheckQueues */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::queueBits
+//
+//      Inputs:     Queue - the queue, Stats - its marks, empty/full/low/high - the state bits to use
+//
+//      Outputs:    the state bits that apply to the queue now
+//
+//      Desc:       Derive the empty, full, low and high water bits from the queue level.
+//
+/****************************************************************************************************/
+
+UInt32 me_nozap_driver_PL2303::queueBits( CirQueue *Queue, BufferMarks *Stats, UInt32 empty, UInt32 full, UInt32 low, UInt32 high )
+{
+    return queueLevelBits( usedSpaceinQueue( Queue ), Queue->Size, Stats->LowWater, Stats->HighWater,
+                           empty, full, low, high );
     
+}/* end queueBits */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::checkTXQueue
+//
+//      Inputs:     port - the port to check
+//
+//      Outputs:    None
+//
+//      Desc:       Called as the TX queue moves. Only goes to changeState when one of the
+//                  TX queue bits crossed a boundary.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::checkTXQueue( PortInfo_t *port )
+{
+    const UInt32    mask = PD_S_TXQ_EMPTY | PD_S_TXQ_FULL | PD_S_TXQ_LOW_WATER | PD_S_TXQ_HIGH_WATER;
+    UInt32          bits;
     
-	/* Check to see if there is anything in the Receive buffer. */
-    Used = usedSpaceinQueue( &port->RX );
-    Free = freeSpaceinQueue( &port->RX );
-	
-    if ( Free == 0 )
-	{
-		QueuingState |= PD_S_RXQ_FULL;
-		QueuingState &= ~PD_S_RXQ_EMPTY;
-	}
-	else if ( Used == 0 )
-	{
-		QueuingState &= ~PD_S_RXQ_FULL;
-		QueuingState |= PD_S_RXQ_EMPTY;
-	}
-	else
-	{
-		QueuingState &= ~PD_S_RXQ_FULL;
-		QueuingState &= ~PD_S_RXQ_EMPTY;
-	}
-	
+    port->QueueChecks++;
+    bits = queueBits( &port->TX, &port->TXStats, PD_S_TXQ_EMPTY, PD_S_TXQ_FULL, PD_S_TXQ_LOW_WATER, PD_S_TXQ_HIGH_WATER );
+    if ( bits == (readPortState( port ) & mask) )
+        return;
+    
+    port->QueueUpdates++;
+    changeState( port, bits, mask );
+    
+}/* end checkTXQueue */
+
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::checkRXQueue
+//
+//      Inputs:     port - the port to check, force - apply flow control even if nothing moved
+//
+//      Outputs:    None
+//
+//      Desc:       Called as the RX queue moves. Flow control (XON/XOFF, RTS, DTR) is only
+//                  looked at when the level crosses a water mark, and the lines go out
+//                  through changeState together with the queue bits.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::checkRXQueue( PortInfo_t *port, bool force )
+{
+    UInt32  mask = PD_S_RXQ_EMPTY | PD_S_RXQ_FULL | PD_S_RXQ_LOW_WATER | PD_S_RXQ_HIGH_WATER;
+    UInt32  bits;
+    UInt32	SW_FlowControl;
+    UInt32	RTS_FlowControl;
+    UInt32	DTR_FlowControl;
+    
+    port->QueueChecks++;
+    bits = queueBits( &port->RX, &port->RXStats, PD_S_RXQ_EMPTY, PD_S_RXQ_FULL, PD_S_RXQ_LOW_WATER, PD_S_RXQ_HIGH_WATER );
+    if ( !force && bits == (readPortState( port ) & mask) )
+        return;
     
+    port->QueueUpdates++;
     
     SW_FlowControl  = port->FlowControl & PD_RS232_A_RXO;
     RTS_FlowControl = port->FlowControl & PD_RS232_A_RTS;
@@ -4098,7 +5451,7 @@ void me_nozap_driver_PL2303::checkQueues( PortInfo_t *port )
 	
 	/* Check to see if we are below the low water mark. */
     
-    if (Used < port->RXStats.LowWater)			    // if under low water mark, release any active flow control
+    if ( bits & PD_S_RXQ_LOW_WATER )			    // if under low water mark, release any active flow control
     {
         if ((SW_FlowControl) && (port->xOffSent))	    // unblock xon/xoff flow control
         {
@@ -4108,25 +5461,17 @@ void me_nozap_driver_PL2303::checkQueues( PortInfo_t *port )
             addBytetoQueue(&(port->TX), port->XONchar);
             setUpTransmit( );
         }
-		if (RTS_FlowControl && !port->RTSAsserted)	    // unblock RTS flow control
-        {
-            port->RTSAsserted = true;
-            port->State |= PD_RS232_S_RFR;
-        }
-		if (DTR_FlowControl && !port->DTRAsserted)	    // unblock DTR flow control
-        {
-            port->DTRAsserted = true;
-            
-            port->State |= PD_RS232_S_DTR;
-        }
-        QueuingState |= PD_S_RXQ_LOW_WATER;
-    } else {
-        QueuingState &= ~PD_S_RXQ_LOW_WATER;
     }
     
+    // unblock RTS/DTR flow control below low water, block it above high water
+    rxFlowLine( RTS_FlowControl, bits & PD_S_RXQ_LOW_WATER, bits & PD_S_RXQ_HIGH_WATER, &port->RTSAsserted,
+                PD_RS232_S_RFR, &bits, &mask );
+    rxFlowLine( DTR_FlowControl, bits & PD_S_RXQ_LOW_WATER, bits & PD_S_RXQ_HIGH_WATER, &port->DTRAsserted,
+                PD_RS232_S_DTR, &bits, &mask );
+    
 	// Check to see if we are above the high water mark
     
-    if (Used > port->RXStats.HighWater)			    // if over highwater mark, block w/any flow control thats enabled
+    if ( bits & PD_S_RXQ_HIGH_WATER )			    // if over highwater mark, block w/any flow control thats enabled
     {
         if ((SW_FlowControl) && (!port->xOffSent))
         {
@@ -4136,36 +5481,22 @@ void me_nozap_driver_PL2303::checkQueues( PortInfo_t *port )
             addBytetoQueue(&(port->TX), port->XOFFchar);
             setUpTransmit( );
         }
-		if (RTS_FlowControl && port->RTSAsserted)
-        {
-            port->RTSAsserted = false;
-            port->State &= ~PD_RS232_S_RFR;			    // lower RTS to hold back more rx data
-        }
-        if (DTR_FlowControl && port->DTRAsserted)
-        {
-            port->DTRAsserted = false;
-            port->State &= ~PD_RS232_S_DTR;
-        }
-        QueuingState |= PD_S_RXQ_HIGH_WATER;
     } else {
-        QueuingState &= ~PD_S_RXQ_HIGH_WATER;
 		port->aboveRxHighWater = false;
     }
     
-	/* Figure out what has changed to get mask.*/
-    DeltaState = QueuingState ^ readPortState( port );
-    changeState( port, QueuingState, DeltaState );
+    changeState( port, bits, mask );
 	
     return;
     
-}/* end CheckQueues */
+}/* end checkRXQueue */
 
 
 /****************************************************************************************************/
 //
 //      Method:     me_nozap_driver_PL2303::SetUpTransmit
 //
-//      Inputs:
+//      Inputs:     flush - send everything now, ignoring the write combining window
 //
 //      Outputs:    return code - true (transmit started), false (transmission already in progress)
 //
@@ -4173,73 +5504,133 @@ void me_nozap_driver_PL2303::checkQueues( PortInfo_t *port )
 //
 /****************************************************************************************************/
 
-bool me_nozap_driver_PL2303::setUpTransmit( void )
+bool me_nozap_driver_PL2303::setUpTransmit( bool flush )
 {
     size_t      count = 0;
     size_t      data_Length = 0;
-    UInt8       *TempOutBuffer;
+    size_t      used;
+    WriteRequest    *request;
+    bool        started = false;
+    bool        hold = false;
+    bool        waiting = false;
 	
 	DEBUG_IOLog(2,"%s(%p)::SetUpTransmit\n", getName(), this);
     
-	//  If we are already in the cycle of transmitting characters,
-	//  then we do not need to do anything.
+    if ( !(fPort && fPort->TXLock && fWriteCount) )
+        return false;
+    
+	//  Only one thread fills and submits buffers, so the transfers leave in queue order.
+	//  If another one is at it, it picks up our data before it stops.
 	
-    if ( fPort->AreTransmitting == TRUE )
+    IOLockLock( fPort->TXLock );
+    if ( flush )
+        fWriteFlush = true;
+    if ( fWriteSubmitting )
+    {
+        fWriteAgain = true;
+        IOLockUnlock( fPort->TXLock );
 		return false;
-	
-	
-    //if ( GetQueueStatus( &fPort->TX ) != queueEmpty )
-    if (usedSpaceinQueue(&fPort->TX) > 0)
-	{
-		//data_Length = fIrDA->TXBufferAvailable();
+    }
+    fWriteSubmitting = true;
+    
+    do
+    {
+        fWriteAgain = false;
         
-		data_Length = MAX_BLOCK_SIZE; // remove maximum 10 bytes from queue
-		if ( data_Length == 0 )
-		{
-			DEBUG_IOLog(4,"%s(%p)::SetUpTransmit - No space in TX buffer available\n", getName(), this);
+        for (;;)
+        {
+            request = &fWriteRequests[fWriteNext];
             
-			return false;
-		}
-		
-		if ( data_Length > MAX_BLOCK_SIZE )
-		{
-			data_Length = MAX_BLOCK_SIZE;
-		}
-		
-		TempOutBuffer = (UInt8*)IOMalloc( data_Length );
-		if ( !TempOutBuffer )
-		{
-			DEBUG_IOLog(4,"%s(%p)::SetUpTransmit - buffer allocation problem\n", getName(), this);
-			return false;
-		}
-		bzero( TempOutBuffer, data_Length );
-		
-		// Fill up the buffer with 1 character from the queue
-		//		count = removefromQueue( &fPort->TX, TempOutBuffer, data_Length );
-		// BJA Aanpassing stuurt karakter voor karakter
-		count = removefromQueue( &fPort->TX, TempOutBuffer, 1 );
-		
-		fPort->AreTransmitting = TRUE;
-		changeState( fPort, PD_S_TX_BUSY, PD_S_TX_BUSY );
-		
-		startTransmit(0, NULL, count, TempOutBuffer );      // do the "transmit" -- send to IrCOMM
-        //BJA Dit is niet goed, we moeten dit uitzetten als we een ack hebben van de pl2303, dus datawritecomplete
-        //		changeState( fPort, 0, PD_S_TX_BUSY );
-        //		fPort->AreTransmitting = false;
-		
-		IOFree( TempOutBuffer, data_Length );
-		
+            // All buffers are on the bus, the next completion continues
+            used = usedSpaceinQueue( &fPort->TX );
+            waiting = request->Pending && !fTerminate && used;
+            if ( request->Pending || fTerminate || (used == 0) )
+                break;
+            
+            // Write combining: a few bytes wait for company, up to WriteDelay
+            hold = writeHold( fPort->WriteDelay, fPort->MinLatency, fWriteFlush,
+                              used, fPort->WriteThreshold, fPort->TXStats.HighWater );
+            if ( hold )
+                break;
+            
+            IOLockUnlock( fPort->TXLock );
+            
+            data_Length = fPort->WriteBatch; // send up to a whole batch per transfer
+            if ( data_Length > MAX_BLOCK_SIZE )
+            {
+                data_Length = MAX_BLOCK_SIZE;
+            }
+            
+            // Fill the out-pipe buffer straight from the queue
+            count = removefromQueue( &fPort->TX, request->Buffer, data_Length );
+            
+            if ( count && (startTransmit( request, count ) == kIOReturnSuccess) )
+            {
+                fWriteNext = (fWriteNext + 1) % fWriteCount;
+                started = true;
+            }
+            
+            IOLockLock( fPort->TXLock );
+            if ( !count || !request->Pending )
+                break;
+        }
+    } while ( fWriteAgain && !fTerminate );
+    
+    // A flush only outlives this call while its data waits for a buffer to come back,
+    // the completion then sends it without holding. Every other way out ends it.
+    if ( !waiting || (usedSpaceinQueue( &fPort->TX ) == 0) )
+        fWriteFlush = false;
+    
+    if ( hold && !fWriteTimerArmed && fWriteTimer )
+    {
+        fWriteTimerArmed = true;
+        fWriteTimer->setTimeoutUS( fPort->WriteDelay );
+    }
+    
+    fWriteSubmitting = false;
+    IOLockUnlock( fPort->TXLock );
+	
+    if ( started )
+    {
 		// We potentially removed a bunch of stuff from the
 		// queue, so see if we can free some thread(s)
 		// to enqueue more stuff.
 		
-		checkQueues( fPort );
+		checkTXQueue( fPort );
     }
 	
-    return true;
+    return started;
     
 }/* end SetUpTransmit */
 
+/****************************************************************************************************/
+//
+//      Method:     me_nozap_driver_PL2303::writeTimeout
+//
+//      Inputs:     owner - this driver, sender - fWriteTimer
+//
+//      Outputs:
+//
+//      Desc:       The write combining window closed, send whatever has been queued.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::writeTimeout( OSObject *owner, IOTimerEventSource *sender )
+{
+    me_nozap_driver_PL2303  *me = (me_nozap_driver_PL2303 *)owner;
+    
+    if ( !me || !me->fPort || !me->fPort->TXLock )
+        return;
+    
+    IOLockLock( me->fPort->TXLock );
+    me->fWriteTimerArmed = false;
+    IOLockUnlock( me->fPort->TXLock );
+    
+    if ( !me->fTerminate )
+        me->setUpTransmit( true );
+    
+}/* end writeTimeout */
+
 
 /****************************************************************************************************/
 //
@@ -4253,21 +5644,30 @@ bool me_nozap_driver_PL2303::setUpTransmit( void )
 //
 /****************************************************************************************************/
 IOReturn me_nozap_driver_PL2303::setControlLines( PortInfo_t *port ){
-	UInt32 state = port->State;
+	UInt32 state;
 	IOReturn rtn;
 	IOUSBDevRequest request;
+    bool start = false;
+    
+    if ( !fpDevice )
+        return kIOReturnNotAttached;
+    
+    // Decide and queue under the lock, so concurrent callers cannot queue out of order
+    IOLockLock( port->serialRequestLock );
+    state = readPortState( port );
     
     DEBUG_IOLog(4,"%s(%p)::setControlLines state %p \n", getName(), this, state );
 	
-    UInt8 value=0;
-    
-    if (state & PD_RS232_S_DTR)  { value |= kCONTROL_DTR;
-	    DEBUG_IOLog(5,"setControlLines DTR ON \n" );
-    }
-    if (state & PD_RS232_S_RFR)  {value |= kCONTROL_RTS;
-        DEBUG_IOLog(5,"setControlLines RTS ON \n" );
-    }
+    UInt8 value = controlLineValue( state, PD_RS232_S_DTR, PD_RS232_S_RFR );
+    DEBUG_IOLog(5,"setControlLines DTR %d RTS %d \n", (value & CONTROL_DTR) != 0, (value & CONTROL_RTS) != 0 );
 	
+    // The chip already has these lines
+    if ( !controlLinesChanged( value, fControlLines, fControlLinesValid ) )
+    {
+        port->ControlLineSkips++;
+        IOLockUnlock( port->serialRequestLock );
+        return kIOReturnSuccess;
+    }
     
 	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
     request.bRequest = SET_CONTROL_REQUEST;
@@ -4275,7 +5675,17 @@ IOReturn me_nozap_driver_PL2303::setControlLines( PortInfo_t *port ){
 	request.wIndex = 0;
 	request.wLength = 0;
 	request.pData = NULL;
-	rtn =  fpDevice->DeviceRequest(&request);
+	rtn =  addControlRequest(&request, NULL, &start);
+    if ( rtn == kIOReturnSuccess )
+    {
+        fControlLines = value;
+        fControlLinesValid = true;
+        port->ControlLineWrites++;
+    }
+    IOLockUnlock( port->serialRequestLock );
+    
+    if ( start )
+        startControlRequest();
 	DEBUG_IOLog(4,"%s(%p)::setControlLines - return: %p \n", getName(), this,  rtn);
 	
 	return rtn;
@@ -4288,14 +5698,15 @@ IOReturn me_nozap_driver_PL2303::setControlLines( PortInfo_t *port ){
 // or any of the queue level variables are changed by the user.
 // WARNING: {BIGGEST_EVENT ≤ LowWater ≤ (HighWater-BIGGEST_EVENT)} and
 //	{(LowWater-BIGGEST_EVENT) ≤ HighWater ≤ (size-BIGGEST_EVENT)} must be enforced.
+// setWaterMarks enforces it with validWaterMarks, BIGGEST_EVENT being markEvent().
 
 
 UInt32 me_nozap_driver_PL2303::generateRxQState( PortInfo_t *port )
 {
     IOLog("%s(%p)::generateRxQState\n", getName(), this );
     
-    UInt32 state = port->State & (kRxAutoFlow | kTxAutoFlow);
-    UInt32 fifostate = port->State & ( kRxQueueState );
+    UInt32 state = readPortState( port ) & (kRxAutoFlow | kTxAutoFlow);
+    UInt32 fifostate = readPortState( port ) & ( kRxQueueState );
     state = maskMux(state, (UInt32)fifostate >> PD_S_RX_OFFSET, PD_S_RXQ_MASK);
     switch (fifostate) {
         case (PD_S_RXQ_EMPTY | PD_S_RXQ_LOW_WATER) :
@@ -4365,12 +5776,79 @@ IOReturn me_nozap_driver_PL2303::setBreak( bool data){
     
 	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
     request.bRequest = BREAK_REQUEST;
-	request.wValue =  0;
+	request.wValue =  value;
 	request.wIndex = 0;
 	request.wLength = 0;
 	request.pData = NULL;
     
-	rtn =  fpDevice->DeviceRequest(&request);
+    // breakDelay times the break from when the chip takes it, not from now
+    IOLockLock( fPort->serialRequestLock );
+    fBreakOnTime = 0;
+    IOLockUnlock( fPort->serialRequestLock );
+    
+	rtn =  queueControlRequest(&request);
 	DEBUG_IOLog(4,"%s(%p)::setBreak - return: %p \n", getName(), this,  rtn);
+    if ( rtn != kIOReturnSuccess && data )
+    {
+        IOLockLock( fPort->serialRequestLock );
+        clock_get_uptime( &fBreakOnTime );  // nothing to wait for
+        IOLockUnlock( fPort->serialRequestLock );
+    }
 	return rtn;
 }
+
+/****************************************************************************************************/
+//
+//		Function:	breakDelay
+//
+//		Inputs:		us - how long the break should last, in micro seconds
+//
+//		Outputs:	
+//
+//		Desc:		PD_E_DELAY while the break is on. setBreak only queues BREAK_ON, so
+//					wait (up to kControlTimeoutMS) for the chip to take it and sleep out
+//					the rest of the interval from there, then the caller turns it off.
+//
+/****************************************************************************************************/
+
+void me_nozap_driver_PL2303::breakDelay( UInt32 us )
+{
+    UInt64  start = 0;
+    UInt64  now;
+    UInt64  elapsed;
+    UInt64  deadline;
+    bool    sleep;
+    
+    clock_interval_to_deadline( kControlTimeoutMS, kMillisecondScale, &deadline );
+    for (;;)
+    {
+        clock_get_uptime( &now );
+        IOLockLock( fPort->serialRequestLock );
+        start = fBreakOnTime;
+        sleep = !start && now < deadline;
+        if ( sleep )
+            fControlWaiters++;
+        IOLockUnlock( fPort->serialRequestLock );
+        
+        if ( !sleep )
+            break;
+        controlSleep( &fBreakOnTime, deadline );
+    }
+    
+    if ( !start )
+    {
+        IOLog("%s(%p)::breakDelay - break not on after %d ms\n", getName(), this, kControlTimeoutMS);
+        start = now;
+    }
+    
+    clock_get_uptime( &now );
+    absolutetime_to_nanoseconds( now - start, &elapsed );
+    elapsed /= 1000;
+    DEBUG_IOLog(4,"%s(%p)::breakDelay - %d us, %d us since the break went on \n", getName(), this, us, (UInt32)elapsed);
+    if ( elapsed < us )
+    {
+        IOSleep( (UInt32)(us - elapsed) / 1000 );
+        IODelay( (UInt32)(us - elapsed) % 1000 );
+    }
+    
+}/* end breakDelay */
@@ -37,11 +37,9 @@
 #include <IOKit/serial/IOSerialDriverSync.h>
 #include <IOKit/serial/IORS232SerialStreamSync.h>
 #include <IOKit/usb/IOUSBDevice.h>
+#include <IOKit/IOTimerEventSource.h>
 
-#define PROLIFIC_REV_H			0x0202
-#define PROLIFIC_REV_X			0x0300
-#define PROLIFIC_REV_HX_CHIP_D	0x0400
-#define PROLIFIC_REV_1			0x0001
+#include "Driver_PL2303_Util.h"
 
 #define baseName        "Repleo-PL2303-"
 
@@ -50,71 +48,13 @@
 #define propertyTag     "Product Name"
 
 #define MAX_BLOCK_SIZE			PAGE_SIZE
-// was PAGE_SIZE, but due to errors lowered to maximum of 10 characters
+// size of the bulk-out buffer, the largest batch one transfer can carry
 
 #define kXOnChar  '\x11'
 #define kXOffChar '\x13'
 
 
 
-// New Prolific 2303HX supported speeds form Manual ds_pl2303HXD_v1.1.doc
-// Revision Data Apr, 16 2007, Note from prolific (manual page 9):
-// By taking advantage of USB bulk transfer mode, large data buffers,
-// and automatic flow control, PL-2303HX is capable of achieving higher
-// throughput compared to traditional UART (Universal Asynchronous Receiver
-// Transmitter) ports. When real RS232 signaling is not required, baud rate
-// higher than 115200 bps could be used for even higher performance. The
-// flexible baud rate generator of PL-2303HX could be programmed to generate
-// any rate between 75 bps to 12M bps.
-
-// My note, however not all the baudrated may be supported by the driver.
-// The following ones are given for sure (on page 19) other rates maybe
-// available depending on the model.
-
-#define kLinkSpeedIgnored	0
-#define kLinkSpeed75		75
-#define kLinkSpeed150		150
-#define kLinkSpeed300		300
-#define kLinkSpeed600		600
-#define kLinkSpeed1200		1200
-#define kLinkSpeed1800		1800
-#define kLinkSpeed2400		2400
-#define kLinkSpeed3600		3600
-#define kLinkSpeed4800		4800
-#define kLinkSpeed7200		7200
-#define kLinkSpeed9600		9600
-#define kLinkSpeed19200		19200
-#define kLinkSpeed38400		38400
-#define kLinkSpeed57600		57600
-#define kLinkSpeed115200    115200
-#define kLinkSpeed230400	230400
-#define kLinkSpeed460800	460800
-#define kLinkSpeed614400	614400
-#define kLinkSpeed921600	921600
-#define kLinkSpeed1228800	1228800
-#define kLinkSpeed1843200	1843200
-#define kLinkSpeed2457600	2457600
-#define kLinkSpeed3000000	3000000
-#define kLinkSpeed6000000	6000000
-
-#define kDefaultBaudRate    9600
-#define kMaxBaudRate        6000000
-#define kMinBaudRate        75
-
-
-// If not working at very high rate one can reconsider also
-// increasing the size of the circular buffer to store at
-// lease 0.1 sec: before was about 460800/10bits/10= 4608
-// now should be  6000000/10bits/10 = 60Kbytes in the worst case
-// In my code set it to 16K to balance among a convenient
-// speed and memory use.
-
-#define kMaxCirBufferSize   1
-
-
-#define LAST_BYTE_COOLDOWN  100000
-#define BYTE_WAIT_PENALTY   2
-
 #define SPECIAL_SHIFT       (5)
 #define SPECIAL_MASK        ((1<<SPECIAL_SHIFT) - 1)
 #define STATE_ALL           ( PD_RS232_S_MASK | PD_S_MASK )
@@ -169,25 +109,55 @@ enum tXO_State {
 
 
 #define INTERRUPT_BUFF_SIZE 10
-#define USBLapPayLoad       1
-
-#define kUART_STATE			0x08
-
-#define SET_LINE_REQUEST_TYPE		0x21
-#define SET_LINE_REQUEST			0x20
-
-#define SET_CONTROL_REQUEST_TYPE	0x21
-#define SET_CONTROL_REQUEST			0x22
-#define CONTROL_DTR					0x01
-#define CONTROL_RTS					0x02
 
-#define BREAK_REQUEST_TYPE			0x21
-#define BREAK_REQUEST				0x23
-#define BREAK_ON					0xffff
-#define BREAK_OFF					0x0000
+// Bulk-in transfers are a whole number of max size packets, a short
+// packet ends the transfer early. The packet count can be overridden
+// per port with the ReadPackets property.
+#define kDefaultMaxPacketSize   64
+#define kDefaultReadPackets     16
+#define kMaxReadPackets         64
+#define kReadPacketsKey         "ReadPackets"
+
+// Number of bulk-in transfers kept outstanding on the pipe, so it is
+// never idle while a completion is being handled. Can be overridden
+// per port with the ReadAhead property.
+#define kDefaultReadAhead       4
+#define kMaxReadAhead           8
+#define kReadAheadKey           "ReadAhead"
+
+// Bytes taken from the TX queue per bulk-out transfer, at most
+// MAX_BLOCK_SIZE. Can be overridden per port with the WriteBatch property.
+#define kDefaultWriteBatch      MAX_BLOCK_SIZE
+#define kWriteBatchKey          "WriteBatch"
+
+// Number of bulk-out buffers, so the next batch is filled from the TX
+// queue while earlier ones are still on the bus. Can be overridden per
+// port with the WriteBuffers property.
+#define kDefaultWriteBuffers    2
+#define kMaxWriteBuffers        4
+#define kWriteBuffersKey        "WriteBuffers"
+
+// A bulk-out transfer that fails part way is sent again from where it
+// stopped, at most kWriteRetries times, as long as no later buffer is on
+// the bus behind it (that would reorder the data).
+#define kWriteRetries           2
+
+// Optional write combining: while less than WriteThreshold bytes are
+// queued, TX waits up to WriteDelay microseconds for more before sending.
+// 0 (the default) sends at once. MinLatency, PD_E_TXQ_FLUSH, a drain and
+// TX high water all send straight away.
+#define kDefaultWriteDelay      0
+#define kMaxWriteDelay          100000
+#define kWriteDelayKey          "WriteDelay"
+#define kDefaultWriteThreshold  kDefaultMaxPacketSize
+#define kWriteThresholdKey      "WriteThreshold"
+
+// Set VerifyLineCoding to read the line coding back with GET_LINE_REQUEST
+// after each change and log it when the chip did not take it as sent.
+// The reply is checked when it arrives, nobody waits for it.
+#define kVerifyLineCodingKey    "VerifyLineCoding"
 
-#define GET_LINE_REQUEST_TYPE		0xa1
-#define GET_LINE_REQUEST			0x21
+#define kUART_STATE			0x08
 
 #define VENDOR_WRITE_REQUEST_TYPE	0x40
 #define VENDOR_WRITE_REQUEST		0x01
@@ -195,9 +165,6 @@ enum tXO_State {
 #define VENDOR_READ_REQUEST_TYPE	0xc0
 #define VENDOR_READ_REQUEST			0x01
 
-#define SIEMENS_VENDOR_ID			0x11f5
-#define SIEMENS_PRODUCT_ID_X65		0x0003
-
 /*
  * Device Configuration Registers (DCR0, DCR1, DCR2)
  */
@@ -224,14 +191,6 @@ enum tXO_State {
 #define RESET_DOWNSTREAM_DATA_PIPE              0x08
 #define RESET_UPSTREAM_DATA_PIPE                0x09
 
-enum pl2303_type {
-	unknown,
-	type_1,		/* don't know the difference between type 0 and */
-	rev_X,		/* type 1, until someone from prolific tells us... */
-	rev_HX,		/* HX version of the pl2303 chip */
-	rev_H
-};
-
 
 typedef struct BufferMarks
 {
@@ -239,17 +198,56 @@ typedef struct BufferMarks
     unsigned long   HighWater;
     unsigned long   LowWater;
     bool            OverRun;
+    bool            FixedSize;      // size set by PD_E_*Q_SIZE, not derived from the baud rate
+    bool            FixedMarks;     // marks set by PD_E_*Q_HIGH_WATER / LOW_WATER
+    unsigned long   PendingSize;    // default size for the baud rate, waiting for the queue to drain
 } BufferMarks;
 
-typedef struct CirQueue
+// Receive errors are kept out of band, next to the RX queue, so the data
+// bytes are stored verbatim. The list has the same single producer /
+// single consumer discipline as the RX queue it belongs to. An entry is
+// tagged with the last byte received when the chip reported the error and
+// holds every error reported for it; dequeueEvent hands them out one by
+// one and consumes the byte with the last. Errors whose byte was already
+// read are dropped, not charged to the byte that happens to be next.
+#define kRXErrorListSize    32
+
+typedef struct RXError
+{
+    size_t  Position;       // RX queue index (Added count) of the byte in error
+    UInt32  Errors;         // kBreakError, kParityError and kFrameError bits not reported yet
+} RXError;
+
+typedef struct RXErrorList
+{
+    RXError Entries[kRXErrorListSize];
+    size_t  Added;          // written by the RX producer only
+    UInt8   Pad1[kCacheLineSize];
+    size_t  Removed;        // written by the RX consumer only
+    UInt8   Pad2[kCacheLineSize];
+} RXErrorList;
+
+typedef struct ReadRequest
 {
-    UInt8   *Start;
-    UInt8   *End;
-    UInt8   *NextChar;
-    UInt8   *LastChar;
-    size_t  Size;
-    size_t  InQueue;
-} CirQueue;
+    IOBufferMemoryDescriptor    *MDP;
+    UInt8                       *Buffer;
+    IOUSBCompletion             Completion;
+    UInt32                      Size;       // bytes asked for
+    UInt32                      Length;     // bytes received, valid when Done
+    IOReturn                    Status;     // completion status, valid when Done
+    bool                        Pending;    // submitted to the bulk-in pipe
+    bool                        Done;       // completed, not yet delivered to the RX queue
+} ReadRequest;
+
+typedef struct WriteRequest
+{
+    IOBufferMemoryDescriptor    *MDP;
+    UInt8                       *Buffer;
+    IOUSBCompletion             Completion;
+    UInt32                      Count;      // bytes in this transfer
+    UInt32                      Retries;    // times the unsent part was sent again
+    bool                        Pending;    // submitted to the bulk-out pipe
+} WriteRequest;
 
 typedef enum QueueStatus
 {
@@ -289,16 +287,25 @@ static inline mach_timespec long2tval( unsigned long val )
 typedef struct
 {
 	enum pl2303_type type;
-    UInt32          State;
+    UInt32          State;          // atomic, read with readPortState, changed with changeState
 	UInt8          lineState;
     
-    UInt32          WatchStateMask;
-    IOLock          *serialRequestLock;
+    StateWaiter     *Waiters;       // threads in privateWatchState, under serialRequestLock
+    UInt32          SpuriousWakeups;    // waiters woken without their state being there
+    
+    // Locks. RX and TX traffic never share one, so reading and writing run side
+    // by side. Where more than one is needed they are taken in this order:
+    // RXLock, TXLock, serialRequestLock. No path holds RXLock and TXLock
+    // together today, and nothing is taken while serialRequestLock is held.
+    IOLock          *RXLock;        // RX producer ownership, read requests, MinLatency
+    IOLock          *TXLock;        // TX producers, write buffers, transmit ownership
+    IOLock          *serialRequestLock; // state waiters and the control request queue
     
 	// queue control structures:
     
     CirQueue        RX;
     CirQueue        TX;
+    RXErrorList     RXErrors;       // errors reported by the chip, by position in RX
     
     BufferMarks     RXStats;
     BufferMarks     TXStats;
@@ -340,6 +347,27 @@ typedef struct
     
     bool            AreTransmitting;
     
+	// USB transfer configuration:
+    
+    UInt32          ReadPackets;    // bulk-in transfer size in max size packets
+    UInt32          ReadSize;       // bulk-in transfer size in bytes
+    UInt32          ReadPacketSize; // bulk-in max packet size, the transfer size with MinLatency
+    UInt32          ReadAhead;      // number of outstanding bulk-in transfers
+    UInt32          WriteBatch;     // max bytes per bulk-out transfer
+    UInt32          WritePacketSize;    // bulk-out max packet size, for zero length packets
+    UInt32          WriteBuffers;   // number of bulk-out buffers
+    UInt32          WriteDelay;     // write combining window in us, 0 is off
+    UInt32          WriteThreshold; // bytes that end the write combining window
+    UInt32          TXTransfers;    // bulk-out transfers started
+    UInt32          ControlTransfers;   // control requests sent to the device
+    UInt32          ControlLineWrites;  // DTR/RTS updates queued for the device
+    UInt32          ControlLineSkips;   // DTR/RTS updates dropped because nothing changed
+    UInt32          QueueChecks;        // checkTXQueue / checkRXQueue calls
+    UInt32          QueueUpdates;       // of those, the ones where a queue bit moved
+    UInt32          LateLineErrors;     // line errors dropped because their byte was already read
+    bool            VerifyLineCoding;   // read the line coding back after setting it
+    UInt32          Quirks;             // kQuirk flags for this device
+    
 	/* extensions to handle the Driver */
     
     bool            isDriver;
@@ -353,17 +381,12 @@ class me_nozap_driver_PL2303 : public IOSerialDriverSync
 {
 	OSDeclareDefaultStructors(me_nozap_driver_PL2303)
 private:
-    UInt32          fCount;         // usb write length
     UInt8           fSessions;      // Active sessions (count of opens on /dev/tty entries)
     bool            fUSBStarted;        // usb family has started (stopped) us
     bool            fTerminate;     // Are we being terminated (ie the device was unplugged)
     UInt8           fProductName[productNameLength];    // Actually the product String from the Device
     PortInfo_t      *fPort;         // The Port
     bool            fReadActive;    // usb read is active
-#if FIX_PARITY_PROCESSING
-    clock_sec_t			_fReadTimestampSecs;
-    clock_nsec_t        _fReadTimestampNanosecs;
-#endif
     bool            fWriteActive;   // usb write is active
     UInt8           fPowerState;    // off,on ordinal for power management
 	IORS232SerialStreamSync		*fNub;              // glue back to IOSerialStream side
@@ -377,22 +400,56 @@ private:
     
     
 	IOBufferMemoryDescriptor    *fpinterruptPipeMDP;
-    IOBufferMemoryDescriptor    *fpPipeInMDP;
-    IOBufferMemoryDescriptor    *fpPipeOutMDP;
     
     UInt8               *fpinterruptPipeBuffer;
-    UInt8               *fPipeInBuffer;
-    UInt8               *fPipeOutBuffer;
     
     UInt8               fpInterfaceNumber;
     
+    ReadRequest         fReadRequests[kMaxReadAhead];   // bulk-in read-ahead, delivered in submission order
+    UInt32              fReadCount;         // requests in use
+    UInt32              fReadHead;          // oldest request, the next one to deliver
+    bool                fReadDelivering;    // a completion is delivering to the RX queue (the RX producer), under RXLock
+    UInt8               fLineErrors;        // line status error bits waiting for the RX producer
+    size_t              fLineErrorPosition; // RX.Added when fLineErrors was first reported
+    UInt64              fRXTime;            // uptime when RX data was last published
+    
+    WriteRequest        fWriteRequests[kMaxWriteBuffers];   // bulk-out buffers, used round robin
+    UInt32              fWriteCount;        // buffers in use
+    UInt32              fWriteNext;         // next buffer to fill
+    UInt32              fWritesInFlight;    // buffers submitted to the pipe
+    bool                fWriteSubmitting;   // a thread is filling and submitting buffers, under TXLock
+    bool                fWriteAgain;        // more work arrived while submitting
+    bool                fWriteFlush;        // send held data without waiting for the write delay
+    bool                fWriteTimerArmed;   // fWriteTimer is counting down
+    IOTimerEventSource  *fWriteTimer;       // ends the write combining window
+    
+    UInt8               fLineCoding[kLineCodingSize];   // last line coding sent to the device
+    bool                fLineCodingValid;   // fLineCoding is what the device has, under serialRequestLock
+    bool                fLineCodingPending; // a line parameter changed and has not been sent
+    IOTimerEventSource  *fLineTimer;        // ends the line coding window
+    IOTimerEventSource  *fWakeTimer;        // repeats a completion's wakeups from the gate
+    
+    ControlRequest      fControlRequests[kControlQueueSize];    // queued control requests, oldest first
+    UInt32              fControlHead;       // oldest request, the one on the bus when fControlBusy
+    UInt32              fControlCount;      // requests queued, including the one on the bus
+    bool                fControlBusy;       // a control request is on the bus
+    UInt8               fControlLines;      // last DTR/RTS value queued for the device
+    bool                fControlLinesValid; // fControlLines is what the device will have
+    UInt64              fBreakOnTime;       // uptime when the chip took the last BREAK_ON, 0 until then
+    UInt32              fControlWaiters;    // threads in controlSleep, under serialRequestLock
+    IOUSBCompletion     fControlCompletion;
+    
+    volatile SInt32     fAllocations;       // allocBuffer calls, must not move while data flows
+    
     IOUSBCompletion     finterruptCompletionInfo;
-    IOUSBCompletion     fReadCompletionInfo;
-    IOUSBCompletion     fWriteCompletionInfo;
     
     static void         interruptReadComplete(  void *obj, void *param, IOReturn ior, UInt32 remaining );
     static void         dataReadComplete(  void *obj, void *param, IOReturn ior, UInt32 remaining );
     static void         dataWriteComplete( void *obj, void *param, IOReturn ior, UInt32 remaining );
+    static void         writeTimeout( OSObject *owner, IOTimerEventSource *sender );
+    static void         lineTimeout( OSObject *owner, IOTimerEventSource *sender );
+    static void         wakeTimeout( OSObject *owner, IOTimerEventSource *sender );
+    static void         controlRequestComplete( void *obj, void *param, IOReturn ior, UInt32 remaining );
     
     bool                initForPM(IOService *provider);
 	
@@ -442,20 +499,31 @@ public:
     static	IOReturn	enqueueEventAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *);
     static	IOReturn	enqueueDataAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
     static	IOReturn	dequeueDataAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    static	IOReturn	dequeueEventAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
     
 	// Gated methods called by the Static stubs
 	virtual	IOReturn	acquirePortGated(bool sleep, void *refCon);
     virtual	IOReturn	releasePortGated(void *refCon);
     virtual	IOReturn	setStateGated(UInt32 state, UInt32 mask, void *refCon);
-    virtual	IOReturn	watchStateGated(UInt32 *state, UInt32 mask);
+    virtual	IOReturn	watchStateGated(UInt32 *state, UInt32 mask, UInt64 deadline = 0);
     virtual	IOReturn	executeEventGated(UInt32 event, UInt32 data, void *refCon);
     virtual	IOReturn	requestEventGated(UInt32 event, UInt32 *data, void *refCon);
     virtual	IOReturn	enqueueDataGated(UInt8 *buffer, UInt32 size, UInt32 *count, bool sleep);
     virtual	IOReturn	dequeueDataGated(UInt8 *buffer, UInt32 size, UInt32 *count, UInt32 min);
+    virtual	IOReturn	dequeueEventGated(UInt32 *event, UInt32 *data, bool sleep, void *refCon);
     
-	bool				setUpTransmit( void );
+	bool				setUpTransmit( bool flush = false );
 	IOReturn			setSerialConfiguration( void );
-    IOReturn			startTransmit( UInt32 control_length, UInt8 *control_buffer, UInt32 data_length, UInt8 *data_buffer );
+    void                changeSerialConfiguration( void );
+    IOReturn            commitSerialConfiguration( void );
+    IOReturn            deviceRequest( IOUSBDevRequest *request );
+    IOReturn            queueControlRequest( IOUSBDevRequest *request, const UInt8 *expect = NULL );
+    IOReturn            addControlRequest( IOUSBDevRequest *request, const UInt8 *expect, bool *start );
+    void                startControlRequest( void );
+    bool                finishControlRequest( IOReturn ior, UInt32 remaining );
+    bool                drainControlRequests( void );
+    void                controlSleep( void *event, UInt64 deadline );
+    IOReturn			startTransmit( WriteRequest *request, UInt32 data_length );
 	
 	
 private:
@@ -471,16 +539,26 @@ private:
 	QueueStatus     getQueueStatus( CirQueue *Queue );
     size_t          addtoQueue( CirQueue *Queue, UInt8 *Buffer, size_t Size );
     size_t          removefromQueue( CirQueue *Queue, UInt8 *Buffer, size_t MaxSize );
+    void            queueLineErrors( void );
+    size_t          cleanBytesinRX( UInt32 *Event );
+    bool            takeRXError( UInt32 Event );
+    void            dropRXErrors( void );
+    size_t          removeRXData( UInt8 *Buffer, size_t MaxSize );
     size_t          freeSpaceinQueue( CirQueue *Queue );
     size_t          usedSpaceinQueue( CirQueue *Queue );
     size_t          getQueueSize( CirQueue *Queue );
     void            checkQueues( PortInfo_t *port );
+    void            checkTXQueue( PortInfo_t *port );
+    void            checkRXQueue( PortInfo_t *port, bool force = false );
+    UInt32          queueBits( CirQueue *Queue, BufferMarks *Stats, UInt32 empty, UInt32 full, UInt32 low, UInt32 high );
     
 	/**** State manipulations ****/
     
-    IOReturn        privateWatchState( PortInfo_t *port, UInt32 *state, UInt32 mask );
+    IOReturn        privateWatchState( PortInfo_t *port, UInt32 *state, UInt32 mask, UInt64 deadline = 0 );
+    UInt64          rxDeadline( UInt64 firstByte );
     UInt32          readPortState( PortInfo_t *port );
     void            changeState( PortInfo_t *port, UInt32 state, UInt32 mask );
+    void            wakeStateWaiters( PortInfo_t *port, UInt32 delta );
     IOReturn        CheckSerialState();       // combines fSessions, fStartStopUserClient, fStartStopUSB to new state
 	/**** USB Specific ****/
     
@@ -490,6 +568,7 @@ private:
     bool            allocateResources( void );                  // allocate pipes
     void            releaseResources( void );                   // free pipes
     bool            startPipes();                               // start the usb reads going
+    bool            submitRead( ReadRequest *request );         // queue one bulk-in read
     void            stopPipes();
     bool            createSerialStream();                       // create bsd stream
     void            destroySerialStream();                      // delete bsd stream
@@ -500,12 +579,21 @@ private:
     void            destroyNub();
     void            SetStructureDefaults( PortInfo_t *port, bool Init );
     bool            allocateRingBuffer( CirQueue *Queue, size_t BufferSize );
+    IOReturn        setQueueSize( CirQueue *Queue, BufferMarks *Stats, size_t BufferSize );
+    void            resizeQueue( CirQueue *Queue, BufferMarks *Stats, size_t BufferSize );
+    void            resizePending( PortInfo_t *port );
+    size_t          markEvent( CirQueue *Queue );
+    void            setDefaultMarks( CirQueue *Queue, BufferMarks *Stats );
+    IOReturn        setWaterMarks( CirQueue *Queue, BufferMarks *Stats, size_t LowWater, size_t HighWater );
     void            freeRingBuffer( CirQueue *Queue );
+    void            *allocBuffer( size_t Size );
+    void            freeBuffer( void *Buffer, size_t Size );
     
     /**** FlowControl ****/
 	IOReturn        setControlLines( PortInfo_t *port );
     UInt32			generateRxQState( PortInfo_t *port );
 	IOReturn		setBreak( bool data);
+	void			breakDelay( UInt32 us );
 	
 	IOReturn        vendor_write0( UInt16 value, UInt16 index);
     
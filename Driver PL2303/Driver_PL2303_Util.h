@@ -0,0 +1,783 @@
+/*
+ * Driver_PL2303_Util.h Prolific PL2303 USB to serial adaptor driver for OS X
+ *
+ * Copyright (c) 2013 NoZAP B.V., Jeroen Arnoldus (opensource@nozap.me , http://www.nozap.me http://www.nozap.nl )
+ * Copyright (c) 2006-2012 BJA Electronics, Jeroen Arnoldus (opensource@bja-electronics.nl)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// The parts of the driver that do not touch IOKit: queue arithmetic, state
+// waiters, line coding, baud rate and quirk tables. Driver_PL2303.h includes this after the
+// IOKit headers; the host tests in Tests/ include it after host.h, which
+// provides the libkern types, so both build the same code.
+
+#ifndef DRIVER_PL2303_UTIL_H
+#define DRIVER_PL2303_UTIL_H
+
+// If not working at very high rate one can reconsider also
+// increasing the size of the circular buffer to store at
+// lease 0.1 sec: before was about 460800/10bits/10= 4608
+// now should be  6000000/10bits/10 = 60Kbytes in the worst case
+// In my code set it to 16K to balance among a convenient
+// speed and memory use.
+// The queues are now sized per port from the baud rate (100 ms per
+// direction, rounded up to a power of two) and can be changed with
+// PD_E_RXQ_SIZE / PD_E_TXQ_SIZE within these limits.
+
+#define kMinCirBufferSize   4096
+#define kMaxCirBufferSize   (128 * 1024)
+#define kCirBufferTimeMS    100
+
+#define kCacheLineSize      64
+
+// Single producer / single consumer ring. Added and Removed count bytes since
+// the queue was set up; each side only writes its own counter (with release)
+// and reads the other one (with acquire), so data moves without a lock. The
+// counters sit on separate cache lines. Several producers, as on TX where
+// XON/XOFF is sent from any context, must hold the TXLock.
+typedef struct CirQueue
+{
+    UInt8   *Start;
+    UInt8   *End;
+    size_t  Size;
+    UInt8   Pad0[kCacheLineSize];
+
+    size_t  Added;          // written by the producer only
+    UInt8   Pad1[kCacheLineSize];
+
+    size_t  Removed;        // written by the consumer only
+    UInt8   Pad2[kCacheLineSize];
+} CirQueue;
+
+
+/* Copies as much of Buffer as fits into the queue, using at most two contiguous
+   segments (up to the end of the ring, then from the start). Must be called by
+   the queue's producer only. Returns the number of bytes queued. */
+
+static inline size_t copyintoQueue( CirQueue *Queue, const UInt8 *Buffer, size_t Size )
+{
+    size_t  Added = Queue->Added;
+    size_t  Removed = __atomic_load_n( &Queue->Removed, __ATOMIC_ACQUIRE );
+    size_t  Offset;
+    size_t  Segment;
+
+    if ( Size > Queue->Size - (Added - Removed) )
+        Size = Queue->Size - (Added - Removed);
+    if ( Size == 0 )
+        return 0;
+
+    Offset = Added % Queue->Size;
+    Segment = Queue->Size - Offset;
+    if ( Segment > Size )
+        Segment = Size;
+
+    bcopy( Buffer, Queue->Start + Offset, Segment );
+    if ( Size > Segment )
+        bcopy( Buffer + Segment, Queue->Start, Size - Segment );
+
+    // publish the data to the consumer
+    __atomic_store_n( &Queue->Added, Added + Size, __ATOMIC_RELEASE );
+
+    return Size;
+}
+
+/* Counterpart of copyintoQueue, takes at most two contiguous segments out of
+   the queue. Must be called by the queue's consumer only. Returns the number
+   of bytes put in Buffer. */
+
+static inline size_t copyfromQueue( CirQueue *Queue, UInt8 *Buffer, size_t MaxSize )
+{
+    size_t  Removed = Queue->Removed;
+    size_t  Added = __atomic_load_n( &Queue->Added, __ATOMIC_ACQUIRE );
+    size_t  Offset;
+    size_t  Segment;
+
+    if ( MaxSize > Added - Removed )
+        MaxSize = Added - Removed;
+    if ( MaxSize == 0 )
+        return 0;
+
+    Offset = Removed % Queue->Size;
+    Segment = Queue->Size - Offset;
+    if ( Segment > MaxSize )
+        Segment = MaxSize;
+
+    bcopy( Queue->Start + Offset, Buffer, Segment );
+    if ( MaxSize > Segment )
+        bcopy( Queue->Start, Buffer + Segment, MaxSize - Segment );
+
+    // hand the space back to the producer
+    __atomic_store_n( &Queue->Removed, Removed + MaxSize, __ATOMIC_RELEASE );
+
+    return MaxSize;
+}
+
+/* Bytes the line carries in ms milliseconds at baudRate, 10 bits a character */
+
+static inline size_t bytesInTime( UInt32 baudRate, UInt32 ms )
+{
+    return ((size_t)baudRate / 10) * ms / 1000;
+}
+
+/* Default queue size: kCirBufferTimeMS worth of 10 bit characters at baudRate */
+
+static inline size_t defaultQueueSize( UInt32 baudRate )
+{
+    size_t  wanted = bytesInTime( baudRate, kCirBufferTimeMS );
+    size_t  size = kMinCirBufferSize;
+    
+    while ( (size < wanted) && (size < kMaxCirBufferSize) )
+        size <<= 1;
+    
+    return size;
+}
+
+// Water marks. The RX high water mark leaves room for what still comes in
+// after flow control is asserted: kFlowControlLatencyMS of data at the
+// current rate plus every bulk-in transfer in flight (ReadAhead of them)
+// landing at once. The default RX queue is made big enough for that. The
+// TX low water mark keeps the latency plus one write batch queued, so
+// writers are woken before the pipe runs dry. PD_E_*Q_HIGH_WATER /
+// LOW_WATER set marks of their own (0 goes back to the defaults); they
+// have to pass validWaterMarks.
+#define kFlowControlLatencyMS   16
+
+/* The rule from generateRxQState, event being the most a queue moves by at once:
+   event <= low <= high - event and high <= size - event */
+
+static inline bool validWaterMarks( size_t size, size_t low, size_t high, size_t event )
+{
+    return (event <= low) && (low + event <= high) && (high + event <= size);
+}
+
+/* Default marks for a queue of size bytes moving by at most event bytes at once.
+   latency is kFlowControlLatencyMS of data, inFlight what the pipe holds: all
+   the read-ahead for RX, one write batch for TX. Marks that would break
+   validWaterMarks fall back to 2/3 and 1/3 of the queue. */
+
+static inline void defaultWaterMarks( bool rx, size_t size, size_t event, size_t latency, size_t inFlight,
+                                      size_t *low, size_t *high )
+{
+    if ( rx )
+    {
+        *high = (size > latency + inFlight) ? size - (latency + inFlight) : 0;
+        *low  = *high >> 1;
+    } else {
+        *high = (size << 1) / 3;
+        *low  = latency + inFlight;
+        if ( *low < (*high >> 1) )
+            *low = *high >> 1;
+    }
+    
+    if ( !validWaterMarks( size, *low, *high, event ) )
+    {
+        *high = (size << 1) / 3;
+        *low  = *high >> 1;
+    }
+}
+
+/* Default RX queue size: defaultQueueSize, doubled (up to kMaxCirBufferSize)
+   until the room the high water mark keeps for latency and inFlight is no
+   more than half the queue and the default marks keep validWaterMarks for
+   transfers of event bytes */
+
+static inline size_t defaultRXQueueSize( UInt32 baudRate, size_t event, size_t inFlight )
+{
+    size_t  size = defaultQueueSize( baudRate );
+    size_t  reserve = bytesInTime( baudRate, kFlowControlLatencyMS ) + inFlight;
+    
+    while ( ((size < (reserve << 1)) || !validWaterMarks( size, (size - reserve) >> 1, size - reserve, event )) &&
+            (size < kMaxCirBufferSize) )
+        size <<= 1;
+    
+    return size;
+}
+
+/* The state bits for a queue holding used of its size bytes: full or empty,
+   below the low and above the high water mark. The caller passes the RXQ or
+   TXQ bits to set. */
+
+static inline UInt32 queueLevelBits( size_t used, size_t size, size_t low, size_t high,
+                                     UInt32 empty, UInt32 full, UInt32 lowBit, UInt32 highBit )
+{
+    UInt32  bits = 0;
+
+    if ( used >= size )
+        bits |= full;
+    else if ( used == 0 )
+        bits |= empty;
+
+    if ( used < low )
+        bits |= lowBit;
+    if ( used > high )
+        bits |= highBit;
+
+    return bits;
+}
+
+/* The port state word is atomic: read without a lock, the masked bits
+   changed by compare and swap, retried if another thread got in first.
+   changeStateWord returns the state before, the new one in *update. */
+
+static inline UInt32 loadStateWord( UInt32 *word )
+{
+    return __atomic_load_n( word, __ATOMIC_ACQUIRE );
+}
+
+static inline UInt32 changeStateWord( UInt32 *word, UInt32 state, UInt32 mask, UInt32 *update )
+{
+    UInt32  old = __atomic_load_n( word, __ATOMIC_RELAXED );
+
+    do {
+        *update = (old & ~mask) | (state & mask);
+    } while ( !__atomic_compare_exchange_n( word, &old, *update, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) );
+    return old;
+}
+
+// Each thread in privateWatchState registers the bits it waits for and
+// sleeps on its own entry, so changeState only wakes the threads whose
+// bits changed. The list, Woken and Sleeping are under serialRequestLock.
+typedef struct StateWaiter
+{
+    UInt32              Mask;
+    bool                Woken;          // one of the bits changed since the waiter last looked
+    bool                Sleeping;       // the waiter decided to sleep, it may not be asleep yet
+    struct StateWaiter  *Next;
+} StateWaiter;
+
+static inline void addStateWaiter( StateWaiter **list, StateWaiter *waiter, UInt32 mask )
+{
+    waiter->Mask = mask;
+    waiter->Woken = false;
+    waiter->Sleeping = false;
+    waiter->Next = *list;
+    *list = waiter;
+}
+
+static inline void removeStateWaiter( StateWaiter **list, StateWaiter *waiter )
+{
+    for ( StateWaiter **link = list; *link; link = &(*link)->Next )
+    {
+        if ( *link == waiter )
+        {
+            *link = waiter->Next;
+            break;
+        }
+    }
+}
+
+/* The bits of mask where state has the value watch has, see privateWatchState */
+
+static inline UInt32 stateFound( UInt32 watch, UInt32 state, UInt32 mask )
+{
+    return (watch ^ ~state) & mask;
+}
+
+/* changeState's part: marks the waiter woken when one of its bits is in delta.
+   True when it has to be woken up, having decided to sleep. */
+
+static inline bool stateWaiterDue( StateWaiter *waiter, UInt32 delta )
+{
+    if ( delta & waiter->Mask )
+        waiter->Woken = true;
+    return waiter->Woken && waiter->Sleeping;
+}
+
+/* The waiter's part, after a check found nothing: true if it may sleep, false
+   when a change since then marked it woken and it has to look again. */
+
+static inline bool stateWaiterSleep( StateWaiter *waiter )
+{
+    bool    woken = waiter->Woken;
+
+    waiter->Woken = false;
+    waiter->Sleeping = !woken;
+    return !woken;
+}
+
+/* Back from sleep, the state is read again after this */
+
+static inline void stateWaiterAwake( StateWaiter *waiter )
+{
+    waiter->Woken = false;
+    waiter->Sleeping = false;
+}
+
+// SET_LINE_REQUEST payload size. Parameter changes that arrive within
+// kLineCodingDelay ms of each other go to the device as one request, and
+// a payload equal to the last one sent is not sent again.
+#define kLineCodingSize         7
+#define kLineCodingDelay        2
+
+// Line coding as carried by SET_LINE_REQUEST and GET_LINE_REQUEST: the
+// rate little endian in bytes 0-3, then stop bits, parity and data bits.
+typedef struct LineCoding
+{
+    UInt32  Rate;           // bits per second
+    UInt8   StopBits;       // 0 = 1, 1 = 1.5, 2 = 2 stop bits
+    UInt8   Parity;         // 0 none, 1 odd, 2 even, 3 mark, 4 space
+    UInt8   DataBits;       // 5 to 8
+} LineCoding;
+
+/* Rate little endian in bytes 0-3, then stop bits, parity and data bits:
+   the kLineCodingSize bytes of SET_LINE_REQUEST */
+
+static inline void encodeLineCoding( const LineCoding *coding, UInt8 *buf )
+{
+    buf[0] = coding->Rate & 0xff;
+    buf[1] = (coding->Rate >> 8) & 0xff;
+    buf[2] = (coding->Rate >> 16) & 0xff;
+    buf[3] = (coding->Rate >> 24) & 0xff;
+    buf[4] = coding->StopBits;
+    buf[5] = coding->Parity;
+    buf[6] = coding->DataBits;
+}
+
+/* The inverse of encodeLineCoding, for a GET_LINE_REQUEST reply */
+
+static inline void decodeLineCoding( const UInt8 *buf, LineCoding *coding )
+{
+    coding->Rate = (UInt32)buf[0] | ((UInt32)buf[1] << 8) | ((UInt32)buf[2] << 16) | ((UInt32)buf[3] << 24);
+    coding->StopBits = buf[4];
+    coding->Parity = buf[5];
+    coding->DataBits = buf[6];
+}
+
+// New Prolific 2303HX supported speeds form Manual ds_pl2303HXD_v1.1.doc
+// Revision Data Apr, 16 2007, Note from prolific (manual page 9):
+// By taking advantage of USB bulk transfer mode, large data buffers,
+// and automatic flow control, PL-2303HX is capable of achieving higher
+// throughput compared to traditional UART (Universal Asynchronous Receiver
+// Transmitter) ports. When real RS232 signaling is not required, baud rate
+// higher than 115200 bps could be used for even higher performance. The
+// flexible baud rate generator of PL-2303HX could be programmed to generate
+// any rate between 75 bps to 12M bps.
+
+// My note, however not all the baudrated may be supported by the driver.
+// The following ones are given for sure (on page 19) other rates maybe
+// available depending on the model.
+
+#define kLinkSpeedIgnored	0
+#define kLinkSpeed75		75
+#define kLinkSpeed150		150
+#define kLinkSpeed300		300
+#define kLinkSpeed600		600
+#define kLinkSpeed1200		1200
+#define kLinkSpeed1800		1800
+#define kLinkSpeed2400		2400
+#define kLinkSpeed3600		3600
+#define kLinkSpeed4800		4800
+#define kLinkSpeed7200		7200
+#define kLinkSpeed9600		9600
+#define kLinkSpeed19200		19200
+#define kLinkSpeed38400		38400
+#define kLinkSpeed57600		57600
+#define kLinkSpeed115200    115200
+#define kLinkSpeed230400	230400
+#define kLinkSpeed460800	460800
+#define kLinkSpeed614400	614400
+#define kLinkSpeed921600	921600
+#define kLinkSpeed1228800	1228800
+#define kLinkSpeed1843200	1843200
+#define kLinkSpeed2457600	2457600
+#define kLinkSpeed3000000	3000000
+#define kLinkSpeed6000000	6000000
+
+#define kDefaultBaudRate    9600
+#define kMaxBaudRate        6000000
+#define kMinBaudRate        75
+
+
+// bcdDevice of the chip revisions start() tells apart
+#define PROLIFIC_REV_H			0x0202
+#define PROLIFIC_REV_X			0x0300
+#define PROLIFIC_REV_HX_CHIP_D	0x0400
+#define PROLIFIC_REV_1			0x0001
+
+enum pl2303_type {
+	unknown,
+	type_1,		/* don't know the difference between type 0 and */
+	rev_X,		/* type 1, until someone from prolific tells us... */
+	rev_HX,		/* HX version of the pl2303 chip */
+	rev_H
+};
+
+// Rates every chip takes directly (the kLinkSpeed list), sorted.
+static constexpr UInt32 kStandardBaudRates[] = {
+	kLinkSpeed75,
+	kLinkSpeed150,
+	kLinkSpeed300,
+	kLinkSpeed600,
+	kLinkSpeed1200,
+	kLinkSpeed1800,
+	kLinkSpeed2400,
+	kLinkSpeed3600,
+	kLinkSpeed4800,
+	kLinkSpeed7200,
+	kLinkSpeed9600,
+	kLinkSpeed19200,
+	kLinkSpeed38400,
+	kLinkSpeed57600,
+	kLinkSpeed115200,
+	kLinkSpeed230400,
+	kLinkSpeed460800,
+	kLinkSpeed614400,
+	kLinkSpeed921600,
+	kLinkSpeed1228800,
+	kLinkSpeed1843200,
+	kLinkSpeed2457600,
+	kLinkSpeed3000000,
+	kLinkSpeed6000000,
+};
+#define kStandardBaudRateCount  (sizeof(kStandardBaudRates) / sizeof(kStandardBaudRates[0]))
+
+// What each pl2303_type can do: its fastest rate and what happens to a rate
+// off the standard list. Divisor: the HX generator takes it as a divisor.
+// Rounded: it goes to the nearest standard rate. Neither: it is sent as it
+// is, which is what the driver did for every chip before this table. That
+// is kept for unknown, the revisions start() cannot place, since a newer
+// HX-class part there may well take rates the table would refuse.
+typedef struct BaudCapability
+{
+    UInt32  MaxRate;
+    bool    Divisor;
+    bool    Rounded;
+} BaudCapability;
+
+static constexpr BaudCapability kBaudCapabilities[] = {
+	{ kMaxBaudRate, false, false },			// unknown
+	{ kLinkSpeed1228800, false, true },		// type_1
+	{ kLinkSpeed1228800, false, true },		// rev_X
+	{ kLinkSpeed6000000, true, false },		// rev_HX
+	{ kLinkSpeed1228800, false, true },		// rev_H
+};
+
+constexpr UInt32 baudDistance( UInt32 a, UInt32 b )
+{
+    return a > b ? a - b : b - a;
+}
+
+constexpr bool isStandardBaudRate( UInt32 rate, UInt32 i = 0 )
+{
+    return i < kStandardBaudRateCount && (kStandardBaudRates[i] == rate || isStandardBaudRate( rate, i + 1 ));
+}
+
+// The standard rate closest to rate, no faster than maxRate. The list is
+// sorted so the distance only falls until the nearest one is passed.
+constexpr UInt32 nearestBaudRate( UInt32 rate, UInt32 maxRate, UInt32 i = 0 )
+{
+    return (i + 1 < kStandardBaudRateCount && kStandardBaudRates[i + 1] <= maxRate &&
+            baudDistance( kStandardBaudRates[i + 1], rate ) <= baudDistance( kStandardBaudRates[i], rate ))
+        ? nearestBaudRate( rate, maxRate, i + 1 ) : kStandardBaudRates[i];
+}
+
+// The rate a chip of this type will be asked for, 0 when it is too fast.
+// Only the Rounded types change it, to the nearest standard rate.
+constexpr UInt32 supportedBaudRate( enum pl2303_type type, UInt32 rate )
+{
+    return (rate < kStandardBaudRates[0] || rate > kBaudCapabilities[type].MaxRate) ? 0 :
+        (!kBaudCapabilities[type].Rounded || isStandardBaudRate( rate )) ? rate :
+        nearestBaudRate( rate, kBaudCapabilities[type].MaxRate );
+}
+
+constexpr bool baudRatesSorted( UInt32 i = 1 )
+{
+    return i >= kStandardBaudRateCount || (kStandardBaudRates[i - 1] < kStandardBaudRates[i] && baudRatesSorted( i + 1 ));
+}
+
+// An off-list rate is divided or rounded, not both, and nobody goes past kMaxBaudRate
+constexpr bool baudCapabilitiesValid( UInt32 i = 0 )
+{
+    return i > rev_H || (!(kBaudCapabilities[i].Divisor && kBaudCapabilities[i].Rounded) &&
+                         kBaudCapabilities[i].MaxRate <= kMaxBaudRate && baudCapabilitiesValid( i + 1 ));
+}
+
+static_assert( baudRatesSorted(), "kStandardBaudRates must be sorted" );
+static_assert( baudCapabilitiesValid(), "kBaudCapabilities entries must be consistent" );
+static_assert( sizeof(kBaudCapabilities) / sizeof(kBaudCapabilities[0]) == rev_H + 1, "one kBaudCapabilities entry per pl2303_type" );
+static_assert( kStandardBaudRates[0] == kMinBaudRate && kStandardBaudRates[kStandardBaudRateCount - 1] == kMaxBaudRate, "kStandardBaudRates spans kMinBaudRate..kMaxBaudRate" );
+static_assert( isStandardBaudRate( kLinkSpeed115200 ) && !isStandardBaudRate( 250000 ), "isStandardBaudRate" );
+static_assert( nearestBaudRate( 250000, kLinkSpeed1228800 ) == kLinkSpeed230400, "nearestBaudRate rounds to the closest rate" );
+static_assert( nearestBaudRate( 100, kLinkSpeed1228800 ) == kLinkSpeed75, "nearestBaudRate rounds down" );
+static_assert( nearestBaudRate( kLinkSpeed6000000, kLinkSpeed1228800 ) == kLinkSpeed1228800, "nearestBaudRate stops at maxRate" );
+static_assert( supportedBaudRate( rev_HX, 250000 ) == 250000, "HX takes any rate in range" );
+static_assert( supportedBaudRate( type_1, 250000 ) == kLinkSpeed230400, "type_1 rounds to a standard rate" );
+static_assert( supportedBaudRate( type_1, kLinkSpeed3000000 ) == 0, "type_1 tops out at 1228800" );
+static_assert( supportedBaudRate( rev_HX, kLinkSpeed6000000 ) == kLinkSpeed6000000, "HX reaches kMaxBaudRate" );
+static_assert( supportedBaudRate( rev_HX, 74 ) == 0, "nothing below kMinBaudRate" );
+static_assert( supportedBaudRate( unknown, 250000 ) == 250000, "unknown chips get the rate as asked" );
+static_assert( supportedBaudRate( unknown, kMaxBaudRate ) == kMaxBaudRate, "unknown chips are not capped below kMaxBaudRate" );
+static_assert( supportedBaudRate( unknown, kMaxBaudRate + 1 ) == 0, "nor above it" );
+
+// Rates outside the kLinkSpeed list go to an HX as a divisor of 12 MHz * 32:
+// rate = kBaudDivisorBase / (mantissa * 4^exponent), with bit 31 of the
+// line coding rate set, the exponent in bits 9-11 and the mantissa in
+// bits 0-8. A rate further off than kBaudRateTolerance (hundredths of a
+// percent) is logged. The Rounded chips get the nearest standard rate,
+// and PD_E_DATA_RATE refuses rates that would be rounded further than
+// kBaudRateTolerance.
+#define kBaudDivisorBase        (12000000 * 32)
+#define kBaudDivisorFlag        0x80000000
+#define kMaxBaudMantissa        511
+#define kMaxBaudExponent        7
+#define kBaudRateTolerance      300
+
+/* Difference between rate and achieved in hundredths of a percent, no
+   floating point in the kernel */
+
+static inline UInt32 baudRateError( UInt32 rate, UInt32 achieved )
+{
+    UInt64 delta = (rate > achieved) ? (rate - achieved) : (achieved - rate);
+    
+    if ( !rate )
+        return 0;
+    
+    return (UInt32)((delta * 10000) / rate);
+}
+
+/* HX divisor encoding: kBaudDivisorBase / (mantissa * 4^exponent). Every
+   exponent is tried with a rounded mantissa and the closest rate wins.
+   Returns the line coding rate field, achieved gets the rate it gives. */
+
+static inline UInt32 divisorBaudRate( UInt32 rate, UInt32 *achieved )
+{
+    UInt32  bestMantissa = kMaxBaudMantissa;
+    UInt32  bestExponent = kMaxBaudExponent;
+    UInt32  bestRate = 0;
+    UInt32  bestError = 0xffffffff;
+    
+    if ( rate < 1 )
+        rate = 1;
+    
+    for ( UInt32 exponent = 0; exponent <= kMaxBaudExponent; exponent++ )
+    {
+        UInt32 base = kBaudDivisorBase >> (exponent << 1);
+        UInt32 mantissa = (base + (rate >> 1)) / rate;
+        
+        if ( mantissa < 1 )
+            mantissa = 1;
+        if ( mantissa > kMaxBaudMantissa )
+            continue;
+        
+        UInt32 candidate = base / mantissa;
+        UInt32 error = baudRateError( rate, candidate );
+        if ( error < bestError )
+        {
+            bestError = error;
+            bestRate = candidate;
+            bestMantissa = mantissa;
+            bestExponent = exponent;
+        }
+    }
+    
+    // Slower than the largest divisor allows, take the slowest there is
+    if ( !bestRate )
+        bestRate = (kBaudDivisorBase >> (kMaxBaudExponent << 1)) / kMaxBaudMantissa;
+    
+    *achieved = bestRate;
+    return kBaudDivisorFlag | (bestExponent << 9) | bestMantissa;
+}
+
+#define SET_LINE_REQUEST_TYPE		0x21
+#define SET_LINE_REQUEST			0x20
+
+#define SET_CONTROL_REQUEST_TYPE	0x21
+#define SET_CONTROL_REQUEST			0x22
+#define CONTROL_DTR					0x01
+#define CONTROL_RTS					0x02
+
+#define BREAK_REQUEST_TYPE			0x21
+#define BREAK_REQUEST				0x23
+#define BREAK_ON					0xffff
+#define BREAK_OFF					0x0000
+
+#define GET_LINE_REQUEST_TYPE		0xa1
+#define GET_LINE_REQUEST			0x21
+
+// Control requests after the start up sequence (modem lines, break, line
+// coding, flow control) are queued and sent one at a time, in order, with
+// the asynchronous DeviceRequest so nobody waits on the gate for them. A
+// modem line or line coding request that has not gone out yet is replaced
+// by a newer one of the same kind. stopSerial waits up to kControlDrainMS
+// for the queue to empty. A request the device does not complete within
+// kControlTimeoutMS fails with a timeout.
+#define kControlQueueSize       16
+#define kControlDrainMS         500
+#define kControlTimeoutMS       1000
+
+typedef struct ControlRequest
+{
+    IOUSBDevRequest     Request;
+    UInt8               Data[kLineCodingSize];      // payload, or the reply to a GET_LINE_REQUEST
+    UInt8               Expect[kLineCodingSize];    // the line coding a GET_LINE_REQUEST should return
+} ControlRequest;
+
+/* Where a new control request goes in the queue of count requests from head:
+   a modem line or line coding request replaces the same kind of request at the
+   tail, as long as that one is not already on the bus (busy and the only one).
+   Anything else gets a new slot at the end and count goes up. NULL when the
+   queue is full. Only picks the slot, the caller fills it in. */
+
+static inline ControlRequest *controlRequestSlot( ControlRequest *requests, UInt32 head, UInt32 *count, bool busy,
+                                                  const IOUSBDevRequest *request )
+{
+    ControlRequest  *tail;
+
+    if ( *count > (busy ? 1u : 0u) &&
+         (request->bRequest == SET_CONTROL_REQUEST || request->bRequest == SET_LINE_REQUEST) )
+    {
+        tail = &requests[(head + *count - 1) % kControlQueueSize];
+        if ( tail->Request.bmRequestType == request->bmRequestType && tail->Request.bRequest == request->bRequest )
+            return tail;
+    }
+
+    if ( *count == kControlQueueSize )
+        return NULL;
+
+    return &requests[(head + (*count)++) % kControlQueueSize];
+}
+
+/* The SET_CONTROL_REQUEST value for the port state, dtrBit and rtsBit being
+   PD_RS232_S_DTR and PD_RS232_S_RFR. setControlLines only queues a value that
+   differs from the last one it queued (last, valid until a request fails). */
+
+static inline UInt8 controlLineValue( UInt32 state, UInt32 dtrBit, UInt32 rtsBit )
+{
+    return ((state & dtrBit) ? CONTROL_DTR : 0) | ((state & rtsBit) ? CONTROL_RTS : 0);
+}
+
+static inline bool controlLinesChanged( UInt8 value, UInt8 last, bool valid )
+{
+    return !valid || (value != last);
+}
+
+/* RX flow control on one line (checkRXQueue): below low water a line lowered
+   for flow control is raised again, above high water it is lowered. *asserted
+   tracks it, the change goes into the bits and mask for changeState. */
+
+static inline void rxFlowLine( bool enabled, bool lowWater, bool highWater, bool *asserted,
+                               UInt32 bit, UInt32 *bits, UInt32 *mask )
+{
+    if ( !enabled )
+        return;
+    if ( lowWater && !*asserted )
+    {
+        *asserted = true;
+        *bits |= bit;
+        *mask |= bit;
+    }
+    else if ( highWater && *asserted )
+    {
+        *asserted = false;
+        *mask |= bit;
+    }
+}
+
+/* Bulk-out timeout for a transfer of count bytes: twice the time the line
+   needs to send it, plus kWriteTimeoutSlackMS for the bus and the device.
+   The chip only takes a packet when its FIFO has room, so at low rates a
+   batch completes at line speed. */
+
+#define kWriteTimeoutSlackMS    1000
+
+static inline UInt32 writeTimeoutMS( UInt32 count, UInt32 baudRate )
+{
+    UInt64  lineMS = baudRate ? ((UInt64)count * 10 * 1000 + baudRate - 1) / baudRate : 0;
+
+    return (UInt32)(lineMS * 2) + kWriteTimeoutSlackMS;
+}
+
+/* Write combining: while fewer than threshold bytes are queued, setUpTransmit
+   holds them up to delayUS for more. MinLatency, a flush (PD_E_TXQ_FLUSH,
+   a drain, the window closing) and TX high water send at once. */
+
+static inline bool writeHold( UInt32 delayUS, bool minLatency, bool flush, size_t used, size_t threshold, size_t highWater )
+{
+    return delayUS && !minLatency && !flush && (used < threshold) && (used <= highWater);
+}
+
+/* Bulk-in reads complete in any order but their data went over the bus in
+   the order they were submitted, so it is delivered in that order: from
+   *head, the oldest one, up to the first one still on the bus (Pending).
+   One that is neither on the bus nor back (Done) could not be submitted
+   again and is skipped. Returns the next read to deliver and moves *head
+   past it, NULL when there is none. The caller holds the RX lock. */
+
+template <class Request>
+static inline Request *nextReadDone( Request *requests, UInt32 count, UInt32 *head )
+{
+    Request *request;
+
+    for ( UInt32 idle = 0; idle < count; idle++ )
+    {
+        request = &requests[*head];
+        if ( request->Pending )
+            return NULL;                // the oldest outstanding read is not back yet
+        *head = (*head + 1) % count;
+        if ( request->Done )
+        {
+            request->Done = false;
+            return request;
+        }
+    }
+
+    return NULL;
+}
+
+#define SIEMENS_VENDOR_ID			0x11f5
+#define SIEMENS_PRODUCT_ID_X65		0x0003
+
+// Device quirks, resolved once in start() into PortInfo_t::Quirks from
+// kDeviceQuirks and the Quirks property of the matching personality, so
+// a new adapter can be described in Info.plist without a code change.
+// kQuirkAnyID in a table entry matches any vendor, product or release.
+#define kQuirkShortStatus       0x0001  // interrupt status is one byte, the UART state at offset 0
+#define kQuirksKey              "Quirks"
+#define kQuirkAnyID             0xffff
+
+typedef struct DeviceQuirk
+{
+    UInt16  VendorID;
+    UInt16  ProductID;
+    UInt16  Release;        // bcdDevice
+    UInt32  Flags;
+} DeviceQuirk;
+
+static constexpr DeviceQuirk kDeviceQuirks[] = {
+	{ SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65, kQuirkAnyID, kQuirkShortStatus },
+};
+#define kDeviceQuirkCount       (sizeof(kDeviceQuirks) / sizeof(kDeviceQuirks[0]))
+
+constexpr bool quirkIDMatches( UInt16 entry, UInt16 id )
+{
+    return entry == kQuirkAnyID || entry == id;
+}
+
+// All flags of the entries that match this device
+constexpr UInt32 deviceQuirks( UInt16 vendor, UInt16 product, UInt16 release, UInt32 i = 0 )
+{
+    return i >= kDeviceQuirkCount ? 0 :
+        ((quirkIDMatches( kDeviceQuirks[i].VendorID, vendor ) && quirkIDMatches( kDeviceQuirks[i].ProductID, product ) &&
+          quirkIDMatches( kDeviceQuirks[i].Release, release )) ? kDeviceQuirks[i].Flags : 0) |
+        deviceQuirks( vendor, product, release, i + 1 );
+}
+
+static_assert( deviceQuirks( SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65, PROLIFIC_REV_HX_CHIP_D ) == kQuirkShortStatus, "Siemens X65 has the short status" );
+static_assert( deviceQuirks( SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65 + 1, PROLIFIC_REV_HX_CHIP_D ) == 0, "only the X65" );
+static_assert( deviceQuirks( 0x067b, 0x2303, PROLIFIC_REV_HX_CHIP_D ) == 0, "plain PL2303 has no quirks" );
+
+#endif /* DRIVER_PL2303_UTIL_H */
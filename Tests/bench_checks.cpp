@@ -0,0 +1,194 @@
+/*
+ * bench_checks.cpp - the queue state upkeep per MB moved. Data streams
+ * both ways: read completions fill the RX queue and a reader drains it,
+ * a writer fills the TX queue and write completions drain it. After every
+ * move the old driver ran checkQueues, which recomputed all TX and RX bits
+ * and the flow control and called changeState under the lock whatever
+ * changed. Now checkTXQueue or checkRXQueue derives the bits of the queue
+ * that moved (queueLevelBits), compares them with the state word and only
+ * calls changeState (changeStateWord, waking the waiters due) when one
+ * crossed a boundary. Reports checks and changeState calls per MB, and the
+ * CPU time per MB on top of the same loop without any checks.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <time.h>
+
+// Stand-ins for the PD_S_* queue bits and PD_RS232_S_RFR
+enum { kTxEmpty = 1, kTxFull = 2, kTxLow = 4, kTxHigh = 8,
+       kRxEmpty = 16, kRxFull = 32, kRxLow = 64, kRxHigh = 128, kRFR = 256 };
+
+#define kQueueSize      16384
+#define kLowWater       (kQueueSize / 3)
+#define kHighWater      ((kQueueSize * 2) / 3)
+#define kStreamBytes    (256u << 20)
+
+enum { kNoChecks, kCheckQueues, kIncremental };
+
+typedef struct BenchPort
+{
+    CirQueue        RX, TX;
+    UInt32          State;
+    bool            RTSAsserted;
+    StateWaiter     *Waiters;
+    pthread_mutex_t Lock;
+    unsigned long   Checks;
+    unsigned long   Changes;
+} BenchPort;
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void wakeStateWaiters( BenchPort *port, UInt32 delta )
+{
+    pthread_mutex_lock( &port->Lock );
+    for ( StateWaiter *waiter = port->Waiters; waiter; waiter = waiter->Next )
+        stateWaiterDue( waiter, delta );
+    pthread_mutex_unlock( &port->Lock );
+}
+
+// Before: everything from scratch, changeState with the lock every time
+static void checkQueues( BenchPort *port )
+{
+    UInt32  state, bits;
+
+    port->Checks++;
+    bits = queueLevelBits( port->TX.Added - port->TX.Removed, port->TX.Size, kLowWater, kHighWater,
+                           kTxEmpty, kTxFull, kTxLow, kTxHigh );
+    bits |= queueLevelBits( port->RX.Added - port->RX.Removed, port->RX.Size, kLowWater, kHighWater,
+                            kRxEmpty, kRxFull, kRxLow, kRxHigh );
+    if ( (bits & kRxLow) && !port->RTSAsserted )
+        port->RTSAsserted = true;
+    if ( (bits & kRxHigh) && port->RTSAsserted )
+        port->RTSAsserted = false;
+    bits |= port->RTSAsserted ? kRFR : 0;
+
+    port->Changes++;
+    pthread_mutex_lock( &port->Lock );
+    state = port->State;
+    port->State = bits;
+    pthread_mutex_unlock( &port->Lock );
+    if ( state ^ bits )
+        wakeStateWaiters( port, state ^ bits );
+}
+
+static void changeState( BenchPort *port, UInt32 state, UInt32 mask )
+{
+    UInt32  update, old;
+
+    port->Changes++;
+    old = changeStateWord( &port->State, state, mask, &update );
+    if ( old ^ update )
+        wakeStateWaiters( port, old ^ update );
+}
+
+// After: the queue that moved, changeState only on a crossing
+static void checkTXQueue( BenchPort *port )
+{
+    const UInt32 mask = kTxEmpty | kTxFull | kTxLow | kTxHigh;
+
+    port->Checks++;
+    UInt32 bits = queueLevelBits( port->TX.Added - port->TX.Removed, port->TX.Size, kLowWater, kHighWater,
+                                  kTxEmpty, kTxFull, kTxLow, kTxHigh );
+    if ( bits != (loadStateWord( &port->State ) & mask) )
+        changeState( port, bits, mask );
+}
+
+static void checkRXQueue( BenchPort *port )
+{
+    UInt32 mask = kRxEmpty | kRxFull | kRxLow | kRxHigh;
+
+    port->Checks++;
+    UInt32 bits = queueLevelBits( port->RX.Added - port->RX.Removed, port->RX.Size, kLowWater, kHighWater,
+                                  kRxEmpty, kRxFull, kRxLow, kRxHigh );
+    if ( bits == (loadStateWord( &port->State ) & mask) )
+        return;
+    rxFlowLine( true, bits & kRxLow, bits & kRxHigh, &port->RTSAsserted, kRFR, &bits, &mask );
+    changeState( port, bits, mask );
+}
+
+static void check( BenchPort *port, int mode, bool rx )
+{
+    if ( mode == kCheckQueues )
+        checkQueues( port );
+    else if ( mode == kIncremental )
+    {
+        if ( rx )
+            checkRXQueue( port );
+        else
+            checkTXQueue( port );
+    }
+}
+
+static double run( int mode, UInt32 chunk, BenchPort *port )
+{
+    static UInt8    rxBuffer[kQueueSize], txBuffer[kQueueSize];
+    static UInt8    data[kQueueSize];
+    StateWaiter     reader, writer, modem;
+    size_t          moved = 0;
+    unsigned        seed = 2303;
+    double          start;
+
+    memset( port, 0, sizeof(*port) );
+    pthread_mutex_init( &port->Lock, NULL );
+    port->RX.Start = rxBuffer;
+    port->RX.End = rxBuffer + kQueueSize;
+    port->RX.Size = kQueueSize;
+    port->TX.Start = txBuffer;
+    port->TX.End = txBuffer + kQueueSize;
+    port->TX.Size = kQueueSize;
+    port->State = kTxEmpty | kTxLow | kRxEmpty | kRxLow | kRFR;
+    port->RTSAsserted = true;
+    addStateWaiter( &port->Waiters, &reader, kRxEmpty );
+    addStateWaiter( &port->Waiters, &writer, kTxFull );
+    addStateWaiter( &port->Waiters, &modem, 0 );
+
+    start = now();
+    while ( moved < kStreamBytes )
+    {
+        UInt32 r = rand_r( &seed );
+
+        // A read completion and the reader, roughly keeping up
+        copyintoQueue( &port->RX, data, chunk );
+        check( port, mode, true );
+        moved += copyfromQueue( &port->RX, data, chunk / 2 + r % chunk );
+        check( port, mode, true );
+
+        // The writer and a write completion
+        copyintoQueue( &port->TX, data, chunk / 2 + (r >> 8) % chunk );
+        check( port, mode, false );
+        moved += copyfromQueue( &port->TX, data, chunk );
+        check( port, mode, false );
+    }
+    pthread_mutex_destroy( &port->Lock );
+    return now() - start;
+}
+
+int main( void )
+{
+    static const UInt32 chunks[] = { 64, 1024 };
+    BenchPort   port;
+    double      mb = kStreamBytes / 1e6;
+
+    printf( "queue state upkeep, both directions, %u MB per run\n", kStreamBytes >> 20 );
+    for ( size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++ )
+    {
+        double base = run( kNoChecks, chunks[c], &port );
+        for ( int mode = kCheckQueues; mode <= kIncremental; mode++ )
+        {
+            double seconds = run( mode, chunks[c], &port );
+            printf( "  %-12s %4u byte moves: %8.0f checks/MB, %8.0f changeState/MB, %7.1f us CPU/MB\n",
+                    mode == kCheckQueues ? "checkQueues" : "incremental", chunks[c],
+                    port.Checks / mb, port.Changes / mb, (seconds - base) * 1e6 / mb );
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * bench_duplex.cpp - full-duplex throughput, as a PPP link or a bootloader
+ * echo drives it. Four threads: read completions fill the RX queue and a
+ * reader drains it, a writer fills the TX queue in large writes and write
+ * completions drain it. Every queue operation holds its queue's lock, the
+ * RXLock or the TXLock, against the old single serialRequestLock around
+ * both queues. Pthread mutexes stand in for the IOLocks. Reports MB/s per
+ * direction; the split only pays off with more than one core.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kQueueSize      65536
+#define kReadChunk      1024            // a bulk-in read
+#define kWriteChunk     16384           // one enqueueData
+#define kWriteBatch     4096            // one bulk-out transfer
+#define kRunMS          300
+
+typedef struct Direction
+{
+    CirQueue        Queue;
+    UInt8           Buffer[kQueueSize];
+    pthread_mutex_t *Lock;
+    size_t          In;
+    size_t          Out;
+    char            Pad[kCacheLineSize];
+} Direction;
+
+static pthread_mutex_t  rxLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  txLock = PTHREAD_MUTEX_INITIALIZER;
+static Direction        rx, tx;
+static bool             running;
+
+typedef struct Side
+{
+    Direction   *Dir;
+    size_t      Chunk;
+    bool        Producer;
+} Side;
+
+static void *pump( void *arg )
+{
+    Side    *side = (Side *)arg;
+    UInt8   data[kWriteChunk];
+    size_t  n;
+
+    memset( data, 0x55, sizeof(data) );
+    while ( __atomic_load_n( &running, __ATOMIC_RELAXED ) )
+    {
+        pthread_mutex_lock( side->Dir->Lock );
+        if ( side->Producer )
+            side->Dir->In += n = copyintoQueue( &side->Dir->Queue, data, side->Chunk );
+        else
+            side->Dir->Out += n = copyfromQueue( &side->Dir->Queue, data, side->Chunk );
+        pthread_mutex_unlock( side->Dir->Lock );
+        if ( !n )
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void setUp( Direction *dir, pthread_mutex_t *lock )
+{
+    memset( &dir->Queue, 0, sizeof(dir->Queue) );
+    dir->Queue.Start = dir->Buffer;
+    dir->Queue.End = dir->Buffer + kQueueSize;
+    dir->Queue.Size = kQueueSize;
+    dir->Lock = lock;
+    dir->In = dir->Out = 0;
+}
+
+static void run( bool split )
+{
+    Side            sides[4] =
+    {
+        { &rx, kReadChunk, true },      // dataReadComplete
+        { &rx, kWriteChunk, false },    // dequeueData
+        { &tx, kWriteChunk, true },     // enqueueData
+        { &tx, kWriteBatch, false },    // setUpTransmit, from dataWriteComplete
+    };
+    pthread_t       threads[4];
+    struct timespec wait = { 0, kRunMS * 1000000L };
+
+    setUp( &rx, &rxLock );
+    setUp( &tx, split ? &txLock : &rxLock );
+    __atomic_store_n( &running, true, __ATOMIC_RELAXED );
+    for ( int i = 0; i < 4; i++ )
+        pthread_create( &threads[i], NULL, pump, &sides[i] );
+    nanosleep( &wait, NULL );
+    __atomic_store_n( &running, false, __ATOMIC_RELAXED );
+    for ( int i = 0; i < 4; i++ )
+        pthread_join( threads[i], NULL );
+
+    double seconds = kRunMS / 1000.0;
+    printf( "  %-22s RX %8.1f MB/s, TX %8.1f MB/s, both %8.1f MB/s%s\n",
+            split ? "RXLock and TXLock" : "one serialRequestLock",
+            rx.Out / seconds / 1e6, tx.Out / seconds / 1e6, (rx.Out + tx.Out) / seconds / 1e6,
+            (rx.In - rx.Out != rx.Queue.Added - rx.Queue.Removed ||
+             tx.In - tx.Out != tx.Queue.Added - tx.Queue.Removed) ? " LOST BYTES" : "" );
+}
+
+int main( void )
+{
+    printf( "full duplex through the queues, %ld cores, %d ms per run\n", sysconf( _SC_NPROCESSORS_ONLN ), kRunMS );
+    run( false );
+    run( true );
+
+    return 0;
+}
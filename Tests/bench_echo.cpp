@@ -0,0 +1,198 @@
+/*
+ * bench_echo.cpp - request/response round trip through a simulated full
+ * speed device, as a Modbus or AT command exchange sees it. The request
+ * goes out in the next 1 ms frame, the peer echoes it after a turnaround,
+ * the host moves what the chip has received into the bulk-in reads every
+ * frame and a short packet or a full read completes one. The completions are
+ * published to the RX queue; the reader either wakes on them
+ * (dequeueDataGated now) or polls the old way: the last byte hidden for
+ * LAST_BYTE_COOLDOWN after it arrived and BYTE_WAIT_PENALTY slept whenever
+ * high water is not reached. The peer's turnaround varies over a frame.
+ *
+ * The second table is PD_RS232_E_MIN_LATENCY: throughput mode reads 1024
+ * bytes per transfer (a response ending on a packet boundary waits for the
+ * next frame) and holds small writes for the write window when one is
+ * configured; low latency mode reads one packet and sends at once.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <algorithm>
+
+#define kFrameUS        1000.0
+#define kPacketSize     64
+#define kPacketsFrame   19
+#define kReadAhead      4               // kDefaultReadAhead
+#define kTurnaroundUS   200.0           // plus up to a frame
+#define kWriteThreshold 64              // kDefaultWriteThreshold
+#define kCooldownUS     100.0           // the old LAST_BYTE_COOLDOWN
+#define kPenaltyUS      2000.0          // the old BYTE_WAIT_PENALTY
+#define kExchanges      1000
+#define kMaxChunks      256
+
+typedef struct EchoMode
+{
+    const char  *Name;
+    bool        Polling;        // cooldown and wait penalty
+    bool        MinLatency;     // one packet reads, no write hold
+    UInt32      WriteDelayUS;   // the write window, 0 for none
+} EchoMode;
+
+typedef struct Chunk
+{
+    double      Time;           // completion, published to the RX queue
+    size_t      Length;
+} Chunk;
+
+static double frameAfter( double t )
+{
+    return (UInt64)(t / kFrameUS + 1) * kFrameUS;
+}
+
+// The bulk-in completions for a response whose first byte is in the chip at first.
+// Every frame the host moves up to kPacketsFrame packets into the kReadAhead reads.
+static UInt32 completions( double first, double usPerByte, size_t length, UInt32 readSize, Chunk *chunks )
+{
+    UInt32  count = 0;
+    size_t  taken = 0, inRead = 0;
+    double  t = frameAfter( first );
+
+    while ( taken < length && count < kMaxChunks - kReadAhead )
+    {
+        size_t arrived = t < first ? 0 : (size_t)((t - first) / usPerByte) + 1;
+        if ( arrived > length )
+            arrived = length;
+        UInt32 packets = kPacketsFrame, reads = kReadAhead;
+
+        while ( packets && reads )
+        {
+            size_t n = arrived - taken;
+            if ( n > kPacketSize )
+                n = kPacketSize;
+            if ( n > readSize - inRead )
+                n = readSize - inRead;
+
+            // The chip NAKs with nothing in its FIFO; a read left open on a packet
+            // boundary after the last byte is ended in the next frame
+            if ( !n && !(inRead && taken == length) )
+                break;
+            taken += n;
+            inRead += n;
+            packets--;
+
+            // A short packet or a full read completes it
+            if ( inRead == readSize || n < kPacketSize )
+            {
+                chunks[count].Time = t;
+                chunks[count].Length = inRead;
+                count++;
+                inRead = 0;
+                reads--;
+            }
+        }
+        t += kFrameUS;
+    }
+    if ( inRead )
+    {
+        chunks[count].Time = t;
+        chunks[count].Length = inRead;
+        count++;
+    }
+    return count;
+}
+
+static double roundTrip( const EchoMode *mode, double start, double turnaround, UInt32 baudRate, size_t length )
+{
+    static UInt8    buffer[kMinCirBufferSize];
+    static UInt8    out[kMinCirBufferSize];
+    CirQueue        q;
+    Chunk           chunks[kMaxChunks];
+    double          usPerByte = 10.0 * 1e6 / baudRate;
+    UInt32          count, published = 0;
+    size_t          got = 0, high = (sizeof(buffer) * 2) / 3;
+    double          t = start;
+
+    memset( &q, 0, sizeof(q) );
+    q.Start = buffer;
+    q.End = buffer + sizeof(buffer);
+    q.Size = sizeof(buffer);
+
+    // enqueueData submits the request unless setUpTransmit holds it, it goes out in the next frame
+    bool hold = writeHold( mode->WriteDelayUS, mode->MinLatency, false, length, kWriteThreshold, sizeof(buffer) );
+    double sent = frameAfter( hold ? start + mode->WriteDelayUS : start ) + length * usPerByte;
+    count = completions( sent + turnaround, usPerByte, length, mode->MinLatency ? kPacketSize : 1024, chunks );
+
+    // dequeueDataGated( min = length )
+    for (;;)
+    {
+        while ( published < count && chunks[published].Time <= t )
+        {
+            copyintoQueue( &q, out, chunks[published].Length );
+            published++;
+        }
+
+        size_t take = q.Added - q.Removed;
+        if ( mode->Polling && take && t < chunks[published - 1].Time + kCooldownUS )
+            take--;
+        got += copyfromQueue( &q, out, take );
+        if ( got >= length )
+            return t - start;
+
+        // Wait for PD_S_RXQ_EMPTY to clear (the old code also returned on high water)
+        if ( q.Added == q.Removed )
+            t = chunks[published].Time;
+        if ( mode->Polling && (size_t)(q.Added - q.Removed) < high )
+            t += kPenaltyUS;
+    }
+}
+
+static void run( const EchoMode *mode, UInt32 baudRate, size_t length )
+{
+    double      trips[kExchanges];
+    double      sum = 0;
+
+    for ( int i = 0; i < kExchanges; i++ )
+    {
+        double turnaround = kTurnaroundUS + (i * 7919 % kExchanges) * kFrameUS / kExchanges;
+        trips[i] = roundTrip( mode, i * kFrameUS / kExchanges, turnaround, baudRate, length );
+        sum += trips[i];
+    }
+    std::sort( trips, trips + kExchanges );
+    printf( "  %-36s %7u baud %4zu bytes: mean %7.0f us, p50 %7.0f us, p99 %7.0f us\n",
+            mode->Name, baudRate, length, sum / kExchanges,
+            trips[kExchanges / 2], trips[(kExchanges * 99) / 100] );
+}
+
+int main( void )
+{
+    static const EchoMode wakes[] =
+    {
+        { "polling (cooldown, 2 ms penalty)",   true,   false,  0 },
+        { "woken by completions",               false,  false,  0 },
+    };
+    static const EchoMode latency[] =
+    {
+        { "throughput",                         false,  false,  0 },
+        { "throughput, 2 ms write window",      false,  false,  2000 },
+        { "low latency",                        false,  true,   2000 },
+    };
+
+    printf( "echo round trip, simulated full speed device, %.0f to %.0f us turnaround\n", kTurnaroundUS, kTurnaroundUS + kFrameUS );
+    for ( size_t m = 0; m < sizeof(wakes) / sizeof(wakes[0]); m++ )
+    {
+        run( &wakes[m], 9600, 8 );
+        run( &wakes[m], 115200, 8 );
+        run( &wakes[m], 115200, 64 );
+    }
+
+    printf( "PD_RS232_E_MIN_LATENCY\n" );
+    for ( size_t m = 0; m < sizeof(latency) / sizeof(latency[0]); m++ )
+    {
+        run( &latency[m], 115200, 8 );
+        run( &latency[m], 3000000, 8 );
+        run( &latency[m], 3000000, 256 );
+    }
+
+    return 0;
+}
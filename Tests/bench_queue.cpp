@@ -0,0 +1,138 @@
+/*
+ * bench_queue.cpp - bytes/sec through the ring buffer, the span copies
+ * against the per-byte path the driver used before (addtoQueue and
+ * removefromQueue looping over addBytetoQueue / getBytetoQueue, each
+ * taking the port lock). A pthread mutex stands in for the IOLock.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define kQueueSize      16384
+#define kTotalBytes     (64u << 20)
+
+// The old queue: pointers and a byte count, one lock round trip per byte
+typedef struct ByteQueue
+{
+    UInt8   *Start;
+    UInt8   *End;
+    UInt8   *NextChar;
+    UInt8   *LastChar;
+    size_t  Size;
+    size_t  InQueue;
+} ByteQueue;
+
+static pthread_mutex_t  byteLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool addByte( ByteQueue *Queue, UInt8 Value )
+{
+    pthread_mutex_lock( &byteLock );
+    if ( (Queue->NextChar == Queue->LastChar) && Queue->InQueue )
+    {
+        pthread_mutex_unlock( &byteLock );
+        return false;
+    }
+    *Queue->NextChar++ = Value;
+    Queue->InQueue++;
+    if ( Queue->NextChar >= Queue->End )
+        Queue->NextChar = Queue->Start;
+    pthread_mutex_unlock( &byteLock );
+    return true;
+}
+
+static bool getByte( ByteQueue *Queue, UInt8 *Value )
+{
+    pthread_mutex_lock( &byteLock );
+    if ( (Queue->NextChar == Queue->LastChar) && !Queue->InQueue )
+    {
+        pthread_mutex_unlock( &byteLock );
+        return false;
+    }
+    *Value = *Queue->LastChar++;
+    Queue->InQueue--;
+    if ( Queue->LastChar >= Queue->End )
+        Queue->LastChar = Queue->Start;
+    pthread_mutex_unlock( &byteLock );
+    return true;
+}
+
+static size_t addBytes( ByteQueue *Queue, const UInt8 *Buffer, size_t Size )
+{
+    size_t written = 0;
+
+    while ( (Queue->Size - Queue->InQueue) && (Size > written) && addByte( Queue, Buffer[written] ) )
+        written++;
+    return written;
+}
+
+static size_t getBytes( ByteQueue *Queue, UInt8 *Buffer, size_t MaxSize )
+{
+    size_t received = 0;
+
+    while ( (MaxSize > received) && getByte( Queue, &Buffer[received] ) )
+        received++;
+    return received;
+}
+
+static double seconds( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static UInt8    storage[kQueueSize];
+static UInt8    chunk[kQueueSize];
+
+// Fill and drain in chunk sized steps, as a bulk-in completion and a read would
+static double benchBytes( size_t chunkSize )
+{
+    ByteQueue   q = { storage, storage + kQueueSize, storage, storage, kQueueSize, 0 };
+    size_t      moved = 0;
+    double      start = seconds();
+
+    while ( moved < kTotalBytes )
+    {
+        size_t n = addBytes( &q, chunk, chunkSize );
+        moved += getBytes( &q, chunk, n );
+    }
+    return moved / (seconds() - start);
+}
+
+static double benchSpans( size_t chunkSize )
+{
+    CirQueue    q;
+    size_t      moved = 0;
+    double      start;
+
+    memset( &q, 0, sizeof(q) );
+    q.Start = storage;
+    q.End = storage + kQueueSize;
+    q.Size = kQueueSize;
+
+    start = seconds();
+    while ( moved < kTotalBytes )
+    {
+        size_t n = copyintoQueue( &q, chunk, chunkSize );
+        moved += copyfromQueue( &q, chunk, n );
+    }
+    return moved / (seconds() - start);
+}
+
+int main( void )
+{
+    static const size_t chunks[] = { 1, 16, 64, 512, 1024, 4096 };
+
+    printf( "%8s %16s %16s %8s\n", "chunk", "per-byte MB/s", "span MB/s", "speedup" );
+    for ( size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++ )
+    {
+        double bytes = benchBytes( chunks[i] );
+        double spans = benchSpans( chunks[i] );
+        printf( "%8zu %16.1f %16.1f %7.1fx\n", chunks[i], bytes / 1e6, spans / 1e6, spans / bytes );
+    }
+    return 0;
+}
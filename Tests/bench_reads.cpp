@@ -0,0 +1,139 @@
+/*
+ * bench_reads.cpp - bulk-in transfer size against a simulated full speed
+ * endpoint. The chip receives at the line rate into its FIFO; in every 1 ms
+ * frame the host fills the outstanding reads in order, up to 19 packets of
+ * 64 bytes, and a read completes when it is full or ends on a short packet.
+ * The completions then go through the driver's delivery path (nextReadDone,
+ * copyintoQueue under a lock standing in for the RXLock), which is timed.
+ * 1 x 1 byte is the old USBLapPayLoad read, 16 x 64 x 4 the default.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define kLineRate       3000000
+#define kPacketSize     64
+#define kPacketsFrame   19
+#define kChipFIFO       512
+#define kFrames         10000
+#define kMaxReads       8
+
+typedef struct BenchRead
+{
+    UInt8       Buffer[64 * kPacketSize];
+    UInt32      Length;
+    bool        Pending;
+    bool        Done;
+} BenchRead;
+
+static BenchRead        reads[kMaxReads];
+static pthread_mutex_t  rxLock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run( UInt32 size, UInt32 count )
+{
+    static UInt8    buffer[kMaxCirBufferSize];
+    static UInt8    out[kMaxCirBufferSize];
+    CirQueue        q;
+    UInt32          head = 0, next = 0;
+    size_t          perFrame = bytesInTime( kLineRate, 1 );
+    size_t          fifo = 0, sent = 0, lost = 0, delivered = 0;
+    unsigned long   completions = 0;
+    double          cpu = 0, start;
+
+    memset( &q, 0, sizeof(q) );
+    q.Start = buffer;
+    q.End = buffer + sizeof(buffer);
+    q.Size = sizeof(buffer);
+    for ( UInt32 i = 0; i < count; i++ )
+    {
+        reads[i].Pending = true;
+        reads[i].Done = false;
+        reads[i].Length = 0;
+    }
+
+    for ( int frame = 0; frame < kFrames; frame++ )
+    {
+        // The line fills the chip's FIFO, what does not fit is lost
+        size_t room = kChipFIFO - fifo;
+        size_t in = perFrame < room ? perFrame : room;
+        lost += perFrame - in;
+        fifo += in;
+
+        // The host moves up to kPacketsFrame packets into the reads, oldest first
+        UInt32 packets = kPacketsFrame;
+        UInt32 first = next, finished = 0;
+        while ( packets && fifo && finished < count )
+        {
+            BenchRead *request = &reads[next];
+            size_t n = size - request->Length;
+            if ( n > kPacketSize )
+                n = kPacketSize;
+            if ( n > fifo )
+                n = fifo;
+            for ( size_t i = 0; i < n; i++ )
+                request->Buffer[request->Length + i] = (UInt8)(sent + i);
+            request->Length += n;
+            sent += n;
+            fifo -= n;
+            packets--;
+            if ( request->Length == size || n < kPacketSize )
+            {
+                next = (next + 1) % count;
+                finished++;
+            }
+        }
+
+        // Their completions, delivered as dataReadComplete does
+        start = now();
+        for ( UInt32 i = 0; i < finished; i++ )
+        {
+            BenchRead *request = &reads[(first + i) % count];
+
+            pthread_mutex_lock( &rxLock );
+            request->Pending = false;
+            request->Done = true;
+            while ( (request = nextReadDone( reads, count, &head )) )
+            {
+                pthread_mutex_unlock( &rxLock );
+                delivered += copyintoQueue( &q, request->Buffer, request->Length );
+                request->Length = 0;
+                pthread_mutex_lock( &rxLock );
+                request->Pending = true;    // submitted again
+            }
+            pthread_mutex_unlock( &rxLock );
+            completions++;
+        }
+        cpu += now() - start;
+
+        // A reader keeping up
+        copyfromQueue( &q, out, sizeof(out) );
+    }
+
+    double seconds = kFrames / 1000.0;
+    double mb = delivered / 1e6;
+    printf( "  %4u bytes x %u reads: %8.1f KB/s, %5.1f%% of the line lost, %8.0f completions/MB, %7.1f us CPU/MB\n",
+            size, count, delivered / seconds / 1e3, 100.0 * lost / (sent + lost + fifo),
+            mb > 0 ? completions / mb : 0.0, mb > 0 ? cpu * 1e6 / mb : 0.0 );
+}
+
+int main( void )
+{
+    printf( "bulk-in at %u baud, simulated full speed endpoint, %d frames\n", kLineRate, kFrames );
+    run( 1, 1 );
+    run( kPacketSize, 1 );
+    run( 16 * kPacketSize, 1 );
+    run( 16 * kPacketSize, 4 );
+    run( 64 * kPacketSize, 4 );
+
+    return 0;
+}
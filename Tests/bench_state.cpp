@@ -0,0 +1,127 @@
+/*
+ * bench_state.cpp - contention on the port state word. Several pollers read
+ * it in a loop, as getState, enqueueData, dequeueData and checkQueues do,
+ * while changers update their own bits, as the completions do. The atomic
+ * word (loadStateWord, changeStateWord) against the old way, a lock around
+ * every read and every masked update. A pthread mutex stands in for the
+ * serialRequestLock. Each changer flips its bit an even number of times, so
+ * a lost update shows as a bit left set at the end.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define kMaxPollers     8
+#define kChangers       2
+#define kRunMS          200
+
+static pthread_mutex_t  stateLock = PTHREAD_MUTEX_INITIALIZER;
+static UInt32           portState;
+static bool             useLock;
+static bool             running;
+
+typedef struct Counter
+{
+    unsigned long   Count;
+    UInt32          Seen;
+    char            Pad[kCacheLineSize];    // one line per thread
+} Counter;
+
+static Counter  pollers[kMaxPollers];
+static Counter  changers[kChangers];
+
+static UInt32 readState( void )
+{
+    UInt32  state;
+
+    if ( !useLock )
+        return loadStateWord( &portState );
+    pthread_mutex_lock( &stateLock );
+    state = portState;
+    pthread_mutex_unlock( &stateLock );
+    return state;
+}
+
+static void changeState( UInt32 state, UInt32 mask )
+{
+    UInt32  update;
+
+    if ( !useLock )
+    {
+        changeStateWord( &portState, state, mask, &update );
+        return;
+    }
+    pthread_mutex_lock( &stateLock );
+    portState = (portState & ~mask) | (state & mask);
+    pthread_mutex_unlock( &stateLock );
+}
+
+static void *poller( void *arg )
+{
+    Counter *counter = (Counter *)arg;
+
+    while ( __atomic_load_n( &running, __ATOMIC_RELAXED ) )
+    {
+        counter->Seen |= readState();
+        counter->Count++;
+    }
+    return NULL;
+}
+
+static void *changer( void *arg )
+{
+    Counter *counter = (Counter *)arg;
+    UInt32  bit = 1u << (counter - changers);
+
+    while ( __atomic_load_n( &running, __ATOMIC_RELAXED ) )
+    {
+        changeState( bit, bit );
+        changeState( 0, bit );
+        counter->Count += 2;
+    }
+    return NULL;
+}
+
+static void run( bool locked, int pollerCount )
+{
+    pthread_t       threads[kMaxPollers + kChangers];
+    struct timespec wait = { 0, kRunMS * 1000000L };
+    unsigned long   reads = 0, changes = 0;
+
+    useLock = locked;
+    portState = 0;
+    memset( pollers, 0, sizeof(pollers) );
+    memset( changers, 0, sizeof(changers) );
+    __atomic_store_n( &running, true, __ATOMIC_RELAXED );
+    for ( int i = 0; i < pollerCount; i++ )
+        pthread_create( &threads[i], NULL, poller, &pollers[i] );
+    for ( int i = 0; i < kChangers; i++ )
+        pthread_create( &threads[pollerCount + i], NULL, changer, &changers[i] );
+    nanosleep( &wait, NULL );
+    __atomic_store_n( &running, false, __ATOMIC_RELAXED );
+    for ( int i = 0; i < pollerCount + kChangers; i++ )
+        pthread_join( threads[i], NULL );
+
+    for ( int i = 0; i < pollerCount; i++ )
+        reads += pollers[i].Count;
+    for ( int i = 0; i < kChangers; i++ )
+        changes += changers[i].Count;
+    printf( "  %-6s %d pollers: %8.1f M reads/s, %7.1f M changes/s%s\n", locked ? "lock" : "atomic",
+            pollerCount, reads / (kRunMS * 1e3), changes / (kRunMS * 1e3),
+            portState ? " LOST UPDATE" : "" );
+}
+
+int main( void )
+{
+    printf( "port state word, %d changers, %d ms per run\n", kChangers, kRunMS );
+    for ( int pollerCount = 1; pollerCount <= kMaxPollers; pollerCount *= 2 )
+    {
+        run( true, pollerCount );
+        run( false, pollerCount );
+    }
+
+    return 0;
+}
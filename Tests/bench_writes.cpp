@@ -0,0 +1,142 @@
+/*
+ * bench_writes.cpp - write combining against an application that writes
+ * one byte at a time. Every enqueueData runs setUpTransmit, which fills a
+ * free bulk-out buffer straight from the TX queue unless writeHold keeps
+ * the bytes back for the window; the window closing sends them (the
+ * fWriteTimer). A transfer goes on the bus in the next 1 ms frame and
+ * completes once the line has sent it, its completion runs setUpTransmit
+ * again. Reports USB transfers, bytes per transfer, throughput and how
+ * long a byte waited from enqueueData until it was on the line.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#define kBaudRate       921600
+#define kFrameUS        1000.0
+#define kWriteBuffers   2               // kDefaultWriteBuffers
+#define kWriteBatch     4096            // MAX_BLOCK_SIZE
+#define kWriteThreshold 64              // kDefaultWriteThreshold
+#define kWriteQueue     16384
+#define kWriteBytes     20000
+
+typedef struct BenchWrite
+{
+    UInt8       Buffer[kWriteBatch];
+    size_t      Count;
+    size_t      First;          // stream offset of Buffer[0]
+    bool        Pending;
+    double      Finish;
+} BenchWrite;
+
+static double frameAfter( double t )
+{
+    return (UInt64)(t / kFrameUS + 1) * kFrameUS;
+}
+
+static void run( UInt32 delayUS, double intervalUS )
+{
+    static UInt8    buffer[kWriteQueue];
+    BenchWrite      writes[kWriteBuffers];
+    CirQueue        q;
+    UInt32          next = 0;
+    size_t          queued = 0, sent = 0, transfers = 0;
+    size_t          high = (kWriteQueue * 2) / 3;
+    double          usPerByte = 10.0 * 1e6 / kBaudRate;
+    double          now = 0, lineFree = 0, timer = -1, waited = 0;
+
+    memset( writes, 0, sizeof(writes) );
+    memset( &q, 0, sizeof(q) );
+    q.Start = buffer;
+    q.End = buffer + sizeof(buffer);
+    q.Size = sizeof(buffer);
+
+    while ( sent < kWriteBytes )
+    {
+        // The next event: a write, a completion or the window closing
+        double  at = queued < kWriteBytes ? queued * intervalUS : -1;
+        int     which = 0;
+        for ( UInt32 i = 0; i < kWriteBuffers; i++ )
+            if ( writes[i].Pending && (at < 0 || writes[i].Finish < at) )
+            {
+                at = writes[i].Finish;
+                which = 1;
+            }
+        if ( timer >= 0 && (at < 0 || timer < at) )
+        {
+            at = timer;
+            which = 2;
+        }
+        now = at;
+
+        bool flush = false;
+        if ( which == 0 )
+        {
+            // enqueueData of one byte
+            UInt8 byte = (UInt8)queued;
+            queued += copyintoQueue( &q, &byte, 1 );
+        }
+        else if ( which == 1 )
+        {
+            // dataWriteComplete for the oldest
+            BenchWrite *done = NULL;
+            for ( UInt32 i = 0; i < kWriteBuffers; i++ )
+                if ( writes[i].Pending && (!done || writes[i].Finish < done->Finish) )
+                    done = &writes[i];
+            for ( size_t i = 0; i < done->Count; i++ )
+                waited += done->Finish - (done->First + i) * intervalUS - (done->Count - i) * usPerByte;
+            sent += done->Count;
+            done->Pending = false;
+        }
+        else
+        {
+            // writeTimeout
+            timer = -1;
+            flush = true;
+        }
+
+        // setUpTransmit
+        bool hold = false;
+        for (;;)
+        {
+            BenchWrite *request = &writes[next];
+            size_t used = q.Added - q.Removed;
+            if ( request->Pending || !used )
+                break;
+            hold = writeHold( delayUS, false, flush, used, kWriteThreshold, high );
+            if ( hold )
+                break;
+            request->First = q.Removed;
+            request->Count = copyfromQueue( &q, request->Buffer, kWriteBatch );
+            double start = frameAfter( now ) > lineFree ? frameAfter( now ) : lineFree;
+            request->Finish = start + request->Count * usPerByte;
+            request->Pending = true;
+            lineFree = request->Finish;
+            transfers++;
+            next = (next + 1) % kWriteBuffers;
+        }
+        if ( !(q.Added - q.Removed) )
+            timer = -1;
+        else if ( hold && timer < 0 )
+            timer = now + delayUS;
+    }
+
+    printf( "  window %5u us, a byte every %5.0f us: %6zu transfers, %6.1f bytes/transfer, %6.1f KB/s, %6.0f us waited\n",
+            delayUS, intervalUS, transfers, (double)sent / transfers, sent / now * 1e3, waited / sent );
+}
+
+int main( void )
+{
+    static const UInt32 windows[] = { 0, 500, 2000 };
+
+    printf( "1 byte writes at %u baud (line %.1f KB/s), %d bytes, %d write buffers\n",
+            kBaudRate, kBaudRate / 10.0 / 1e3, kWriteBytes, kWriteBuffers );
+    for ( size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++ )
+    {
+        run( windows[w], 10 );
+        run( windows[w], 100 );
+        run( windows[w], 1000 );
+    }
+
+    return 0;
+}
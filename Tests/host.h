@@ -0,0 +1,53 @@
+/*
+ * host.h - what Driver_PL2303_Util.h expects from libkern, for building
+ * the pure parts of the driver on a host (Linux or OS X user space).
+ */
+
+#ifndef PL2303_TESTS_HOST_H
+#define PL2303_TESTS_HOST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int32_t     SInt32;
+
+// IOKit/usb/USB.h
+typedef struct IOUSBDevRequest
+{
+    UInt8       bmRequestType;
+    UInt8       bRequest;
+    UInt16      wValue;
+    UInt16      wIndex;
+    UInt16      wLength;
+    void        *pData;
+    UInt32      wLenDone;
+} IOUSBDevRequest;
+
+static int failures;
+
+#define CHECK( cond ) \
+    do { if ( !(cond) ) { failures++; fprintf( stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond ); } } while ( 0 )
+
+#define CHECK_EQ( a, b ) \
+    do { unsigned long long _a = (a), _b = (b); \
+         if ( _a != _b ) { failures++; fprintf( stderr, "%s:%d: CHECK_EQ failed: %s == %s (%llu != %llu)\n", \
+                                                __FILE__, __LINE__, #a, #b, _a, _b ); } } while ( 0 )
+
+static inline int testResult( const char *name )
+{
+    if ( failures )
+        fprintf( stderr, "%s: %d failure(s)\n", name, failures );
+    else
+        printf( "%s: ok\n", name );
+    return failures ? 1 : 0;
+}
+
+#endif /* PL2303_TESTS_HOST_H */
@@ -0,0 +1,178 @@
+/*
+ * test_allocs.cpp - the data path must not allocate. allocBuffer counts
+ * the driver's own allocations in fAllocations; here every heap allocation
+ * of the process is counted while data streams both ways through the parts
+ * of the data path that build on the host: TX queue into preallocated
+ * bulk-out buffers (as setUpTransmit fills them), bulk-in reads delivered
+ * in order into the RX queue (as dataReadComplete does), the queue bits.
+ * Only the setup before the stream may allocate.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <new>
+
+static unsigned long    allocations;
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc( size_t size );
+extern "C" void *__libc_calloc( size_t count, size_t size );
+extern "C" void *__libc_realloc( void *ptr, size_t size );
+
+extern "C" void *malloc( size_t size )
+{
+    allocations++;
+    return __libc_malloc( size );
+}
+
+extern "C" void *calloc( size_t count, size_t size )
+{
+    allocations++;
+    return __libc_calloc( count, size );
+}
+
+extern "C" void *realloc( void *ptr, size_t size )
+{
+    allocations++;
+    return __libc_realloc( ptr, size );
+}
+#endif
+
+// Counted through malloc on glibc, here elsewhere
+__attribute__((noinline)) void *operator new( size_t size )
+{
+#ifndef __GLIBC__
+    allocations++;
+#endif
+    void *p = malloc( size );
+    if ( !p )
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete( void *p ) noexcept
+{
+    free( p );
+}
+
+#define kBatch          4096            // MAX_BLOCK_SIZE
+#define kWriteBuffers   2
+#define kReadSize       1024
+#define kReadAhead      4
+#define kStreamBytes    (8u << 20)
+
+typedef struct Buffer
+{
+    UInt8       *Data;
+    size_t      Count;
+    UInt32      Length;
+    bool        Pending;
+    bool        Done;
+} Buffer;
+
+static void testHook( void )
+{
+    unsigned long before = allocations;
+    int *p = new int( 1 );
+    delete p;
+    CHECK( allocations > before );
+}
+
+static void testSteadyState( void )
+{
+    CirQueue        tx, rx;
+    Buffer          writes[kWriteBuffers];
+    Buffer          reads[kReadAhead];
+    UInt8           *chunk;
+    UInt32          nextWrite = 0, readHead = 0, nextRead = 0;
+    size_t          queued = 0, received = 0;
+    UInt8           expect = 0;
+    bool            ordered = true;
+    unsigned long   before;
+
+    // Setup: the queues and the pipe buffers, as allocateResources does
+    memset( &tx, 0, sizeof(tx) );
+    memset( &rx, 0, sizeof(rx) );
+    tx.Size = rx.Size = 16384;
+    tx.Start = (UInt8 *)malloc( tx.Size );
+    rx.Start = (UInt8 *)malloc( rx.Size );
+    tx.End = tx.Start + tx.Size;
+    rx.End = rx.Start + rx.Size;
+    for ( int i = 0; i < kWriteBuffers; i++ )
+    {
+        memset( &writes[i], 0, sizeof(writes[i]) );
+        writes[i].Data = (UInt8 *)malloc( kBatch );
+    }
+    for ( int i = 0; i < kReadAhead; i++ )
+    {
+        memset( &reads[i], 0, sizeof(reads[i]) );
+        reads[i].Data = (UInt8 *)malloc( kReadSize );
+        reads[i].Pending = true;
+    }
+    chunk = (UInt8 *)malloc( kBatch );
+
+    before = allocations;
+    while ( received < kStreamBytes )
+    {
+        // enqueueData
+        size_t want = 1 + (queued % 1500);
+        for ( size_t i = 0; i < want; i++ )
+            chunk[i] = (UInt8)(queued + i);
+        queued += copyintoQueue( &tx, chunk, want );
+        queueLevelBits( tx.Added - tx.Removed, tx.Size, 4096, 8192, 1, 2, 4, 8 );
+
+        // setUpTransmit into the next free buffer, then the device completes it
+        Buffer *write = &writes[nextWrite];
+        write->Count = copyfromQueue( &tx, write->Data, kBatch );
+        nextWrite = (nextWrite + 1) % kWriteBuffers;
+
+        // The device loops it back through the bulk-in reads
+        size_t at = 0;
+        while ( at < write->Count )
+        {
+            Buffer *read = &reads[nextRead];
+            size_t n = write->Count - at < kReadSize ? write->Count - at : kReadSize;
+            memcpy( read->Data, write->Data + at, n );
+            read->Length = n;
+            read->Pending = false;
+            read->Done = true;
+            at += n;
+            nextRead = (nextRead + 1) % kReadAhead;
+
+            // dataReadComplete
+            while ( (read = nextReadDone( reads, kReadAhead, &readHead )) )
+            {
+                copyintoQueue( &rx, read->Data, read->Length );
+                read->Pending = true;
+            }
+            queueLevelBits( rx.Added - rx.Removed, rx.Size, 4096, 8192, 1, 2, 4, 8 );
+        }
+
+        // dequeueData
+        size_t got = copyfromQueue( &rx, chunk, kBatch );
+        for ( size_t i = 0; i < got; i++ )
+            if ( chunk[i] != expect++ )
+                ordered = false;
+        received += got;
+    }
+
+    CHECK_EQ( allocations - before, 0 );
+    CHECK( ordered );
+
+    free( chunk );
+    for ( int i = 0; i < kReadAhead; i++ )
+        free( reads[i].Data );
+    for ( int i = 0; i < kWriteBuffers; i++ )
+        free( writes[i].Data );
+    free( rx.Start );
+    free( tx.Start );
+}
+
+int main( void )
+{
+    testHook();
+    testSteadyState();
+
+    return testResult( "test_allocs" );
+}
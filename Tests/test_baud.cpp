@@ -0,0 +1,169 @@
+/*
+ * test_baud.cpp - line coding and baud rate encoding.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+static void testLineCoding( void )
+{
+    LineCoding  coding = { 0x12345678, 2, 1, 7 };
+    LineCoding  back;
+    UInt8       buf[kLineCodingSize];
+
+    encodeLineCoding( &coding, buf );
+
+    // Little endian rate, then stop bits, parity and data bits
+    CHECK_EQ( buf[0], 0x78 );
+    CHECK_EQ( buf[1], 0x56 );
+    CHECK_EQ( buf[2], 0x34 );
+    CHECK_EQ( buf[3], 0x12 );
+    CHECK_EQ( buf[4], 2 );
+    CHECK_EQ( buf[5], 1 );
+    CHECK_EQ( buf[6], 7 );
+
+    decodeLineCoding( buf, &back );
+    CHECK_EQ( back.Rate, coding.Rate );
+    CHECK_EQ( back.StopBits, coding.StopBits );
+    CHECK_EQ( back.Parity, coding.Parity );
+    CHECK_EQ( back.DataBits, coding.DataBits );
+
+    // 9600 8N1 as the chip reports it
+    const UInt8 reply[kLineCodingSize] = { 0x80, 0x25, 0x00, 0x00, 0, 0, 8 };
+
+    decodeLineCoding( reply, &back );
+    CHECK_EQ( back.Rate, 9600 );
+    CHECK_EQ( back.StopBits, 0 );
+    CHECK_EQ( back.Parity, 0 );
+    CHECK_EQ( back.DataBits, 8 );
+
+    // The divisor flag in the top bit survives the round trip
+    coding.Rate = 0x80000000 | (1 << 9) | 250;
+    encodeLineCoding( &coding, buf );
+    CHECK_EQ( buf[3], 0x80 );
+    decodeLineCoding( buf, &back );
+    CHECK_EQ( back.Rate, coding.Rate );
+}
+
+static void testBaudRateError( void )
+{
+    CHECK_EQ( baudRateError( 9600, 9600 ), 0 );
+    CHECK_EQ( baudRateError( 10000, 10100 ), 100 );
+    CHECK_EQ( baudRateError( 10000, 9900 ), 100 );
+    CHECK_EQ( baudRateError( 9600, 9615 ), 15 );
+    CHECK_EQ( baudRateError( 0, 9600 ), 0 );
+    CHECK_EQ( baudRateError( 12000000, 0 ), 10000 );
+}
+
+// The rate the chip makes of a divisor code
+static UInt32 divisorRate( UInt32 code )
+{
+    UInt32 mantissa = code & 0x1ff;
+    UInt32 exponent = (code >> 9) & 0x7;
+
+    return (kBaudDivisorBase >> (exponent << 1)) / mantissa;
+}
+
+static void testDivisorBaudRate( void )
+{
+    UInt32 achieved;
+
+    // Exact divisors of 12 MHz * 32
+    CHECK_EQ( divisorBaudRate( 12000000, &achieved ), kBaudDivisorFlag | 32 );
+    CHECK_EQ( achieved, 12000000 );
+    CHECK_EQ( divisorBaudRate( 250000, &achieved ), kBaudDivisorFlag | (1 << 9) | 384 );
+    CHECK_EQ( achieved, 250000 );
+    divisorBaudRate( 75, &achieved );
+    CHECK_EQ( achieved, 75 );
+
+    // The nearest there is
+    divisorBaudRate( 115200, &achieved );
+    CHECK_EQ( achieved, 115384 );
+
+    // Below the slowest divisor: the slowest one
+    CHECK_EQ( divisorBaudRate( 0, &achieved ), kBaudDivisorFlag | (kMaxBaudExponent << 9) | kMaxBaudMantissa );
+    CHECK_EQ( achieved, (kBaudDivisorBase >> (kMaxBaudExponent << 1)) / kMaxBaudMantissa );
+
+    // The whole range the HX generator covers, 75 bps to 12 Mbps: the code is
+    // well formed, gives the rate reported and stays within kBaudRateTolerance
+    UInt32 worst = 0;
+
+    for ( UInt32 rate = 75; rate <= 12000000; rate += rate / 1000 + 1 )
+    {
+        UInt32 code = divisorBaudRate( rate, &achieved );
+        UInt32 error = baudRateError( rate, achieved );
+
+        CHECK( code & kBaudDivisorFlag );
+        CHECK( (code & ~kBaudDivisorFlag) >> 12 == 0 );
+        CHECK( (code & 0x1ff) >= 1 );
+        CHECK_EQ( divisorRate( code ), achieved );
+        CHECK( error <= kBaudRateTolerance );
+        if ( error > worst )
+            worst = error;
+    }
+    CHECK( worst < kBaudRateTolerance / 2 );
+}
+
+static void testBaudCapabilities( void )
+{
+    // Every standard rate goes through unchanged up to each type's limit
+    for ( UInt32 i = 0; i < kStandardBaudRateCount; i++ )
+    {
+        UInt32 rate = kStandardBaudRates[i];
+
+        CHECK( isStandardBaudRate( rate ) );
+        for ( int type = unknown; type <= rev_H; type++ )
+            CHECK_EQ( supportedBaudRate( (enum pl2303_type)type, rate ), rate <= kBaudCapabilities[type].MaxRate ? rate : 0 );
+    }
+
+    // Nearest standard rate, ties go up, never past maxRate
+    CHECK_EQ( nearestBaudRate( 76, kLinkSpeed1228800 ), kLinkSpeed75 );
+    CHECK_EQ( nearestBaudRate( 14400, kLinkSpeed1228800 ), kLinkSpeed19200 );
+    CHECK_EQ( nearestBaudRate( 14399, kLinkSpeed1228800 ), kLinkSpeed9600 );
+    CHECK_EQ( nearestBaudRate( 100000, kLinkSpeed1228800 ), kLinkSpeed115200 );
+    CHECK_EQ( nearestBaudRate( 2000000, kLinkSpeed1228800 ), kLinkSpeed1228800 );
+    CHECK_EQ( nearestBaudRate( 2000000, kLinkSpeed6000000 ), kLinkSpeed1843200 );
+
+    // Off-list rates: HX divides, the older chips round, unknown chips get
+    // the rate as asked, as before the capability table
+    CHECK_EQ( supportedBaudRate( rev_HX, 250000 ), 250000 );
+    CHECK_EQ( supportedBaudRate( rev_X, 250000 ), kLinkSpeed230400 );
+    CHECK_EQ( supportedBaudRate( rev_H, 31250 ), kLinkSpeed38400 );
+    CHECK_EQ( supportedBaudRate( unknown, 250000 ), 250000 );
+    CHECK_EQ( supportedBaudRate( unknown, 31250 ), 31250 );
+
+    // Limits
+    CHECK_EQ( supportedBaudRate( type_1, kLinkSpeed1843200 ), 0 );
+    CHECK_EQ( supportedBaudRate( rev_HX, kMaxBaudRate + 1 ), 0 );
+    CHECK_EQ( supportedBaudRate( unknown, kMaxBaudRate ), kMaxBaudRate );
+    CHECK_EQ( supportedBaudRate( unknown, kMaxBaudRate + 1 ), 0 );
+    for ( int type = unknown; type <= rev_H; type++ )
+        CHECK_EQ( supportedBaudRate( (enum pl2303_type)type, kMinBaudRate - 1 ), 0 );
+
+    // Whatever comes back for an in-range rate is a rate this type can send
+    for ( UInt32 rate = kMinBaudRate; rate <= kMaxBaudRate; rate += rate / 100 + 1 )
+    {
+        for ( int type = unknown; type <= rev_H; type++ )
+        {
+            const BaudCapability *cap = &kBaudCapabilities[type];
+            UInt32 got = supportedBaudRate( (enum pl2303_type)type, rate );
+
+            if ( rate > cap->MaxRate )
+                CHECK_EQ( got, 0 );
+            else if ( cap->Rounded )
+                CHECK( isStandardBaudRate( got ) && got <= cap->MaxRate );
+            else
+                CHECK_EQ( got, rate );
+        }
+    }
+}
+
+int main( void )
+{
+    testLineCoding();
+    testBaudRateError();
+    testDivisorBaudRate();
+    testBaudCapabilities();
+
+    return testResult( "test_baud" );
+}
@@ -0,0 +1,131 @@
+/*
+ * test_control.cpp - coalescing in the control request queue
+ * (controlRequestSlot, used by addControlRequest).
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+static ControlRequest   requests[kControlQueueSize];
+static UInt32           head;
+static UInt32           count;
+
+static IOUSBDevRequest makeRequest( UInt8 type, UInt8 request, UInt16 value )
+{
+    IOUSBDevRequest r;
+
+    memset( &r, 0, sizeof(r) );
+    r.bmRequestType = type;
+    r.bRequest = request;
+    r.wValue = value;
+    return r;
+}
+
+// What addControlRequest does with the slot, minus the payload
+static ControlRequest *add( IOUSBDevRequest r, bool busy )
+{
+    ControlRequest *slot = controlRequestSlot( requests, head, &count, busy, &r );
+
+    if ( slot )
+        slot->Request = r;
+    return slot;
+}
+
+static void reset( UInt32 newHead )
+{
+    memset( requests, 0, sizeof(requests) );
+    head = newHead;
+    count = 0;
+}
+
+static void testModemLinesMerge( void )
+{
+    reset( 0 );
+
+    // The first one goes on the bus, it must never be rewritten
+    ControlRequest *first = add( makeRequest( SET_CONTROL_REQUEST_TYPE, SET_CONTROL_REQUEST, CONTROL_DTR ), false );
+    CHECK( first == &requests[0] );
+    CHECK_EQ( count, 1 );
+
+    ControlRequest *second = add( makeRequest( SET_CONTROL_REQUEST_TYPE, SET_CONTROL_REQUEST, CONTROL_RTS ), true );
+    CHECK( second == &requests[1] );
+    CHECK_EQ( count, 2 );
+
+    // Waiting behind the busy one: replaced, not queued again
+    ControlRequest *third = add( makeRequest( SET_CONTROL_REQUEST_TYPE, SET_CONTROL_REQUEST, CONTROL_DTR | CONTROL_RTS ), true );
+    CHECK( third == second );
+    CHECK_EQ( count, 2 );
+    CHECK_EQ( requests[0].Request.wValue, CONTROL_DTR );
+    CHECK_EQ( requests[1].Request.wValue, CONTROL_DTR | CONTROL_RTS );
+}
+
+static void testNotBusyTailMerges( void )
+{
+    reset( 0 );
+
+    // Nothing on the bus yet, so even a single queued request can be replaced
+    add( makeRequest( SET_LINE_REQUEST_TYPE, SET_LINE_REQUEST, 0 ), false );
+    CHECK( add( makeRequest( SET_LINE_REQUEST_TYPE, SET_LINE_REQUEST, 1 ), false ) == &requests[0] );
+    CHECK_EQ( count, 1 );
+    CHECK_EQ( requests[0].Request.wValue, 1 );
+}
+
+static void testOrderKept( void )
+{
+    reset( 0 );
+
+    add( makeRequest( SET_LINE_REQUEST_TYPE, SET_LINE_REQUEST, 0 ), true );
+    add( makeRequest( SET_LINE_REQUEST_TYPE, SET_LINE_REQUEST, 1 ), true );
+    add( makeRequest( BREAK_REQUEST_TYPE, BREAK_REQUEST, BREAK_ON ), true );
+    CHECK_EQ( count, 3 );
+
+    // Only the tail is looked at: a line coding behind a break is a new request
+    add( makeRequest( SET_LINE_REQUEST_TYPE, SET_LINE_REQUEST, 2 ), true );
+    CHECK_EQ( count, 4 );
+    CHECK_EQ( requests[1].Request.wValue, 1 );
+    CHECK_EQ( requests[3].Request.wValue, 2 );
+
+    // Breaks and reads are never merged
+    add( makeRequest( BREAK_REQUEST_TYPE, BREAK_REQUEST, BREAK_OFF ), true );
+    add( makeRequest( BREAK_REQUEST_TYPE, BREAK_REQUEST, BREAK_ON ), true );
+    add( makeRequest( GET_LINE_REQUEST_TYPE, GET_LINE_REQUEST, 0 ), true );
+    add( makeRequest( GET_LINE_REQUEST_TYPE, GET_LINE_REQUEST, 0 ), true );
+    CHECK_EQ( count, 8 );
+
+    // A different request type with the same request code is not the same kind
+    add( makeRequest( 0x40, SET_LINE_REQUEST, 0 ), true );
+    CHECK_EQ( count, 9 );
+}
+
+static void testFullAndWrap( void )
+{
+    reset( kControlQueueSize - 3 );
+
+    for ( UInt32 i = 0; i < kControlQueueSize; i++ )
+    {
+        ControlRequest *slot = add( makeRequest( BREAK_REQUEST_TYPE, BREAK_REQUEST, (UInt16)i ), true );
+        CHECK( slot == &requests[(kControlQueueSize - 3 + i) % kControlQueueSize] );
+    }
+    CHECK_EQ( count, kControlQueueSize );
+    CHECK( add( makeRequest( BREAK_REQUEST_TYPE, BREAK_REQUEST, 0 ), true ) == NULL );
+    CHECK_EQ( count, kControlQueueSize );
+
+    // Full, but the tail is a waiting modem line request: it is still replaced
+    reset( 5 );
+    for ( UInt32 i = 0; i < kControlQueueSize - 1; i++ )
+        add( makeRequest( BREAK_REQUEST_TYPE, BREAK_REQUEST, 0 ), true );
+    add( makeRequest( SET_CONTROL_REQUEST_TYPE, SET_CONTROL_REQUEST, 0 ), true );
+    CHECK_EQ( count, kControlQueueSize );
+    CHECK( add( makeRequest( SET_CONTROL_REQUEST_TYPE, SET_CONTROL_REQUEST, CONTROL_RTS ), true ) == &requests[4] );
+    CHECK_EQ( requests[4].Request.wValue, CONTROL_RTS );
+}
+
+int main( void )
+{
+    testModemLinesMerge();
+    testNotBusyTailMerges();
+    testOrderKept();
+    testFullAndWrap();
+
+    return testResult( "test_control" );
+}
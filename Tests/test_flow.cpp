@@ -0,0 +1,220 @@
+/*
+ * test_flow.cpp - DTR/RTS writes while RTS/DTR flow control is switched on
+ * and off under load. A producer fills the RX queue in bursts and a reader
+ * drains it, each move goes through checkRXQueue (queueLevelBits, rxFlowLine)
+ * and changeState; a changed line runs setControlLines, which only sends a
+ * value the chip does not have (controlLineValue, controlLinesChanged). Some
+ * moves overlap the application changing DTR, as changeState runs from the
+ * completion and the client threads at once. Checks the chip always ends up
+ * with the port's lines, one write per change of the lines and flow control
+ * holding RTS low above high water.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+// Stand-ins for the PD_S_RXQ_*, PD_RS232_S_* and PD_RS232_A_* bits
+enum { kRxEmpty = 1, kRxFull = 2, kRxLow = 4, kRxHigh = 8, kDTR = 16, kRFR = 32 };
+enum { kFlowRTS = 1, kFlowDTR = 2 };
+
+#define kRxQueue        4096
+#define kLowWater       1024
+#define kHighWater      3072
+#define kMoves          200000
+
+typedef struct SimPort
+{
+    UInt32      State;
+    UInt32      FlowControl;
+    bool        RTSAsserted;
+    bool        DTRAsserted;
+    UInt8       ControlLines;       // fControlLines
+    bool        ControlLinesValid;
+    UInt8       Chip;               // what the device has
+    UInt32      ControlLineWrites;
+    UInt32      ControlLineSkips;
+    UInt32      QueueChecks;
+    UInt32      QueueUpdates;
+} SimPort;
+
+static void setControlLines( SimPort *port )
+{
+    UInt8 value = controlLineValue( port->State, kDTR, kRFR );
+
+    if ( !controlLinesChanged( value, port->ControlLines, port->ControlLinesValid ) )
+    {
+        port->ControlLineSkips++;
+        return;
+    }
+    port->ControlLines = value;
+    port->ControlLinesValid = true;
+    port->ControlLineWrites++;
+    port->Chip = value;
+}
+
+// changeState up to the point where it calls setControlLines; true if it would
+static bool changeStateBits( SimPort *port, UInt32 state, UInt32 mask )
+{
+    UInt32 old = port->State;
+
+    port->State = (old & ~mask) | (state & mask);
+    return ((port->State ^ old) & (kDTR | kRFR)) != 0;
+}
+
+static void changeState( SimPort *port, UInt32 state, UInt32 mask )
+{
+    if ( changeStateBits( port, state, mask ) )
+        setControlLines( port );
+}
+
+// checkRXQueue without XON/XOFF. With overlap the application changes DTR in
+// between: both threads update the state before either gets to setControlLines.
+static void checkRXQueue( SimPort *port, CirQueue *q, bool force, bool overlap )
+{
+    UInt32  mask = kRxEmpty | kRxFull | kRxLow | kRxHigh;
+    UInt32  bits;
+
+    port->QueueChecks++;
+    bits = queueLevelBits( q->Added - q->Removed, q->Size, kLowWater, kHighWater, kRxEmpty, kRxFull, kRxLow, kRxHigh );
+    if ( !force && bits == (port->State & mask) )
+        return;
+    port->QueueUpdates++;
+
+    rxFlowLine( port->FlowControl & kFlowRTS, bits & kRxLow, bits & kRxHigh, &port->RTSAsserted, kRFR, &bits, &mask );
+    rxFlowLine( port->FlowControl & kFlowDTR, bits & kRxLow, bits & kRxHigh, &port->DTRAsserted, kDTR, &bits, &mask );
+
+    if ( !overlap || (port->FlowControl & kFlowDTR) )
+    {
+        changeState( port, bits, mask );
+        return;
+    }
+
+    bool mine = changeStateBits( port, bits, mask );
+    bool theirs = changeStateBits( port, port->State ^ kDTR, kDTR );
+    if ( mine )
+        setControlLines( port );
+    if ( theirs )
+        setControlLines( port );
+}
+
+// PD_E_FLOW_CONTROL: switching away from a line lowered for flow control raises
+// it, then checkQueues applies the new mode
+static void setFlowControl( SimPort *port, CirQueue *q, UInt32 flow )
+{
+    UInt32 old = port->FlowControl;
+
+    port->FlowControl = flow;
+    if ( (old & kFlowRTS) && !(flow & kFlowRTS) && !port->RTSAsserted )
+    {
+        port->RTSAsserted = true;
+        changeState( port, kRFR, kRFR );
+    }
+    if ( (old & kFlowDTR) && !(flow & kFlowDTR) && !port->DTRAsserted )
+    {
+        port->DTRAsserted = true;
+        changeState( port, kDTR, kDTR );
+    }
+    checkRXQueue( port, q, true, false );
+}
+
+static void testControlLineValue( void )
+{
+    CHECK_EQ( controlLineValue( 0, kDTR, kRFR ), 0 );
+    CHECK_EQ( controlLineValue( kDTR, kDTR, kRFR ), CONTROL_DTR );
+    CHECK_EQ( controlLineValue( kRFR | kRxHigh, kDTR, kRFR ), CONTROL_RTS );
+    CHECK_EQ( controlLineValue( kDTR | kRFR, kDTR, kRFR ), CONTROL_DTR | CONTROL_RTS );
+
+    CHECK( controlLinesChanged( CONTROL_DTR, CONTROL_DTR, false ) );     // after a failed request
+    CHECK( !controlLinesChanged( CONTROL_DTR, CONTROL_DTR, true ) );
+    CHECK( controlLinesChanged( CONTROL_RTS, CONTROL_DTR, true ) );
+}
+
+static void testRxFlowLine( void )
+{
+    bool    asserted = true;
+    UInt32  bits = 0, mask = 0;
+
+    rxFlowLine( false, false, true, &asserted, kRFR, &bits, &mask );
+    CHECK( asserted && !mask );
+    rxFlowLine( true, false, false, &asserted, kRFR, &bits, &mask );
+    CHECK( asserted && !mask );
+    rxFlowLine( true, false, true, &asserted, kRFR, &bits, &mask );
+    CHECK( !asserted && mask == kRFR && !bits );
+    bits = mask = 0;
+    rxFlowLine( true, false, true, &asserted, kRFR, &bits, &mask );     // already low
+    CHECK( !asserted && !mask );
+    rxFlowLine( true, true, false, &asserted, kRFR, &bits, &mask );
+    CHECK( asserted && mask == kRFR && bits == kRFR );
+}
+
+static void testToggleUnderLoad( void )
+{
+    static UInt8    buffer[kRxQueue];
+    static UInt8    chunk[kRxQueue];
+    SimPort         port;
+    CirQueue        q;
+    UInt32          changes = 0;
+    UInt8           lines;
+    bool            chipRight = true, heldBack = true;
+    unsigned        seed = 2303;
+
+    memset( &q, 0, sizeof(q) );
+    q.Start = buffer;
+    q.End = buffer + sizeof(buffer);
+    q.Size = sizeof(buffer);
+    memset( &port, 0, sizeof(port) );
+
+    // Opened with DTR and RTS up, sent once
+    port.State = kDTR | kRFR | kRxEmpty | kRxLow;
+    port.RTSAsserted = port.DTRAsserted = true;
+    port.FlowControl = kFlowRTS;
+    setControlLines( &port );
+    lines = port.Chip;
+    CHECK_EQ( port.ControlLineWrites, 1 );
+
+    for ( int i = 0; i < kMoves; i++ )
+    {
+        UInt32 r = rand_r( &seed );
+
+        // The line bursts in faster than the reader drains, until RTS holds it back
+        if ( r % 3 != 0 )
+        {
+            if ( port.State & kRFR )
+                copyintoQueue( &q, chunk, 1 + r % 256 );
+        }
+        else
+            copyfromQueue( &q, chunk, 1 + r % 512 );
+
+        checkRXQueue( &port, &q, false, r % 16 == 0 );
+
+        // The application switches flow control now and then
+        if ( r % 997 == 0 )
+            setFlowControl( &port, &q, port.FlowControl ^ ((r >> 10) % 2 ? kFlowRTS : kFlowDTR) );
+
+        UInt8 now = controlLineValue( port.State, kDTR, kRFR );
+        if ( now != lines )
+            changes++;
+        lines = now;
+
+        if ( port.Chip != now )
+            chipRight = false;
+        if ( (port.FlowControl & kFlowRTS) && (port.State & kRxHigh) && (port.State & kRFR) )
+            heldBack = false;
+    }
+
+    CHECK( chipRight );
+    CHECK( heldBack );
+    CHECK_EQ( port.ControlLineWrites, changes + 1 );
+    CHECK( port.ControlLineSkips > 0 );
+    CHECK( changes > 100 );
+    CHECK( port.QueueUpdates < port.QueueChecks / 4 );
+}
+
+int main( void )
+{
+    testControlLineValue();
+    testRxFlowLine();
+    testToggleUnderLoad();
+
+    return testResult( "test_flow" );
+}
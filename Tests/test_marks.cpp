@@ -0,0 +1,113 @@
+/*
+ * test_marks.cpp - default water marks and the rule they must keep.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+static void testValidWaterMarks( void )
+{
+    // event <= low, low + event <= high, high + event <= size
+    CHECK( validWaterMarks( 4096, 1024, 2048, 1024 ) );
+    CHECK( validWaterMarks( 4096, 1024, 3072, 1024 ) );
+    CHECK( !validWaterMarks( 4096, 1023, 3072, 1024 ) );
+    CHECK( !validWaterMarks( 4096, 1024, 2047, 1024 ) );
+    CHECK( !validWaterMarks( 4096, 1024, 3073, 1024 ) );
+    CHECK( !validWaterMarks( 4096, 2048, 1024, 64 ) );
+    CHECK( validWaterMarks( 4096, 0, 0, 0 ) );
+}
+
+static void testRXMarks( void )
+{
+    size_t  low, high;
+
+    // High water leaves room for the latency and every read in flight
+    defaultWaterMarks( true, 65536, 1024, 9600, 4 * 1024, &low, &high );
+    CHECK_EQ( high, 65536 - (9600 + 4 * 1024) );
+    CHECK_EQ( low, high >> 1 );
+
+    // Not room for that: 2/3 and 1/3
+    defaultWaterMarks( true, 4096, 1024, 15, 4 * 1024, &low, &high );
+    CHECK_EQ( high, (4096 << 1) / 3 );
+    CHECK_EQ( low, high >> 1 );
+
+    // Every rate and read-ahead: with the default RX size the marks keep the
+    // rule and leave room for everything in flight
+    for ( UInt32 rate = 75; rate <= 6000000; rate += rate / 5 + 1 )
+    {
+        for ( size_t readSize = 64; readSize <= 64 * 512; readSize <<= 1 )
+        {
+            for ( size_t readAhead = 1; readAhead <= 8; readAhead++ )
+            {
+                size_t latency = bytesInTime( rate, kFlowControlLatencyMS );
+                size_t inFlight = readAhead * readSize;
+                size_t size = defaultRXQueueSize( rate, readSize, inFlight );
+
+                CHECK( (size & (size - 1)) == 0 );
+                CHECK( size >= defaultQueueSize( rate ) && size <= kMaxCirBufferSize );
+                defaultWaterMarks( true, size, readSize, latency, inFlight, &low, &high );
+                CHECK( validWaterMarks( size, low, high, readSize ) );
+                if ( size < kMaxCirBufferSize )
+                {
+                    CHECK_EQ( high, size - (latency + inFlight) );
+                    CHECK( high >= size / 2 );
+                }
+            }
+        }
+    }
+}
+
+static void testRXQueueSize( void )
+{
+    // 9600 bps with four 1 KB reads: 8 KB would leave under half, so 16 KB
+    CHECK_EQ( defaultQueueSize( 9600 ), kMinCirBufferSize );
+    CHECK_EQ( defaultRXQueueSize( 9600, 1024, 4 * 1024 ), 16384 );
+
+    // One read of 2 KB at 75 bps: 4 KB leaves half, but low water would be under one read
+    CHECK_EQ( defaultRXQueueSize( 75, 2048, 2048 ), 8192 );
+    CHECK_EQ( defaultRXQueueSize( 9600, 2048, 2048 ), 8192 );
+
+    // Little in flight: the plain default
+    CHECK_EQ( defaultRXQueueSize( 9600, 64, 64 ), kMinCirBufferSize );
+    CHECK_EQ( defaultRXQueueSize( 921600, 64, 64 ), defaultQueueSize( 921600 ) );
+
+    // Never more than kMaxCirBufferSize
+    CHECK_EQ( defaultRXQueueSize( 6000000, 64 * 512, 8 * 64 * 512 ), kMaxCirBufferSize );
+}
+
+static void testTXMarks( void )
+{
+    size_t  low, high;
+
+    // Writers woken while the latency and a write batch are still queued
+    defaultWaterMarks( false, 65536, 64, 20000, 4096, &low, &high );
+    CHECK_EQ( high, (65536 << 1) / 3 );
+    CHECK_EQ( low, 20000 + 4096 );
+
+    // But never below half of high
+    defaultWaterMarks( false, 65536, 64, 15, 4096, &low, &high );
+    CHECK_EQ( low, high >> 1 );
+
+    // Does not fit: 2/3 and 1/3
+    defaultWaterMarks( false, 4096, 64, 9600, 4096, &low, &high );
+    CHECK_EQ( high, (4096 << 1) / 3 );
+    CHECK_EQ( low, high >> 1 );
+
+    for ( UInt32 rate = 75; rate <= 6000000; rate += rate / 5 + 1 )
+    {
+        size_t size = defaultQueueSize( rate );
+
+        defaultWaterMarks( false, size, 64, bytesInTime( rate, kFlowControlLatencyMS ), 4096, &low, &high );
+        CHECK( validWaterMarks( size, low, high, 64 ) );
+    }
+}
+
+int main( void )
+{
+    testValidWaterMarks();
+    testRXMarks();
+    testRXQueueSize();
+    testTXMarks();
+
+    return testResult( "test_marks" );
+}
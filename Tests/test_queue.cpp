@@ -0,0 +1,160 @@
+/*
+ * test_queue.cpp - CirQueue span copies (copyintoQueue / copyfromQueue).
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+
+static void setupQueue( CirQueue *Queue, UInt8 *Buffer, size_t Size )
+{
+    memset( Queue, 0, sizeof(*Queue) );
+    Queue->Start = Buffer;
+    Queue->End = Buffer + Size;
+    Queue->Size = Size;
+}
+
+static void testEmptyAndFull( void )
+{
+    UInt8       buffer[16];
+    UInt8       data[32];
+    UInt8       out[32];
+    CirQueue    q;
+
+    setupQueue( &q, buffer, sizeof(buffer) );
+    for ( size_t i = 0; i < sizeof(data); i++ )
+        data[i] = (UInt8)i;
+
+    CHECK_EQ( copyfromQueue( &q, out, sizeof(out) ), 0 );
+    CHECK_EQ( copyintoQueue( &q, data, 0 ), 0 );
+
+    // More than fits: only the free space is taken
+    CHECK_EQ( copyintoQueue( &q, data, sizeof(data) ), 16 );
+    CHECK_EQ( copyintoQueue( &q, data, 1 ), 0 );
+    CHECK_EQ( q.Added - q.Removed, 16 );
+
+    CHECK_EQ( copyfromQueue( &q, out, sizeof(out) ), 16 );
+    CHECK( memcmp( out, data, 16 ) == 0 );
+    CHECK_EQ( copyfromQueue( &q, out, sizeof(out) ), 0 );
+}
+
+static void testWrap( void )
+{
+    UInt8       buffer[10];
+    UInt8       data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    UInt8       out[8];
+    CirQueue    q;
+
+    setupQueue( &q, buffer, sizeof(buffer) );
+
+    // Move the indexes to 7 so the next copies straddle the end of the ring
+    CHECK_EQ( copyintoQueue( &q, data, 7 ), 7 );
+    CHECK_EQ( copyfromQueue( &q, out, 7 ), 7 );
+
+    CHECK_EQ( copyintoQueue( &q, data, 8 ), 8 );
+    CHECK( memcmp( buffer + 7, data, 3 ) == 0 );
+    CHECK( memcmp( buffer, data + 3, 5 ) == 0 );
+
+    memset( out, 0, sizeof(out) );
+    CHECK_EQ( copyfromQueue( &q, out, 8 ), 8 );
+    CHECK( memcmp( out, data, 8 ) == 0 );
+    CHECK_EQ( q.Added, 15 );
+    CHECK_EQ( q.Removed, 15 );
+}
+
+// Random sized copies on both sides against a straight byte counter
+static void testRandomSpans( void )
+{
+    UInt8       buffer[97];
+    UInt8       chunk[256];
+    CirQueue    q;
+    UInt8       next = 0;
+    UInt8       expect = 0;
+
+    setupQueue( &q, buffer, sizeof(buffer) );
+    srand( 2303 );
+
+    for ( int round = 0; round < 100000; round++ )
+    {
+        size_t want = rand() % sizeof(chunk);
+        size_t room = q.Size - (q.Added - q.Removed);
+        for ( size_t i = 0; i < want; i++ )
+            chunk[i] = (UInt8)(next + i);
+        size_t added = copyintoQueue( &q, chunk, want );
+        CHECK_EQ( added, want < room ? want : room );
+        next += (UInt8)added;
+
+        size_t used = q.Added - q.Removed;
+        want = rand() % sizeof(chunk);
+        size_t removed = copyfromQueue( &q, chunk, want );
+        CHECK_EQ( removed, want < used ? want : used );
+        for ( size_t i = 0; i < removed; i++ )
+        {
+            if ( chunk[i] != expect )
+            {
+                CHECK_EQ( chunk[i], expect );
+                return;
+            }
+            expect++;
+        }
+    }
+}
+
+// One producer and one consumer thread, as the RX completion and the reader
+#define kThreadBytes    (16u << 20)
+
+static CirQueue     threadQueue;
+static UInt8        threadBuffer[4096];
+
+static void *producer( void * )
+{
+    UInt8   chunk[300];
+    size_t  sent = 0;
+
+    while ( sent < kThreadBytes )
+    {
+        size_t want = 1 + (sent % sizeof(chunk));
+        if ( want > kThreadBytes - sent )
+            want = kThreadBytes - sent;
+        for ( size_t i = 0; i < want; i++ )
+            chunk[i] = (UInt8)((sent + i) * 7);
+        sent += copyintoQueue( &threadQueue, chunk, want );
+    }
+    return NULL;
+}
+
+static void testThreads( void )
+{
+    pthread_t   thread;
+    UInt8       chunk[500];
+    size_t      received = 0;
+    bool        ordered = true;
+
+    setupQueue( &threadQueue, threadBuffer, sizeof(threadBuffer) );
+    pthread_create( &thread, NULL, producer, NULL );
+
+    while ( received < kThreadBytes )
+    {
+        size_t got = copyfromQueue( &threadQueue, chunk, 1 + (received % sizeof(chunk)) );
+        for ( size_t i = 0; i < got; i++ )
+            if ( chunk[i] != (UInt8)((received + i) * 7) )
+                ordered = false;
+        received += got;
+    }
+
+    pthread_join( thread, NULL );
+    CHECK( ordered );
+    CHECK_EQ( received, kThreadBytes );
+    CHECK_EQ( threadQueue.Added, threadQueue.Removed );
+}
+
+int main( void )
+{
+    testEmptyAndFull();
+    testWrap();
+    testRandomSpans();
+    testThreads();
+
+    return testResult( "test_queue" );
+}
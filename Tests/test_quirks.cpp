@@ -0,0 +1,42 @@
+/*
+ * test_quirks.cpp - the device quirk table.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+static void testDeviceQuirks( void )
+{
+    // The Siemens X65 has the one byte status, whatever its revision
+    CHECK_EQ( deviceQuirks( SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65, PROLIFIC_REV_HX_CHIP_D ), kQuirkShortStatus );
+    CHECK_EQ( deviceQuirks( SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65, PROLIFIC_REV_1 ), kQuirkShortStatus );
+    CHECK_EQ( deviceQuirks( SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65, 0 ), kQuirkShortStatus );
+
+    // Nothing else does
+    CHECK_EQ( deviceQuirks( SIEMENS_VENDOR_ID, SIEMENS_PRODUCT_ID_X65 + 1, PROLIFIC_REV_HX_CHIP_D ), 0 );
+    CHECK_EQ( deviceQuirks( SIEMENS_VENDOR_ID + 1, SIEMENS_PRODUCT_ID_X65, PROLIFIC_REV_HX_CHIP_D ), 0 );
+    CHECK_EQ( deviceQuirks( 0x067b, 0x2303, PROLIFIC_REV_H ), 0 );
+    CHECK_EQ( deviceQuirks( 0x067b, 0x2303, PROLIFIC_REV_X ), 0 );
+
+    // kQuirkAnyID is a wildcard in the table only, not in the device ids
+    CHECK( quirkIDMatches( kQuirkAnyID, 0x1234 ) );
+    CHECK( quirkIDMatches( 0x1234, 0x1234 ) );
+    CHECK( !quirkIDMatches( 0x1234, kQuirkAnyID ) );
+    CHECK( !quirkIDMatches( 0x1234, 0x1235 ) );
+
+    // Every entry matches its own ids
+    for ( UInt32 i = 0; i < kDeviceQuirkCount; i++ )
+    {
+        const DeviceQuirk *q = &kDeviceQuirks[i];
+
+        CHECK( q->Flags != 0 );
+        CHECK_EQ( deviceQuirks( q->VendorID, q->ProductID, q->Release ) & q->Flags, q->Flags );
+    }
+}
+
+int main( void )
+{
+    testDeviceQuirks();
+
+    return testResult( "test_quirks" );
+}
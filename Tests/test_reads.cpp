@@ -0,0 +1,260 @@
+/*
+ * test_reads.cpp - bulk-in read ordering (nextReadDone) and a mock pipe
+ * that completes reads out of order, with random delays and errors, to
+ * check dataReadComplete's delivery: in order, nothing twice, and the
+ * pipe never starves because a failed read was not submitted again.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { kReadOK, kReadError, kReadAborted };
+
+typedef struct MockRead
+{
+    UInt32      Seq;        // which block of the stream the bus put in it
+    int         Status;
+    bool        Pending;
+    bool        Done;
+} MockRead;
+
+static void testOrder( void )
+{
+    MockRead    reads[4];
+    UInt32      head = 0;
+
+    memset( reads, 0, sizeof(reads) );
+    for ( int i = 0; i < 4; i++ )
+        reads[i].Pending = true;
+
+    // The second one back first waits for the first
+    reads[1].Pending = false;
+    reads[1].Done = true;
+    CHECK( nextReadDone( reads, 4, &head ) == NULL );
+    CHECK_EQ( head, 0 );
+
+    reads[0].Pending = false;
+    reads[0].Done = true;
+    CHECK( nextReadDone( reads, 4, &head ) == &reads[0] );
+    CHECK( nextReadDone( reads, 4, &head ) == &reads[1] );
+    CHECK( nextReadDone( reads, 4, &head ) == NULL );
+    CHECK_EQ( head, 2 );
+    CHECK( !reads[0].Done && !reads[1].Done );
+
+    // One that could not be submitted again is skipped
+    reads[2].Pending = false;
+    reads[3].Pending = false;
+    reads[3].Done = true;
+    reads[0].Pending = true;
+    CHECK( nextReadDone( reads, 4, &head ) == &reads[3] );
+    CHECK_EQ( head, 0 );
+    CHECK( nextReadDone( reads, 4, &head ) == NULL );
+
+    // Nothing on the bus and nothing back: stops after one lap
+    reads[0].Pending = false;
+    reads[1].Pending = false;
+    CHECK( nextReadDone( reads, 4, &head ) == NULL );
+}
+
+// The mock pipe. The bus fills submitted reads in submission order, the
+// completion threads report them in any order after a random delay.
+#define kMockReads      8
+#define kMockBlocks     20000
+#define kMockCompleters 3
+
+static pthread_mutex_t  pipeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  rxLock = PTHREAD_MUTEX_INITIALIZER;
+
+static MockRead     reads[kMockReads];
+static MockRead     *submitted[kMockReads];     // FIFO, waiting for the bus
+static UInt32       submittedCount;
+static MockRead     *filled[kMockReads];        // back from the bus, not yet reported
+static UInt32       filledCount;
+static UInt32       outstanding;                // submitted and not yet reported
+static UInt32       nextSeq;
+static bool         aborting;
+static bool         stopping;
+
+static UInt32       readHead;
+static bool         delivering;
+static UInt32       lastSeq;
+static UInt32       delivered;
+static UInt32       completedOK;
+static bool         ordered = true;
+
+static void submitRead( MockRead *request )
+{
+    pthread_mutex_lock( &rxLock );
+    request->Pending = true;
+    request->Done = false;
+    pthread_mutex_unlock( &rxLock );
+
+    pthread_mutex_lock( &pipeLock );
+    submitted[submittedCount++] = request;
+    outstanding++;
+    pthread_mutex_unlock( &pipeLock );
+}
+
+// dataReadComplete without the queue
+static void readComplete( MockRead *request, int status )
+{
+    pthread_mutex_lock( &rxLock );
+    request->Pending = false;
+    request->Done = true;
+    request->Status = status;
+    if ( status == kReadOK )
+        completedOK++;
+    if ( delivering )
+    {
+        pthread_mutex_unlock( &rxLock );
+        return;
+    }
+    delivering = true;
+
+    while ( (request = nextReadDone( reads, kMockReads, &readHead )) )
+    {
+        if ( request->Status == kReadOK )
+        {
+            if ( delivered && request->Seq <= lastSeq )
+                ordered = false;
+            lastSeq = request->Seq;
+            delivered++;
+        }
+        pthread_mutex_unlock( &rxLock );
+
+        if ( request->Status != kReadAborted )
+            submitRead( request );
+
+        pthread_mutex_lock( &rxLock );
+    }
+
+    delivering = false;
+    pthread_mutex_unlock( &rxLock );
+}
+
+static void *bus( void * )
+{
+    for (;;)
+    {
+        pthread_mutex_lock( &pipeLock );
+        if ( stopping && !outstanding )
+        {
+            pthread_mutex_unlock( &pipeLock );
+            return NULL;
+        }
+        if ( submittedCount )
+        {
+            MockRead *request = submitted[0];
+            memmove( submitted, submitted + 1, --submittedCount * sizeof(submitted[0]) );
+            request->Seq = nextSeq++;
+            request->Status = aborting ? kReadAborted : (rand() % 32 == 0) ? kReadError : kReadOK;
+            filled[filledCount++] = request;
+        }
+        pthread_mutex_unlock( &pipeLock );
+        sched_yield();
+    }
+}
+
+static void *completer( void *arg )
+{
+    unsigned    seed = (unsigned)(uintptr_t)arg;
+
+    for (;;)
+    {
+        MockRead    *request = NULL;
+        int         status = kReadOK;
+
+        pthread_mutex_lock( &pipeLock );
+        if ( stopping && !outstanding )
+        {
+            pthread_mutex_unlock( &pipeLock );
+            return NULL;
+        }
+        if ( filledCount )
+        {
+            UInt32 pick = rand_r( &seed ) % filledCount;
+            request = filled[pick];
+            status = request->Status;
+            filled[pick] = filled[--filledCount];
+        }
+        pthread_mutex_unlock( &pipeLock );
+
+        if ( !request )
+        {
+            sched_yield();
+            continue;
+        }
+        if ( rand_r( &seed ) % 4 == 0 )
+            usleep( rand_r( &seed ) % 50 );
+        readComplete( request, status );
+
+        pthread_mutex_lock( &pipeLock );
+        outstanding--;
+        pthread_mutex_unlock( &pipeLock );
+    }
+}
+
+static UInt32 deliveredNow( void )
+{
+    UInt32  count;
+
+    pthread_mutex_lock( &rxLock );
+    count = delivered;
+    pthread_mutex_unlock( &rxLock );
+    return count;
+}
+
+static void testMockPipe( void )
+{
+    pthread_t   busThread;
+    pthread_t   completers[kMockCompleters];
+    UInt32      count, last = 0;
+    int         stalled = 0;
+
+    srand( 2303 );
+    for ( int i = 0; i < kMockReads; i++ )
+        submitRead( &reads[i] );
+    pthread_create( &busThread, NULL, bus, NULL );
+    for ( int i = 0; i < kMockCompleters; i++ )
+        pthread_create( &completers[i], NULL, completer, (void *)(uintptr_t)(i + 1) );
+
+    // Reads keep flowing through the errors; 2 s without progress is a stall
+    while ( (count = deliveredNow()) < kMockBlocks && stalled < 200 )
+    {
+        stalled = (count == last) ? stalled + 1 : 0;
+        last = count;
+        usleep( 10000 );
+    }
+    CHECK( count >= kMockBlocks );
+
+    // An abort ends every read and none is submitted again
+    pthread_mutex_lock( &pipeLock );
+    aborting = true;
+    stopping = true;
+    pthread_mutex_unlock( &pipeLock );
+    pthread_join( busThread, NULL );
+    for ( int i = 0; i < kMockCompleters; i++ )
+        pthread_join( completers[i], NULL );
+
+    CHECK( ordered );
+    CHECK_EQ( delivered, completedOK );
+    CHECK( !delivering );
+    for ( int i = 0; i < kMockReads; i++ )
+    {
+        CHECK( !reads[i].Pending );
+        CHECK( !reads[i].Done );
+    }
+}
+
+int main( void )
+{
+    testOrder();
+    testMockPipe();
+
+    return testResult( "test_reads" );
+}
@@ -0,0 +1,145 @@
+/*
+ * test_sizing.cpp - queue sizes and timeouts derived from the baud rate,
+ * and a paced RX stream with flow control through the default queue.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+static void testBytesInTime( void )
+{
+    CHECK_EQ( bytesInTime( 9600, 1000 ), 960 );
+    CHECK_EQ( bytesInTime( 9600, 100 ), 96 );
+    CHECK_EQ( bytesInTime( 6000000, 16 ), 9600 );
+    CHECK_EQ( bytesInTime( 75, 10 ), 0 );
+}
+
+static void testDefaultQueueSize( void )
+{
+    // Slow rates get the minimum
+    CHECK_EQ( defaultQueueSize( 75 ), kMinCirBufferSize );
+    CHECK_EQ( defaultQueueSize( 9600 ), kMinCirBufferSize );
+    CHECK_EQ( defaultQueueSize( 115200 ), kMinCirBufferSize );
+
+    // kCirBufferTimeMS worth of data, rounded up to a power of two
+    CHECK_EQ( defaultQueueSize( 460800 ), 8192 );
+    CHECK_EQ( defaultQueueSize( 921600 ), 16384 );
+    CHECK_EQ( defaultQueueSize( 6000000 ), 65536 );
+
+    // Never more than kMaxCirBufferSize
+    CHECK_EQ( defaultQueueSize( 12000000 ), kMaxCirBufferSize );
+    CHECK_EQ( defaultQueueSize( 0xffffffff ), kMaxCirBufferSize );
+
+    for ( UInt32 rate = 75; rate <= 12000000; rate += rate / 7 + 1 )
+    {
+        size_t size = defaultQueueSize( rate );
+
+        CHECK( (size & (size - 1)) == 0 );
+        CHECK( size >= kMinCirBufferSize && size <= kMaxCirBufferSize );
+        CHECK( size >= bytesInTime( rate, kCirBufferTimeMS ) || size == kMaxCirBufferSize );
+    }
+}
+
+static void testWriteTimeout( void )
+{
+    // A 4 KB batch takes about 4.3 s at 9600 and 137 s at 300 bps
+    CHECK_EQ( writeTimeoutMS( 4096, 9600 ), 2 * 4267 + kWriteTimeoutSlackMS );
+    CHECK_EQ( writeTimeoutMS( 4096, 300 ), 2 * 136534 + kWriteTimeoutSlackMS );
+    CHECK_EQ( writeTimeoutMS( 4096, 6000000 ), 2 * 7 + kWriteTimeoutSlackMS );
+    CHECK_EQ( writeTimeoutMS( 0, 9600 ), kWriteTimeoutSlackMS );
+    CHECK_EQ( writeTimeoutMS( 64, 0 ), kWriteTimeoutSlackMS );
+
+    // Always more than the line needs, at every rate and batch size
+    for ( UInt32 rate = 75; rate <= 12000000; rate += rate / 5 + 1 )
+        for ( UInt32 count = 1; count <= 4096; count <<= 1 )
+            CHECK( (UInt64)writeTimeoutMS( count, rate ) * rate >= (UInt64)count * 10 * 1000 );
+}
+
+// 3 Mbaud into the default RX queue with a reader far slower than the line,
+// in 1 ms steps. The host drops RTS at the high water mark and raises it at
+// the low one; the device only sees a change kFlowControlLatencyMS later,
+// and the bulk-in reads land ReadAhead at a time. Nothing may be dropped.
+#define kPacedRate          3000000
+#define kPacedReadSize      1024        // kDefaultReadPackets * kDefaultMaxPacketSize
+#define kPacedReadAhead     4           // kDefaultReadAhead
+#define kPacedMS            20000
+
+static void testPacedNoLoss( void )
+{
+    size_t      size = defaultRXQueueSize( kPacedRate, kPacedReadSize, kPacedReadAhead * kPacedReadSize );
+    size_t      perMS = bytesInTime( kPacedRate, 1 );
+    size_t      low, high;
+    UInt8       *buffer = (UInt8 *)malloc( size );
+    UInt8       chunk[kPacedReadAhead * kPacedReadSize];
+    CirQueue    q;
+    bool        rts[kFlowControlLatencyMS];     // what the host asked for, the device sees the oldest
+    bool        flowOff = false;
+    size_t      pending = 0;                    // received by the chip, not yet delivered
+    size_t      sent = 0, received = 0, dropped = 0, peak = 0;
+    UInt8       expect = 0;
+    bool        ordered = true;
+
+    defaultWaterMarks( true, size, kPacedReadSize, bytesInTime( kPacedRate, kFlowControlLatencyMS ),
+                       kPacedReadAhead * kPacedReadSize, &low, &high );
+    CHECK( validWaterMarks( size, low, high, kPacedReadSize ) );
+
+    memset( &q, 0, sizeof(q) );
+    q.Start = buffer;
+    q.End = buffer + size;
+    q.Size = size;
+    for ( int i = 0; i < kFlowControlLatencyMS; i++ )
+        rts[i] = true;
+
+    for ( int ms = 0; ms < kPacedMS; ms++ )
+    {
+        // The device sends while the RTS it sees is up, the last partial transfer ends short
+        bool deviceSends = rts[ms % kFlowControlLatencyMS];
+        if ( deviceSends )
+            pending += perMS;
+        if ( pending >= sizeof(chunk) || (!deviceSends && pending) )
+        {
+            size_t n = pending < sizeof(chunk) ? pending : sizeof(chunk);
+            for ( size_t i = 0; i < n; i++ )
+                chunk[i] = (UInt8)(sent + i);
+            size_t queued = copyintoQueue( &q, chunk, n );
+            dropped += n - queued;
+            sent += n;
+            pending -= n;
+        }
+
+        size_t used = q.Added - q.Removed;
+        if ( used > peak )
+            peak = used;
+        if ( used >= high )
+            flowOff = true;
+        else if ( used <= low )
+            flowOff = false;
+        rts[ms % kFlowControlLatencyMS] = !flowOff;
+
+        // A tenth of the line rate, and now and then nothing for 200 ms
+        if ( (ms / 1000) % 3 == 2 && (ms % 1000) < 200 )
+            continue;
+        size_t got = copyfromQueue( &q, chunk, perMS / 10 );
+        for ( size_t i = 0; i < got; i++ )
+            if ( chunk[i] != expect++ )
+                ordered = false;
+        received += got;
+    }
+
+    CHECK_EQ( dropped, 0 );
+    CHECK( ordered );
+    CHECK( peak <= size );
+    CHECK( peak >= high );                      // flow control was really exercised
+    CHECK_EQ( received + (q.Added - q.Removed), sent );
+    free( buffer );
+}
+
+int main( void )
+{
+    testBytesInTime();
+    testDefaultQueueSize();
+    testWriteTimeout();
+    testPacedNoLoss();
+
+    return testResult( "test_sizing" );
+}
@@ -0,0 +1,228 @@
+/*
+ * test_waiters.cpp - the state waiter list (addStateWaiter, stateWaiterDue,
+ * stateWaiterSleep) and the spurious wakeups it saves. A reader, a writer
+ * and a modem watcher wait on one port, each for its own bit, while another
+ * thread keeps changing bits, some that nobody waits for. The threads run
+ * privateWatchState's loop; a mutex stands in for the command gate, the
+ * sleeps for commandSleep. Against the old scheme, one wakeup on the state
+ * word for all of them, wakeups with nothing found are counted as the driver
+ * counts SpuriousWakeups.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+// Stand-ins for PD_S_ACTIVE, PD_S_RXQ_EMPTY, PD_S_TXQ_FULL, PD_RS232_S_CTS and bits nobody watches
+enum { kActive = 1, kRxEmpty = 2, kTxFull = 4, kCTS = 8, kRxLow = 16, kTxLow = 32 };
+
+#define kWatchers       3
+#define kChanges        20000
+
+typedef struct TestWaiter
+{
+    StateWaiter     Waiter;         // first, the list holds these
+    pthread_cond_t  Asleep;         // what commandSleep( &waiter ) sleeps on
+} TestWaiter;
+
+typedef struct TestPort
+{
+    pthread_mutex_t Gate;
+    pthread_mutex_t Lock;           // serialRequestLock
+    pthread_cond_t  StateEvent;     // the old commandWakeup( &port->State )
+    UInt32          State;
+    StateWaiter     *Waiters;
+    bool            Targeted;
+    UInt32          WatchStateMask; // the old scheme: every waiter's mask together
+    UInt32          Wakeups;
+    UInt32          SpuriousWakeups;
+    UInt32          Found;
+} TestPort;
+
+typedef struct Watch
+{
+    TestPort        *Port;
+    UInt32          Bit;
+} Watch;
+
+// changeState, in the gate
+static void changeState( TestPort *port, UInt32 state, UInt32 mask )
+{
+    UInt32 old = port->State;
+
+    port->State = (old & ~mask) | (state & mask);
+    UInt32 delta = port->State ^ old;
+    if ( !delta )
+        return;
+
+    pthread_mutex_lock( &port->Lock );
+    if ( port->Targeted )
+    {
+        for ( StateWaiter *waiter = port->Waiters; waiter; waiter = waiter->Next )
+            if ( stateWaiterDue( waiter, delta ) )
+                pthread_cond_signal( &((TestWaiter *)waiter)->Asleep );
+    }
+    else if ( delta & port->WatchStateMask )
+        pthread_cond_broadcast( &port->StateEvent );
+    pthread_mutex_unlock( &port->Lock );
+}
+
+// privateWatchState for the bit to differ from what it is now, in the gate
+static bool watchState( TestPort *port, UInt32 bit )
+{
+    TestWaiter  waiter;
+    UInt32      watch = ~port->State & bit;     // wait for the other value, or inactive
+    UInt32      mask = bit | kActive;
+    bool        woken = false, found;
+
+    pthread_cond_init( &waiter.Asleep, NULL );
+    pthread_mutex_lock( &port->Lock );
+    addStateWaiter( &port->Waiters, &waiter.Waiter, mask );
+    port->WatchStateMask |= mask;
+    pthread_mutex_unlock( &port->Lock );
+
+    for (;;)
+    {
+        UInt32 current = port->State;
+        UInt32 foundStates = stateFound( watch, current, mask );
+        if ( foundStates )
+        {
+            found = !(foundStates & kActive);
+            break;
+        }
+
+        pthread_mutex_lock( &port->Lock );
+        if ( woken )
+            port->SpuriousWakeups++;
+        woken = !stateWaiterSleep( &waiter.Waiter );
+        pthread_mutex_unlock( &port->Lock );
+        if ( woken )
+        {
+            woken = false;
+            continue;
+        }
+
+        pthread_cond_wait( port->Targeted ? &waiter.Asleep : &port->StateEvent, &port->Gate );
+        woken = true;
+
+        pthread_mutex_lock( &port->Lock );
+        port->Wakeups++;
+        stateWaiterAwake( &waiter.Waiter );
+        pthread_mutex_unlock( &port->Lock );
+    }
+
+    pthread_mutex_lock( &port->Lock );
+    removeStateWaiter( &port->Waiters, &waiter.Waiter );
+    port->Found += found;
+    pthread_mutex_unlock( &port->Lock );
+    pthread_cond_destroy( &waiter.Asleep );
+    return found;
+}
+
+static void *watcher( void *arg )
+{
+    Watch   *watch = (Watch *)arg;
+
+    pthread_mutex_lock( &watch->Port->Gate );
+    while ( watchState( watch->Port, watch->Bit ) )
+        ;
+    pthread_mutex_unlock( &watch->Port->Gate );
+    return NULL;
+}
+
+static void run( TestPort *port, bool targeted )
+{
+    static const UInt32 bits[] = { kRxEmpty, kTxFull, kCTS, kRxLow, kTxLow, kRxLow, kTxLow };
+    pthread_t   threads[kWatchers];
+    Watch       watches[kWatchers] = { { port, kRxEmpty }, { port, kTxFull }, { port, kCTS } };
+    unsigned    seed = 2303;
+
+    memset( port, 0, sizeof(*port) );
+    pthread_mutex_init( &port->Gate, NULL );
+    pthread_mutex_init( &port->Lock, NULL );
+    pthread_cond_init( &port->StateEvent, NULL );
+    port->State = kActive | kRxEmpty;
+    port->Targeted = targeted;
+
+    for ( int i = 0; i < kWatchers; i++ )
+        pthread_create( &threads[i], NULL, watcher, &watches[i] );
+
+    // Queue and modem bits come and go, the queue water marks most often
+    for ( int i = 0; i < kChanges; i++ )
+    {
+        UInt32 bit = bits[rand_r( &seed ) % (sizeof(bits) / sizeof(bits[0]))];
+        pthread_mutex_lock( &port->Gate );
+        changeState( port, port->State ^ bit, bit );
+        pthread_mutex_unlock( &port->Gate );
+        sched_yield();
+    }
+
+    pthread_mutex_lock( &port->Gate );
+    changeState( port, 0, kActive );
+    pthread_mutex_unlock( &port->Gate );
+    for ( int i = 0; i < kWatchers; i++ )
+        pthread_join( threads[i], NULL );
+
+    CHECK( port->Waiters == NULL );
+    CHECK( port->Found > 0 );
+    pthread_cond_destroy( &port->StateEvent );
+    pthread_mutex_destroy( &port->Lock );
+    pthread_mutex_destroy( &port->Gate );
+}
+
+static void testList( void )
+{
+    StateWaiter *list = NULL;
+    StateWaiter a, b;
+
+    addStateWaiter( &list, &a, kRxEmpty );
+    addStateWaiter( &list, &b, kCTS );
+
+    // Not asleep yet: marked, the check before sleeping sees it
+    CHECK( !stateWaiterDue( &a, kRxEmpty ) );
+    CHECK( a.Woken && !b.Woken );
+    CHECK( !stateWaiterSleep( &a ) );
+    CHECK( !a.Woken && !a.Sleeping );
+
+    // Asleep: due only for its own bits
+    CHECK( stateWaiterSleep( &a ) );
+    CHECK( stateWaiterSleep( &b ) );
+    CHECK( !stateWaiterDue( &a, kCTS | kTxFull ) );
+    CHECK( stateWaiterDue( &b, kCTS | kTxFull ) );
+    CHECK( stateWaiterDue( &b, 0 ) );           // repeated from the gate until it is up
+    stateWaiterAwake( &b );
+    CHECK( !stateWaiterDue( &b, 0 ) );
+
+    CHECK_EQ( stateFound( kCTS, kCTS | kActive, kCTS ), kCTS );
+    CHECK_EQ( stateFound( 0, kCTS | kActive, kCTS | kActive ), 0 );
+    CHECK_EQ( stateFound( 0, kCTS, kCTS | kActive ), kActive );
+
+    removeStateWaiter( &list, &a );
+    CHECK( list == &b && !b.Next );
+    removeStateWaiter( &list, &a );
+    removeStateWaiter( &list, &b );
+    CHECK( list == NULL );
+}
+
+static void testSpurious( void )
+{
+    static TestPort broadcast, targeted;
+
+    run( &broadcast, false );
+    run( &targeted, true );
+
+    // Every change of a watched bit woke all three; now only the one it is for
+    CHECK( broadcast.SpuriousWakeups > broadcast.Wakeups / 2 );
+    CHECK( targeted.SpuriousWakeups * 10 < broadcast.SpuriousWakeups );
+    CHECK( targeted.Wakeups < broadcast.Wakeups );
+}
+
+int main( void )
+{
+    testList();
+    testSpurious();
+
+    return testResult( "test_waiters" );
+}
@@ -0,0 +1,183 @@
+/*
+ * test_writes.cpp - the bulk-out pipeline against a simulated device with
+ * a configurable USB latency. Up to WriteBuffers transfers are in flight,
+ * each filled straight from the TX queue as setUpTransmit does; the device
+ * takes a transfer latency microseconds after it was submitted and sends
+ * it at the line rate. Checks the data order, TX busy and the TXQ bits at
+ * every completion, and that a second buffer hides the latency. Also the
+ * write combining hold.
+ */
+
+#include "host.h"
+#include "Driver_PL2303_Util.h"
+
+#define kWriteRate      921600
+#define kWriteBatch     512
+#define kWriteQueue     16384
+#define kWriteBytes     (2u << 20)
+#define kMaxBuffers     4
+
+// Stand-ins for the PD_S_TXQ_* bits
+enum { kTxEmpty = 1, kTxFull = 2, kTxLow = 4, kTxHigh = 8 };
+
+typedef struct SimWrite
+{
+    UInt8       Buffer[kWriteBatch];
+    size_t      Count;
+    bool        Pending;
+    double      Finish;         // us, when the device has sent it
+} SimWrite;
+
+typedef struct SimResult
+{
+    double      Seconds;
+    size_t      Sent;
+    size_t      Transfers;
+    bool        Ordered;
+    bool        BusyRight;
+    bool        BitsRight;
+} SimResult;
+
+static SimResult simulate( UInt32 buffers, double latencyUS )
+{
+    static UInt8    buffer[kWriteQueue];
+    SimWrite        writes[kMaxBuffers];
+    SimResult       result;
+    CirQueue        q;
+    UInt8           chunk[700];
+    size_t          queued = 0;
+    UInt32          next = 0, inFlight = 0;
+    UInt8           expect = 0;
+    double          now = 0, lineFree = 0;
+    double          usPerByte = 10.0 * 1e6 / kWriteRate;
+    size_t          low = kWriteQueue / 3, high = (kWriteQueue * 2) / 3;
+
+    memset( &result, 0, sizeof(result) );
+    result.Ordered = result.BusyRight = result.BitsRight = true;
+    memset( writes, 0, sizeof(writes) );
+    memset( &q, 0, sizeof(q) );
+    q.Start = buffer;
+    q.End = buffer + sizeof(buffer);
+    q.Size = sizeof(buffer);
+
+    for (;;)
+    {
+        // The writer tops the queue up while it has data
+        while ( queued < kWriteBytes )
+        {
+            size_t want = 1 + (queued * 7) % sizeof(chunk);
+            if ( want > kWriteBytes - queued )
+                want = kWriteBytes - queued;
+            for ( size_t i = 0; i < want; i++ )
+                chunk[i] = (UInt8)(queued + i);
+            size_t added = copyintoQueue( &q, chunk, want );
+            queued += added;
+            if ( added < want )
+                break;
+        }
+
+        // setUpTransmit: fill the free buffers in order, straight from the queue
+        for (;;)
+        {
+            SimWrite *request = &writes[next];
+            if ( request->Pending )
+                break;
+            request->Count = copyfromQueue( &q, request->Buffer, kWriteBatch );
+            if ( !request->Count )
+                break;
+            double start = now + latencyUS > lineFree ? now + latencyUS : lineFree;
+            request->Finish = start + request->Count * usPerByte;
+            request->Pending = true;
+            lineFree = request->Finish;
+            inFlight++;
+            result.Transfers++;
+            next = (next + 1) % buffers;
+        }
+
+        UInt32 bits = queueLevelBits( q.Added - q.Removed, q.Size, low, high, kTxEmpty, kTxFull, kTxLow, kTxHigh );
+        if ( (q.Added == q.Removed) != ((bits & kTxEmpty) != 0) )
+            result.BitsRight = false;
+        if ( !inFlight )
+            break;
+
+        // dataWriteComplete for the oldest one, the device sends them in order
+        SimWrite *done = NULL;
+        for ( UInt32 i = 0; i < buffers; i++ )
+            if ( writes[i].Pending && (!done || writes[i].Finish < done->Finish) )
+                done = &writes[i];
+        now = done->Finish;
+        for ( size_t i = 0; i < done->Count; i++ )
+            if ( done->Buffer[i] != expect++ )
+                result.Ordered = false;
+        result.Sent += done->Count;
+        done->Pending = false;
+        bool busy = (--inFlight != 0);
+
+        // TX busy means some buffer is still on the bus
+        bool onBus = false;
+        for ( UInt32 i = 0; i < buffers; i++ )
+            onBus |= writes[i].Pending;
+        if ( busy != onBus )
+            result.BusyRight = false;
+    }
+
+    // Drained: empty and below low water, nothing busy
+    UInt32 bits = queueLevelBits( q.Added - q.Removed, q.Size, low, high, kTxEmpty, kTxFull, kTxLow, kTxHigh );
+    if ( bits != (kTxEmpty | kTxLow) )
+        result.BitsRight = false;
+    result.Seconds = now / 1e6;
+    return result;
+}
+
+static void testPipeline( void )
+{
+    double      line = kWriteRate / 10.0;
+    double      rate[kMaxBuffers + 1];
+
+    for ( UInt32 buffers = 1; buffers <= kMaxBuffers; buffers++ )
+    {
+        SimResult r = simulate( buffers, 2000 );
+        CHECK( r.Ordered );
+        CHECK( r.BusyRight );
+        CHECK( r.BitsRight );
+        CHECK_EQ( r.Sent, kWriteBytes );
+        rate[buffers] = r.Sent / r.Seconds;
+    }
+
+    // One buffer idles the line for the latency after every transfer, two keep it busy
+    CHECK( rate[1] < 0.8 * line );
+    CHECK( rate[2] > 0.99 * line );
+    CHECK( rate[kMaxBuffers] > 0.99 * line );
+
+    // Without latency one buffer is as good as any
+    SimResult r = simulate( 1, 0 );
+    CHECK( r.Sent / r.Seconds > 0.99 * line );
+}
+
+static void testQueueBits( void )
+{
+    CHECK_EQ( queueLevelBits( 0, 100, 30, 60, kTxEmpty, kTxFull, kTxLow, kTxHigh ), kTxEmpty | kTxLow );
+    CHECK_EQ( queueLevelBits( 30, 100, 30, 60, kTxEmpty, kTxFull, kTxLow, kTxHigh ), 0 );
+    CHECK_EQ( queueLevelBits( 60, 100, 30, 60, kTxEmpty, kTxFull, kTxLow, kTxHigh ), 0 );
+    CHECK_EQ( queueLevelBits( 61, 100, 30, 60, kTxEmpty, kTxFull, kTxLow, kTxHigh ), kTxHigh );
+    CHECK_EQ( queueLevelBits( 100, 100, 30, 60, kTxEmpty, kTxFull, kTxLow, kTxHigh ), kTxFull | kTxHigh );
+}
+
+static void testWriteHold( void )
+{
+    CHECK( writeHold( 500, false, false, 1, 64, 100 ) );
+    CHECK( !writeHold( 0, false, false, 1, 64, 100 ) );        // no window
+    CHECK( !writeHold( 500, true, false, 1, 64, 100 ) );       // MinLatency
+    CHECK( !writeHold( 500, false, true, 1, 64, 100 ) );       // flushing
+    CHECK( !writeHold( 500, false, false, 64, 64, 100 ) );     // threshold reached
+    CHECK( !writeHold( 500, false, false, 50, 64, 40 ) );      // above high water
+}
+
+int main( void )
+{
+    testQueueBits();
+    testWriteHold();
+    testPipeline();
+
+    return testResult( "test_writes" );
+}